@@ -0,0 +1,774 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/* guid-bench-agent - synthetic GUI agent running one benchmark scenario
+ * against qubes-guid and printing the result as a JSON object.
+ *
+ * Both programs are expected to run in the same Xen domain (see
+ * run-perf.sh): window contents are shared with qubes-guid using grant
+ * references to our own domain, and scenarios that need to poke the X server
+ * (expose storms, input injection) open their own connection to $DISPLAY.
+ *
+ * Completion of asynchronous work is detected with "fences":
+ *  - a window dump of a small fence window is acknowledged only after
+ *    qubes-guid synced with the X server, so all previous messages were
+ *    handled and drawn;
+ *  - a synthetic pointer motion is reported back only after qubes-guid
+ *    processed all X events queued before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/stat.h>
+#include <xengnttab.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <qubes-gui-protocol.h>
+#include "vchan-agent.h"
+
+#define PROTOCOL_VERSION ((QUBES_GUID_PROTOCOL_VERSION_MAJOR << 16) | \
+                          QUBES_GUID_PROTOCOL_VERSION_MINOR)
+
+struct bench_window {
+    uint32_t id;
+    uint32_t width, height;
+    uint32_t pages;
+    uint32_t *refs;
+    void *fb;
+};
+
+struct bench {
+    struct vchan_agent agent;
+    int guid_domid;
+    xengntshr_handle *xgs;
+    uint32_t next_id;
+    struct bench_window fence;
+    /* parsing of the qubes-guid -> agent stream */
+    size_t preamble;    /* protocol version and xconf still to skip */
+    size_t skip;        /* body of the current message */
+    size_t hdr_len;
+    struct msg_hdr hdr;
+    uint64_t acks;      /* MSG_WINDOW_DUMP_ACK received */
+    uint64_t motions;   /* MSG_MOTION received */
+    uint64_t keys;      /* MSG_KEYPRESS received */
+    uint64_t destroys;  /* MSG_DESTROY received */
+    int64_t last_received_ns;
+    /* local X server connection, only for some scenarios */
+    Display *dpy;
+    /* qubes-guid statistics */
+    pid_t guid_pid;
+    const char *guid_stats_file;
+    /* qubes-guid configuration label, included in the output */
+    const char *variant;
+};
+
+static void on_receive(struct vchan_agent *a, const char *buf, size_t len)
+{
+    struct bench *b = a->priv;
+
+    while (len > 0) {
+        size_t n;
+        if (b->preamble || b->skip) {
+            size_t *left = b->preamble ? &b->preamble : &b->skip;
+            n = len < *left ? len : *left;
+            *left -= n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+        n = sizeof(b->hdr) - b->hdr_len;
+        if (n > len)
+            n = len;
+        memcpy((char *)&b->hdr + b->hdr_len, buf, n);
+        b->hdr_len += n;
+        buf += n;
+        len -= n;
+        if (b->hdr_len < sizeof(b->hdr))
+            continue;
+        b->hdr_len = 0;
+        b->skip = b->hdr.untrusted_len;
+        b->last_received_ns = bench_now_ns();
+        switch (b->hdr.type) {
+        case MSG_WINDOW_DUMP_ACK:
+            b->acks++;
+            break;
+        case MSG_MOTION:
+            b->motions++;
+            break;
+        case MSG_KEYPRESS:
+            b->keys++;
+            break;
+        case MSG_DESTROY:
+            b->destroys++;
+            break;
+        }
+    }
+}
+
+static void send_msg(struct bench *b, uint32_t type, uint32_t window,
+        const void *body, size_t len)
+{
+    struct msg_hdr hdr = { .type = type, .window = window, .untrusted_len = len };
+
+    vchan_agent_write(&b->agent, &hdr, sizeof(hdr));
+    if (len)
+        vchan_agent_write(&b->agent, body, len);
+}
+
+static void window_create(struct bench *b, struct bench_window *w,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    struct msg_create crt = {
+        .x = x, .y = y, .width = width, .height = height,
+        .parent = 0, .override_redirect = 0,
+    };
+
+    memset(w, 0, sizeof(*w));
+    w->id = b->next_id++;
+    w->width = width;
+    w->height = height;
+    send_msg(b, MSG_CREATE, w->id, &crt, sizeof(crt));
+}
+
+static void window_map(struct bench *b, struct bench_window *w)
+{
+    struct msg_map_info info = { .transient_for = 0, .override_redirect = 0 };
+
+    send_msg(b, MSG_MAP, w->id, &info, sizeof(info));
+}
+
+/* share (once) and send window contents */
+static void window_dump(struct bench *b, struct bench_window *w)
+{
+    struct msg_window_dump_hdr wd = {
+        .type = WINDOW_DUMP_TYPE_GRANT_REFS,
+        .width = w->width,
+        .height = w->height,
+        .bpp = 24,
+    };
+    struct msg_hdr hdr;
+
+    if (!w->fb) {
+        w->pages = NUM_PAGES(w->width * w->height * 4);
+        if (!(w->refs = calloc(w->pages, sizeof(*w->refs))))
+            err(1, "calloc");
+        w->fb = xengntshr_share_pages(b->xgs, b->guid_domid, w->pages,
+                w->refs, 1);
+        if (!w->fb)
+            err(1, "xengntshr_share_pages(%u pages)", w->pages);
+        memset(w->fb, 0x80, (size_t)w->pages * 4096);
+    }
+    hdr.type = MSG_WINDOW_DUMP;
+    hdr.window = w->id;
+    hdr.untrusted_len = MSG_WINDOW_DUMP_HDR_LEN + w->pages * SIZEOF_GRANT_REF;
+    vchan_agent_write(&b->agent, &hdr, sizeof(hdr));
+    vchan_agent_write(&b->agent, &wd, MSG_WINDOW_DUMP_HDR_LEN);
+    vchan_agent_write(&b->agent, w->refs, w->pages * SIZEOF_GRANT_REF);
+}
+
+static void window_shmimage(struct bench *b, struct bench_window *w,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    struct msg_shmimage img = { .x = x, .y = y, .width = width, .height = height };
+
+    send_msg(b, MSG_SHMIMAGE, w->id, &img, sizeof(img));
+}
+
+static void window_destroy(struct bench *b, struct bench_window *w)
+{
+    send_msg(b, MSG_DESTROY, w->id, NULL, 0);
+    if (w->fb) {
+        /* qubes-guid may still have it mapped, the grants are released
+         * when it unmaps them */
+        xengntshr_unshare(b->xgs, w->fb, w->pages);
+        free(w->refs);
+        w->fb = NULL;
+    }
+}
+
+/* wait until qubes-guid handled everything sent so far */
+static void fence(struct bench *b)
+{
+    uint64_t acks = b->acks;
+
+    window_dump(b, &b->fence);
+    while (b->acks == acks)
+        vchan_agent_poll(&b->agent, 1000);
+}
+
+static void bench_connect(struct bench *b)
+{
+    uint32_t version = PROTOCOL_VERSION;
+
+    b->agent.on_receive = on_receive;
+    b->agent.priv = b;
+    b->preamble = sizeof(uint32_t) + sizeof(struct msg_xconf);
+    b->next_id = 1;
+    if (!(b->xgs = xengntshr_open(NULL, 0)))
+        err(1, "xengntshr_open");
+    vchan_agent_listen(&b->agent, b->guid_domid);
+    vchan_agent_write(&b->agent, &version, sizeof(version));
+    /* 1x1 fence window, never mapped */
+    window_create(b, &b->fence, 0, 0, 1, 1);
+    fence(b);
+}
+
+static void open_display(struct bench *b)
+{
+    int ev, er, major, minor;
+
+    if (!(b->dpy = XOpenDisplay(NULL)))
+        errx(1, "cannot open display");
+    if (!XTestQueryExtension(b->dpy, &ev, &er, &major, &minor))
+        errx(1, "XTEST extension not available");
+}
+
+/* find window created by qubes-guid for given VM window */
+static Window find_local_window(struct bench *b, uint32_t remote_id)
+{
+    Atom vmwindowid = XInternAtom(b->dpy, "_QUBES_VMWINDOWID", False);
+    Window root, parent, *children, found = None;
+    unsigned int i, n;
+
+    if (!XQueryTree(b->dpy, DefaultRootWindow(b->dpy), &root, &parent,
+                &children, &n))
+        errx(1, "XQueryTree failed");
+    for (i = 0; i < n && found == None; i++) {
+        Atom type;
+        int format;
+        unsigned long nitems, after;
+        unsigned char *data = NULL;
+
+        if (XGetWindowProperty(b->dpy, children[i], vmwindowid, 0, 1, False,
+                    XA_WINDOW, &type, &format, &nitems, &after, &data) == Success &&
+                nitems == 1 && *(unsigned long *)data == remote_id)
+            found = children[i];
+        if (data)
+            XFree(data);
+    }
+    XFree(children);
+    if (found == None)
+        errx(1, "window 0x%x not found on the X server", remote_id);
+    return found;
+}
+
+/* window position on the screen */
+static void local_window_origin(struct bench *b, Window w, int *x, int *y)
+{
+    Window child;
+
+    XTranslateCoordinates(b->dpy, w, DefaultRootWindow(b->dpy), 0, 0, x, y, &child);
+}
+
+/* move the pointer and wait until qubes-guid reports the motion; returns
+ * the latency in ns */
+static int64_t motion_fence(struct bench *b, int x, int y)
+{
+    uint64_t motions = b->motions;
+    int64_t start = bench_now_ns();
+
+    XTestFakeMotionEvent(b->dpy, -1, x, y, CurrentTime);
+    XFlush(b->dpy);
+    while (b->motions == motions)
+        vchan_agent_poll(&b->agent, 1000);
+    return b->last_received_ns - start;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, int64_t *samples, int n)
+{
+    qsort(samples, n, sizeof(*samples), cmp_int64);
+    printf("\"%s\":{\"samples\":%d,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+            "\"p99_us\":%.1f,\"max_us\":%.1f}",
+            name, n, samples[n / 2] / 1e3, samples[n * 9 / 10] / 1e3,
+            samples[n * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
+
+/* ask qubes-guid to dump its statistics and print them as "guid" member */
+static void print_guid_stats(struct bench *b)
+{
+    struct stat st;
+    struct timespec before = { 0, 0 };
+    char buf[65536];
+    size_t len;
+    FILE *f;
+    int i;
+
+    if (!b->guid_pid)
+        return;
+    if (stat(b->guid_stats_file, &st) == 0)
+        before = st.st_mtim;
+    if (kill(b->guid_pid, SIGUSR2) < 0)
+        err(1, "kill(%d, SIGUSR2)", (int)b->guid_pid);
+    for (i = 0; i < 500; i++) {
+        if (stat(b->guid_stats_file, &st) == 0 &&
+                (st.st_mtim.tv_sec != before.tv_sec ||
+                 st.st_mtim.tv_nsec != before.tv_nsec))
+            break;
+        usleep(10000);
+    }
+    if (i == 500 || !(f = fopen(b->guid_stats_file, "r"))) {
+        warnx("no statistics from qubes-guid");
+        return;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    while (len > 0 && buf[len - 1] == '\n')
+        len--;
+    buf[len] = '\0';
+    printf(",\"guid\":%s", buf);
+}
+
+/* full-window updates, as fast as qubes-guid and X server can take them */
+static void scenario_shm(struct bench *b, const char *name,
+        uint32_t width, uint32_t height, double duration)
+{
+    struct bench_window w;
+    uint64_t frames = 0;
+    int64_t start, end, deadline;
+
+    window_create(b, &w, 0, 0, width, height);
+    window_map(b, &w);
+    window_dump(b, &w);
+    fence(b);
+    start = bench_now_ns();
+    deadline = start + duration * 1e9;
+    do {
+        window_shmimage(b, &w, 0, 0, width, height);
+        frames++;
+    } while ((frames % 16) || bench_now_ns() < deadline);
+    fence(b);
+    end = bench_now_ns();
+    printf("{\"scenario\":\"%s\",\"width\":%u,\"height\":%u,\"frames\":%" PRIu64
+            ",\"seconds\":%.3f,\"frames_per_s\":%.1f,\"mpixels_per_s\":%.1f",
+            name, width, height, frames, (end - start) / 1e9,
+            frames * 1e9 / (end - start),
+            (double)frames * width * height * 1e3 / (end - start));
+    print_guid_stats(b);
+    printf("}\n");
+    window_destroy(b, &w);
+}
+
+/* many small damaged rectangles spread over a 1080p window */
+static void scenario_small_rects(struct bench *b, double duration)
+{
+    const uint32_t width = 1920, height = 1080, rect = 32;
+    struct bench_window w;
+    uint64_t rects = 0;
+    uint32_t seed = 1;
+    int64_t start, end, deadline;
+
+    window_create(b, &w, 0, 0, width, height);
+    window_map(b, &w);
+    window_dump(b, &w);
+    fence(b);
+    start = bench_now_ns();
+    deadline = start + duration * 1e9;
+    do {
+        /* deterministic pseudo-random positions */
+        seed = seed * 1103515245 + 12345;
+        uint32_t x = (seed >> 8) % (width - rect);
+        seed = seed * 1103515245 + 12345;
+        uint32_t y = (seed >> 8) % (height - rect);
+        window_shmimage(b, &w, x, y, rect, rect);
+        rects++;
+    } while ((rects % 256) || bench_now_ns() < deadline);
+    fence(b);
+    end = bench_now_ns();
+    printf("{\"scenario\":\"small-rects\",\"rect_size\":%u,\"rects\":%" PRIu64
+            ",\"seconds\":%.3f,\"rects_per_s\":%.1f",
+            rect, rects, (end - start) / 1e9, rects * 1e9 / (end - start));
+    print_guid_stats(b);
+    printf("}\n");
+    window_destroy(b, &w);
+}
+
+/* create, map and destroy many windows */
+static void scenario_windows(struct bench *b, int count)
+{
+    struct bench_window *w;
+    int64_t t0, t1, t2, t3;
+    int i;
+
+    if (!(w = calloc(count, sizeof(*w))))
+        err(1, "calloc");
+    t0 = bench_now_ns();
+    for (i = 0; i < count; i++)
+        window_create(b, &w[i], (i * 17) % 1600, (i * 13) % 800, 300, 200);
+    fence(b);
+    t1 = bench_now_ns();
+    for (i = 0; i < count; i++)
+        window_map(b, &w[i]);
+    fence(b);
+    t2 = bench_now_ns();
+    for (i = 0; i < count; i++)
+        window_destroy(b, &w[i]);
+    fence(b);
+    t3 = bench_now_ns();
+    printf("{\"scenario\":\"windows\",\"windows\":%d,"
+            "\"create_per_s\":%.1f,\"map_per_s\":%.1f,\"destroy_per_s\":%.1f",
+            count, count * 1e9 / (t1 - t0), count * 1e9 / (t2 - t1),
+            count * 1e9 / (t3 - t2));
+    print_guid_stats(b);
+    printf("}\n");
+    free(w);
+}
+
+/* repeatedly cover and uncover a 1080p window, forcing qubes-guid to
+ * repaint it on each Expose */
+static void scenario_expose_storm(struct bench *b, int count)
+{
+    const uint32_t width = 1920, height = 1080;
+    struct bench_window w;
+    XSetWindowAttributes attr = { .override_redirect = True };
+    Window local, cover;
+    int64_t start, end;
+    int x, y, i;
+
+    open_display(b);
+    window_create(b, &w, 0, 0, width, height);
+    window_map(b, &w);
+    window_dump(b, &w);
+    fence(b);
+    local = find_local_window(b, w.id);
+    local_window_origin(b, local, &x, &y);
+    cover = XCreateWindow(b->dpy, DefaultRootWindow(b->dpy), x, y, width,
+            height, 0, CopyFromParent, InputOutput, CopyFromParent,
+            CWOverrideRedirect, &attr);
+    motion_fence(b, x + 10, y + 10);
+    start = bench_now_ns();
+    for (i = 0; i < count; i++) {
+        XMapRaised(b->dpy, cover);
+        XUnmapWindow(b->dpy, cover);
+    }
+    /* pointer motion is queued after all the Expose events */
+    motion_fence(b, x + 20, y + 20);
+    end = bench_now_ns();
+    printf("{\"scenario\":\"expose-storm\",\"exposes\":%d,\"seconds\":%.3f,"
+            "\"exposes_per_s\":%.1f",
+            count, (end - start) / 1e9, count * 1e9 / (end - start));
+    print_guid_stats(b);
+    printf("}\n");
+    XDestroyWindow(b->dpy, cover);
+    XSync(b->dpy, False);
+    window_destroy(b, &w);
+}
+
+/* time from injecting an input event to the X server until the matching
+ * message arrives on the vchan */
+static void scenario_input_latency(struct bench *b, int count)
+{
+    struct bench_window w;
+    int64_t *motion, *key;
+    Window local;
+    KeyCode keycode;
+    int x, y, i;
+
+    if (!(motion = calloc(count, sizeof(*motion))) ||
+            !(key = calloc(count, sizeof(*key))))
+        err(1, "calloc");
+    open_display(b);
+    window_create(b, &w, 0, 0, 640, 480);
+    window_map(b, &w);
+    window_dump(b, &w);
+    fence(b);
+    local = find_local_window(b, w.id);
+    local_window_origin(b, local, &x, &y);
+    XSetInputFocus(b->dpy, local, RevertToParent, CurrentTime);
+    keycode = XKeysymToKeycode(b->dpy, XK_a);
+    motion_fence(b, x + 1, y + 1);
+    for (i = 0; i < count; i++)
+        motion[i] = motion_fence(b, x + 10 + (i % 2) * 10, y + 10);
+    for (i = 0; i < count; i++) {
+        uint64_t keys = b->keys;
+        int64_t start = bench_now_ns();
+
+        XTestFakeKeyEvent(b->dpy, keycode, i % 2 == 0, CurrentTime);
+        XFlush(b->dpy);
+        while (b->keys == keys)
+            vchan_agent_poll(&b->agent, 1000);
+        key[i] = b->last_received_ns - start;
+    }
+    printf("{\"scenario\":\"input-latency\",");
+    print_latency("motion", motion, count);
+    printf(",");
+    print_latency("key", key, count);
+    print_guid_stats(b);
+    printf("}\n");
+    window_destroy(b, &w);
+    free(motion);
+    free(key);
+}
+
+/* tray icon updates; with changing content each update is different (up to
+ * 64 distinct frames), otherwise the same icon is sent again and again */
+static void scenario_tray(struct bench *b, const char *name, bool changing,
+        double duration)
+{
+    const uint32_t size = 32, frames_count = 64;
+    struct bench_window w;
+    uint32_t *fb;
+    uint64_t updates = 0;
+    int64_t start, end, deadline;
+    uint32_t i;
+
+    window_create(b, &w, 0, 0, size, size);
+    send_msg(b, MSG_DOCK, w.id, NULL, 0);
+    window_dump(b, &w);
+    fence(b);
+    fb = w.fb;
+    start = bench_now_ns();
+    deadline = start + duration * 1e9;
+    do {
+        if (changing || updates == 0) {
+            /* background in the corner, moving colored bar */
+            uint32_t frame = updates % frames_count;
+            for (i = 0; i < size * size; i++)
+                fb[i] = (i % size == frame % size) ? 0x2060c0 + frame :
+                        (i / size > 8 ? 0x808080 : 0xffffff);
+        }
+        window_shmimage(b, &w, 0, 0, size, size);
+        updates++;
+        /* icon updates are small, do not let them queue up too much */
+        if (updates % 64 == 0)
+            fence(b);
+    } while ((updates % 64) || bench_now_ns() < deadline);
+    end = bench_now_ns();
+    printf("{\"scenario\":\"%s\",", name);
+    if (b->variant)
+        printf("\"variant\":\"%s\",", b->variant);
+    printf("\"size\":%u,\"updates\":%" PRIu64 ",\"seconds\":%.3f,"
+            "\"updates_per_s\":%.1f",
+            size, updates, (end - start) / 1e9, updates * 1e9 / (end - start));
+    print_guid_stats(b);
+    printf("}\n");
+    window_destroy(b, &w);
+}
+
+/* CPU time (ms) and resident memory (kB) of qubes-guid, -1 if unknown */
+static void guid_usage(struct bench *b, double *cpu_ms, long *rss_kb)
+{
+    char path[64], line[256];
+    unsigned long utime, stime;
+    FILE *f;
+
+    *cpu_ms = -1;
+    *rss_kb = -1;
+    if (!b->guid_pid)
+        return;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)b->guid_pid);
+    if ((f = fopen(path, "r"))) {
+        /* fields 14 and 15, after the command name in parentheses */
+        if (fgets(line, sizeof(line), f) && strrchr(line, ')') &&
+                sscanf(strrchr(line, ')') + 2,
+                    "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                    &utime, &stime) == 2)
+            *cpu_ms = (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)b->guid_pid);
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "VmRSS: %ld", rss_kb) == 1)
+                break;
+        fclose(f);
+    }
+}
+
+/* desktop activity unrelated to a VM without windows (root window property
+ * changes, another window moved), which its qubes-guid should not process */
+static void scenario_idle_root(struct bench *b, int count)
+{
+    XSetWindowAttributes attr = { .override_redirect = True };
+    Window root, other;
+    Atom prop;
+    double cpu_before, cpu_after;
+    long rss, value;
+    int64_t start, end;
+    uint64_t destroys = b->destroys;
+    int i;
+
+    open_display(b);
+    root = DefaultRootWindow(b->dpy);
+    prop = XInternAtom(b->dpy, "_QUBES_BENCH_IDLE", False);
+    other = XCreateWindow(b->dpy, root, 0, 0, 100, 100, 0, CopyFromParent,
+            InputOutput, CopyFromParent, CWOverrideRedirect, &attr);
+    XMapWindow(b->dpy, other);
+    /* the fence window is the only one, wait until it is gone */
+    window_destroy(b, &b->fence);
+    while (b->destroys == destroys)
+        vchan_agent_poll(&b->agent, 1000);
+    guid_usage(b, &cpu_before, &rss);
+    start = bench_now_ns();
+    for (i = 0; i < count; i++) {
+        value = i;
+        XChangeProperty(b->dpy, root, prop, XA_CARDINAL, 32, PropModeReplace,
+                (unsigned char *)&value, 1);
+        XMoveWindow(b->dpy, other, i % 100, i % 100);
+    }
+    XSync(b->dpy, False);
+    end = bench_now_ns();
+    /* a new fence window; everything queued before it is handled once it
+     * is acknowledged */
+    window_create(b, &b->fence, 0, 0, 1, 1);
+    fence(b);
+    guid_usage(b, &cpu_after, &rss);
+    printf("{\"scenario\":\"idle-root\",\"changes\":%d,\"seconds\":%.3f",
+            count, (end - start) / 1e9);
+    if (cpu_before >= 0 && cpu_after >= 0)
+        printf(",\"guid_cpu_ms\":%.1f", cpu_after - cpu_before);
+    if (rss >= 0)
+        printf(",\"guid_rss_kb\":%ld", rss);
+    print_guid_stats(b);
+    printf("}\n");
+    XDeleteProperty(b->dpy, root, prop);
+    XDestroyWindow(b->dpy, other);
+    XSync(b->dpy, False);
+}
+
+/* qubes-guid startup: nothing to do once connected, its statistics hold
+ * the time to each startup phase (e.g. x_connect, including the per-display
+ * setup in mkghandles()) */
+static void scenario_startup(struct bench *b)
+{
+    printf("{\"scenario\":\"startup\"");
+    print_guid_stats(b);
+    printf("}\n");
+}
+
+static void usage(FILE *stream)
+{
+    fprintf(stream, "Usage: guid-bench-agent [options] SCENARIO\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream, " --domid=ID, -d ID\tdomain ID running qubes-guid (required)\n");
+    fprintf(stream, " --duration=SECONDS, -t SECONDS\tduration of throughput scenarios (default: 5)\n");
+    fprintf(stream, " --count=N, -n N\tnumber of windows, exposes, input events or root changes (default: 500)\n");
+    fprintf(stream, " --stats-pid=PID\tqubes-guid process to collect statistics from\n");
+    fprintf(stream, " --stats-file=PATH\tstatistics file of that process\n");
+    fprintf(stream, " --variant=LABEL\tqubes-guid configuration label to include in the output\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Scenarios:\n");
+    fprintf(stream, "  shm-1080p, shm-4k\tfull-window updates\n");
+    fprintf(stream, "  small-rects\tmany 32x32 updates\n");
+    fprintf(stream, "  windows\tcreate, map and destroy N windows\n");
+    fprintf(stream, "  expose-storm\tcover and uncover a window N times\n");
+    fprintf(stream, "  input-latency\tX input event to vchan message latency\n");
+    fprintf(stream, "  tray, tray-static\ttray icon updates with changing or the same content\n");
+    fprintf(stream, "  idle-root\tN root property changes and window moves, with no VM window\n");
+    fprintf(stream, "  startup\tqubes-guid startup phases (run with a fresh qubes-guid)\n");
+}
+
+static struct option longopts[] = {
+    { "domid", required_argument, NULL, 'd' },
+    { "duration", required_argument, NULL, 't' },
+    { "count", required_argument, NULL, 'n' },
+    { "stats-pid", required_argument, NULL, 'P' },
+    { "stats-file", required_argument, NULL, 'F' },
+    { "variant", required_argument, NULL, 'V' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+    struct bench b = { .guid_domid = -1 };
+    double duration = 5;
+    int count = 500;
+    const char *scenario;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:t:n:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            b.guid_domid = atoi(optarg);
+            break;
+        case 't':
+            duration = strtod(optarg, NULL);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'P':
+            b.guid_pid = atoi(optarg);
+            break;
+        case 'F':
+            b.guid_stats_file = optarg;
+            break;
+        case 'V':
+            b.variant = optarg;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || b.guid_domid < 0 || count <= 0 || duration <= 0) {
+        usage(stderr);
+        exit(1);
+    }
+    if (b.guid_pid && !b.guid_stats_file)
+        errx(1, "--stats-pid requires --stats-file");
+    scenario = argv[optind];
+
+    bench_connect(&b);
+    if (!strcmp(scenario, "shm-1080p"))
+        scenario_shm(&b, scenario, 1920, 1080, duration);
+    else if (!strcmp(scenario, "shm-4k"))
+        scenario_shm(&b, scenario, 3840, 2160, duration);
+    else if (!strcmp(scenario, "small-rects"))
+        scenario_small_rects(&b, duration);
+    else if (!strcmp(scenario, "windows"))
+        scenario_windows(&b, count);
+    else if (!strcmp(scenario, "expose-storm"))
+        scenario_expose_storm(&b, count);
+    else if (!strcmp(scenario, "input-latency"))
+        scenario_input_latency(&b, count);
+    else if (!strcmp(scenario, "tray"))
+        scenario_tray(&b, scenario, true, duration);
+    else if (!strcmp(scenario, "tray-static"))
+        scenario_tray(&b, scenario, false, duration);
+    else if (!strcmp(scenario, "idle-root"))
+        scenario_idle_root(&b, count);
+    else if (!strcmp(scenario, "startup"))
+        scenario_startup(&b);
+    else
+        errx(1, "unknown scenario '%s'", scenario);
+    fflush(stdout);
+    libvchan_close(b.agent.vchan);
+    return 0;
+}
@@ -0,0 +1,710 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/* guid-microbench - microbenchmarks of the pure hot path helpers of qubes-guid
+ * (gui-daemon/hotpath.c), printing one JSON object per benchmark.
+ *
+ * Cycles are read with RDTSC where available, so they count reference
+ * (nominal frequency) cycles, not core cycles; pin the process and disable
+ * frequency scaling for stable numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <err.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "hotpath.h"
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t cycles_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* prevent the compiler from dropping benchmarked calls */
+static volatile uint64_t sink;
+
+struct bench_result {
+    const char *name;
+    uint64_t ops;       /* function calls */
+    uint64_t units;     /* pixels or bytes processed */
+    const char *unit;   /* "pixel", "byte" or NULL */
+    int64_t ns;
+    uint64_t cycles;
+};
+
+static void print_result(const struct bench_result *r)
+{
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f",
+            r->name, (unsigned long long)r->ops, (double)r->ns / r->ops);
+    if (r->cycles)
+        printf(",\"cycles_per_op\":%.2f", (double)r->cycles / r->ops);
+    if (r->unit) {
+        printf(",\"ns_per_%s\":%.3f", r->unit, (double)r->ns / r->units);
+        if (r->cycles)
+            printf(",\"cycles_per_%s\":%.3f", r->unit,
+                    (double)r->cycles / r->units);
+    }
+    printf("}\n");
+}
+
+#define BENCH_START(r) do { \
+        (r)->ns = now_ns(); \
+        (r)->cycles = cycles_now(); \
+    } while (0)
+#define BENCH_END(r) do { \
+        (r)->cycles = cycles_now() - (r)->cycles; \
+        (r)->ns = now_ns() - (r)->ns; \
+    } while (0)
+
+/* deterministic pseudo-random numbers */
+static uint32_t xorshift_state = 2463534242u;
+static uint32_t xorshift32(void)
+{
+    uint32_t x = xorshift_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return xorshift_state = x;
+}
+
+#define RECTS 4096
+
+static void bench_shm_clip(const char *name, const struct shm_clip_geometry *geo,
+        uint64_t iterations)
+{
+    static int rects[RECTS][4];
+    struct bench_result r = { .name = name, .ops = iterations };
+    uint64_t i, acc = 0;
+
+    /* mix of rectangles inside, crossing the frame and outside the window */
+    for (i = 0; i < RECTS; i++) {
+        rects[i][0] = xorshift32() % (geo->win_width + 64);
+        rects[i][1] = xorshift32() % (geo->win_height + 64);
+        rects[i][2] = xorshift32() % 512;
+        rects[i][3] = xorshift32() % 512;
+    }
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++) {
+        int *rect = rects[i % RECTS];
+        int x = rect[0], y = rect[1], w = rect[2], h = rect[3];
+        bool do_border;
+
+        acc += shm_update_clip(geo, &x, &y, &w, &h, &do_border) + w + do_border;
+    }
+    BENCH_END(&r);
+    sink += acc;
+    print_result(&r);
+}
+
+static void bench_sanitize(const char *name,
+        void (*sanitize)(unsigned char *, int), const char *sample,
+        int allow_utf8, uint64_t iterations)
+{
+    /* same size as msg_wmname.data */
+    unsigned char buf[128];
+    struct bench_result r = {
+        .name = name, .ops = iterations, .unit = "byte",
+    };
+    size_t len = strlen(sample);
+    uint64_t i;
+
+    if (len >= sizeof(buf))
+        errx(1, "sample too long");
+    r.units = iterations * len;
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++) {
+        /* the string is modified in place, restore it each time */
+        memcpy(buf, sample, len + 1);
+        sanitize(buf, allow_utf8);
+        sink += buf[len - 1];
+    }
+    BENCH_END(&r);
+    print_result(&r);
+}
+
+static void bench_utf8_char(uint64_t iterations)
+{
+    /* 2, 3 and 4 bytes sequences, and an invalid one */
+    static unsigned char chars[][5] = {
+        "\xc5\xbc", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\xa0\x80",
+    };
+    struct bench_result r = { .name = "validate_utf8_char", .ops = iterations };
+    uint64_t i, acc = 0;
+
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++)
+        acc += validate_utf8_char(chars[i % 4]);
+    BENCH_END(&r);
+    sink += acc;
+    print_result(&r);
+}
+
+/* run both sanitize_string_from_vm() implementations on buf (of len bytes,
+ * plus the terminating NUL) in both modes, return number of mismatches */
+static uint64_t sanitize_compare(const unsigned char *buf, size_t len)
+{
+    unsigned char ref[64], out[64];
+    uint64_t wrong = 0;
+    int allow_utf8;
+
+    for (allow_utf8 = 0; allow_utf8 < 2; allow_utf8++) {
+        memcpy(ref, buf, len + 1);
+        memcpy(out, buf, len + 1);
+        sanitize_string_from_vm_scalar(ref, allow_utf8);
+        sanitize_string_from_vm(out, allow_utf8);
+        if (memcmp(ref, out, len + 1))
+            wrong++;
+    }
+    return wrong;
+}
+
+/* compare sanitize_string_from_vm() with the byte by byte implementation:
+ * all 3 byte sequences across a 16 byte block boundary, 4 byte sequences of
+ * bytes at the UTF-8 range boundaries at various positions, and random
+ * strings */
+static bool check_sanitize(void)
+{
+    static const unsigned char edges[] = {
+        0x01, 0x1F, 0x20, 'a', 0x7E, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF,
+        0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF1,
+        0xF3, 0xF4, 0xF5, 0xFF,
+    };
+    const size_t n_edges = sizeof(edges);
+    /* around the first block boundary, negative from the end */
+    static const int positions[] = { 0, 12, 13, 14, 15, 16, -4 };
+    unsigned char buf[64];
+    uint64_t wrong = 0, strings = 0;
+    size_t a, b, c, d, len, pos;
+    int i;
+
+    memset(buf, 'x', sizeof(buf));
+    len = 20;
+    buf[len] = 0;
+    for (a = 1; a < 256; a++)
+        for (b = 1; b < 256; b++)
+            for (c = 1; c < 256; c++) {
+                buf[14] = a;
+                buf[15] = b;
+                buf[16] = c;
+                wrong += sanitize_compare(buf, len);
+                strings++;
+            }
+    for (len = 4; len <= 40; len += 12) {
+        for (i = 0; i < (int)(sizeof(positions) / sizeof(positions[0])); i++) {
+            pos = positions[i] < 0 ? len + positions[i] : (size_t)positions[i];
+            if (pos + 4 > len)
+                continue;
+            memset(buf, 'x', len);
+            buf[len] = 0;
+            for (a = 0; a < n_edges; a++)
+                for (b = 0; b < n_edges; b++)
+                    for (c = 0; c < n_edges; c++)
+                        for (d = 0; d < n_edges; d++) {
+                            buf[pos] = edges[a];
+                            buf[pos + 1] = edges[b];
+                            buf[pos + 2] = edges[c];
+                            buf[pos + 3] = edges[d];
+                            wrong += sanitize_compare(buf, len);
+                            strings++;
+                        }
+        }
+    }
+    for (i = 0; i < 1000000; i++) {
+        len = xorshift32() % 48;
+        for (pos = 0; pos < len; pos++) {
+            uint32_t r = xorshift32();
+            /* mostly printable ASCII, some high and control bytes */
+            buf[pos] = r % 4 ? 0x20 + (r >> 8) % 0x5F : 1 + (r >> 8) % 255;
+        }
+        buf[len] = 0;
+        wrong += sanitize_compare(buf, len);
+        strings++;
+    }
+    printf("{\"check\":\"sanitize\",\"strings\":%llu,\"mismatches\":%llu}\n",
+            (unsigned long long)strings, (unsigned long long)wrong);
+    return wrong == 0;
+}
+
+/* tray icon sized image with photo-like content and some white
+ * (background) pixels */
+static uint32_t *tint_test_image(int pixels)
+{
+    uint32_t *image = malloc(pixels * sizeof(*image));
+    int p;
+
+    if (!image)
+        err(1, "malloc");
+    for (p = 0; p < pixels; p++)
+        image[p] = (p % 7 == 0) ? 0xffffff : xorshift32() & 0xffffff;
+    return image;
+}
+
+/* double precision tinting, as done before the LUT kernels */
+static void bench_tint_double(int size, uint64_t iterations)
+{
+    struct bench_result r = {
+        .name = "tint/double", .unit = "pixel",
+    };
+    int pixels = size * size;
+    uint32_t *image = tint_test_image(pixels);
+    double tint_h, tint_l, tint_s;
+    uint64_t i, acc = 0;
+    int p;
+
+    rgb_to_hls(0xcc0000, &tint_h, &tint_l, &tint_s);
+    r.ops = r.units = iterations * pixels;
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++)
+        for (p = 0; p < pixels; p++)
+            acc += tint_pixel(image[p], tint_h, tint_s, true);
+    BENCH_END(&r);
+    sink += acc;
+    free(image);
+    print_result(&r);
+}
+
+/* one kernel call per row, as done by tint_tray_and_update() */
+static void bench_tint_kernel(const char *name, tint_pixels_fn *fn,
+        int size, uint64_t iterations)
+{
+    struct bench_result r = { .name = name, .unit = "pixel" };
+    int pixels = size * size;
+    uint32_t *orig = tint_test_image(pixels);
+    uint32_t *image = malloc(pixels * sizeof(*image));
+    struct tint_lut lut;
+    double tint_h, tint_l, tint_s;
+    uint64_t i;
+    int row;
+
+    if (!image)
+        err(1, "malloc");
+    rgb_to_hls(0xcc0000, &tint_h, &tint_l, &tint_s);
+    tint_lut_init(&lut, tint_h, tint_s);
+    r.ops = iterations * size;
+    r.units = iterations * pixels;
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++) {
+        /* the image is modified in place, restore it each time */
+        memcpy(image, orig, pixels * sizeof(*image));
+        for (row = 0; row < size; row++)
+            fn(&lut, image + row * size, size, true);
+        sink += image[i % pixels];
+    }
+    BENCH_END(&r);
+    free(image);
+    free(orig);
+    print_result(&r);
+}
+
+static void bench_tint(int size, uint64_t iterations)
+{
+    bench_tint_double(size, iterations);
+    bench_tint_kernel("tint/scalar", tint_pixels_scalar, size, iterations);
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+        bench_tint_kernel("tint/sse2", tint_pixels_sse2, size, iterations);
+    if (__builtin_cpu_supports("avx2"))
+        bench_tint_kernel("tint/avx2", tint_pixels_avx2, size, iterations);
+#endif
+}
+
+/* run all tint kernels over all colors (also with a non-zero top byte) and
+ * compare them with each other and with the double precision path */
+static bool check_tint(void)
+{
+    const size_t count = 1 << 24;
+    uint32_t *ref = malloc(count * sizeof(*ref));
+    uint32_t *out = malloc(count * sizeof(*out));
+    tint_pixels_fn *kernels[3] = { tint_pixels_scalar };
+    struct tint_lut lut;
+    double tint_h, tint_l, tint_s;
+    uint64_t differing = 0;
+    int max_diff = 0, k, n = 1, whitehack;
+    bool identical = true;
+    size_t i;
+
+    if (!ref || !out)
+        err(1, "malloc");
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+        kernels[n++] = tint_pixels_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = tint_pixels_avx2;
+#endif
+    rgb_to_hls(0x3874d8, &tint_h, &tint_l, &tint_s);
+    tint_lut_init(&lut, tint_h, tint_s);
+    for (whitehack = 0; whitehack < 2; whitehack++) {
+        for (i = 0; i < count; i++)
+            ref[i] = i | (i & 0xff) << 24;
+        tint_pixels_scalar(&lut, ref, count, whitehack);
+        for (k = 1; k < n; k++) {
+            for (i = 0; i < count; i++)
+                out[i] = i | (i & 0xff) << 24;
+            kernels[k](&lut, out, count, whitehack);
+            if (memcmp(ref, out, count * sizeof(*out)))
+                identical = false;
+        }
+        for (i = 0; i < count; i++) {
+            uint32_t d = tint_pixel(i, tint_h, tint_s, whitehack);
+            int shift;
+
+            if (d == ref[i])
+                continue;
+            differing++;
+            for (shift = 0; shift < 24; shift += 8) {
+                int diff = abs((int)((d >> shift) & 0xff) -
+                               (int)((ref[i] >> shift) & 0xff));
+                if (diff > max_diff)
+                    max_diff = diff;
+            }
+        }
+    }
+    printf("{\"check\":\"tint\",\"kernels\":%d,\"kernels_identical\":%s,"
+            "\"differing_from_double\":%llu,\"max_channel_diff_from_double\":%d}\n",
+            n, identical ? "true" : "false", (unsigned long long)differing,
+            max_diff);
+    free(ref);
+    free(out);
+    return identical;
+}
+
+/* tray icon cache key */
+static void bench_hash(int size, uint64_t iterations)
+{
+    struct bench_result r = {
+        .name = "hash_image_region", .ops = iterations, .unit = "pixel",
+    };
+    uint32_t *image = tint_test_image(size * size);
+    uint64_t i, acc = 0;
+
+    r.units = iterations * size * size;
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++)
+        acc += hash_image_region((const uint8_t *)image, size * 4,
+                0, 0, size, size);
+    BENCH_END(&r);
+    sink += acc;
+    free(image);
+    print_result(&r);
+}
+
+/* TRAY_BACKGROUND mask of an icon with about half of background pixels */
+static void bench_bg_mask(int size, uint64_t iterations)
+{
+    struct bench_result r = {
+        .name = "tray_bg_mask_rows", .ops = iterations, .unit = "pixel",
+    };
+    uint32_t *image = tint_test_image(size * size);
+    uint8_t *mask = malloc(tray_bg_mask_stride(size) * size);
+    uint64_t i;
+    int p;
+
+    if (!mask)
+        err(1, "malloc");
+    for (p = 0; p < size * size; p++)
+        if (image[p] & 1)
+            image[p] = image[0];
+    r.units = iterations * size * size;
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++) {
+        tray_bg_mask_rows((const uint8_t *)image, size * 4, size, size,
+                image[0], mask);
+        sink += mask[i % size];
+    }
+    BENCH_END(&r);
+    free(mask);
+    free(image);
+    print_result(&r);
+}
+
+/* compare tray_bg_mask_rows() with a bit by bit computation, for all widths
+ * up to a few vector lengths and a mask with stale bits */
+static bool check_bg_mask(void)
+{
+    const int max_width = 40, height = 4;
+    uint32_t *image = tint_test_image(max_width * height);
+    uint8_t *mask = malloc(tray_bg_mask_stride(max_width) * height);
+    uint32_t back = 0xff123456;
+    uint64_t wrong = 0;
+    int w, x, y;
+
+    if (!mask)
+        err(1, "malloc");
+    for (x = 0; x < max_width * height; x++)
+        if (image[x] & 1)
+            /* only the top byte differs */
+            image[x] = back ^ 0xff000000;
+    for (w = 1; w <= max_width; w++) {
+        size_t mask_stride = tray_bg_mask_stride(w);
+
+        memset(mask, 0x5a, mask_stride * height);
+        tray_bg_mask_rows((const uint8_t *)image, max_width * 4, w, height,
+                back, mask);
+        for (y = 0; y < height; y++)
+            for (x = 0; x < w; x++) {
+                bool expected = (image[y * max_width + x] & 0xffffff) !=
+                    (back & 0xffffff);
+                bool bit = mask[y * mask_stride + x / 8] >> (x % 8) & 1;
+
+                if (bit != expected)
+                    wrong++;
+            }
+    }
+    printf("{\"check\":\"tray_bg_mask\",\"wrong_bits\":%llu}\n",
+            (unsigned long long)wrong);
+    free(mask);
+    free(image);
+    return wrong == 0;
+}
+
+/* fixed seed, the benchmarks do not need unpredictable values */
+static const uint32_t bench_seed[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+static void bench_chacha_rng(uint64_t iterations)
+{
+    struct bench_result r = {
+        .name = "chacha_rng_u32", .ops = iterations,
+        .units = iterations * 4, .unit = "byte",
+    };
+    struct chacha_rng rng;
+    uint64_t i, acc = 0;
+
+    chacha_rng_seed(&rng, bench_seed);
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++)
+        acc += chacha_rng_u32(&rng);
+    BENCH_END(&r);
+    sink += acc;
+    print_result(&r);
+}
+
+/* RFC 7539 section 2.3.2 test vector */
+static bool check_chacha20(void)
+{
+    static const uint32_t nonce[3] = { 0x09000000, 0x4a000000, 0x00000000 };
+    static const uint32_t expected[16] = {
+        0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+        0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+        0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+        0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2,
+    };
+    uint32_t key[8], out[16];
+    bool ok;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        key[i] = (4 * i) | (4 * i + 1) << 8 | (4 * i + 2) << 16 |
+            (uint32_t)(4 * i + 3) << 24;
+    chacha20_block(key, 1, nonce, out);
+    ok = !memcmp(out, expected, sizeof(out));
+    printf("{\"check\":\"chacha20\",\"rfc7539\":%s}\n",
+            ok ? "true" : "false");
+    return ok;
+}
+
+static uint32_t bench_random(void *opaque)
+{
+    return chacha_rng_u32(opaque);
+}
+
+/* release time calculation of ebuf_queue_xevent(), without getrandom()
+ * reseeding */
+static void bench_ebuf(uint64_t iterations)
+{
+    struct bench_result r = { .name = "ebuf_release_time", .ops = iterations };
+    const uint32_t max_delay = 20;
+    int64_t now = 1000000000, prev_release = 0;
+    uint64_t i;
+    struct chacha_rng rng;
+
+    chacha_rng_seed(&rng, bench_seed);
+
+    BENCH_START(&r);
+    for (i = 0; i < iterations; i++) {
+        now += (i & 3) * 1000000;
+        prev_release = ebuf_release_time(prev_release, now, max_delay,
+                bench_random, &rng);
+    }
+    BENCH_END(&r);
+    sink += prev_release;
+    print_result(&r);
+}
+
+/* Simulate the event queue: release delays must stay within [0, max_delay]
+ * (+1us of rounding) and keep the events order; delays of isolated events
+ * must be uniformly distributed (chi-squared test over 20 bins, the limit is
+ * far above the 99.99th percentile for 19 degrees of freedom). */
+static bool check_ebuf(void)
+{
+    const uint32_t max_delay = 20;
+    const int64_t max_ns = max_delay * 1000000LL + 1000;
+    const int events = 200000, bins = 20;
+    const double chi2_limit = 50;
+    uint64_t hist[20] = { 0 }, out_of_range = 0, reordered = 0;
+    int64_t now = 1000000000, prev_release = 0, release, delay;
+    struct chacha_rng rng;
+    double chi2 = 0, expected = (double)events / bins;
+    int i;
+
+    chacha_rng_seed(&rng, bench_seed);
+    /* bursts of events, faster than the delay */
+    for (i = 0; i < events; i++) {
+        now += xorshift32() % 3000000;
+        release = ebuf_release_time(prev_release, now, max_delay,
+                bench_random, &rng);
+        delay = release - now;
+        if (delay < 0 || delay > max_ns)
+            out_of_range++;
+        if (release < prev_release)
+            reordered++;
+        prev_release = release;
+    }
+    /* isolated events */
+    for (i = 0; i < events; i++) {
+        now += max_ns + xorshift32() % 1000000;
+        release = ebuf_release_time(prev_release, now, max_delay,
+                bench_random, &rng);
+        delay = release - now;
+        if (delay < 0 || delay > max_ns)
+            out_of_range++;
+        else
+            hist[delay / 1000 * bins / (max_delay * 1000 + 1)]++;
+        prev_release = release;
+    }
+    for (i = 0; i < bins; i++)
+        chi2 += (hist[i] - expected) * (hist[i] - expected) / expected;
+    printf("{\"check\":\"ebuf\",\"max_delay_ms\":%u,\"out_of_range\":%llu,"
+            "\"reordered\":%llu,\"chi2_uniform\":%.2f,\"chi2_limit\":%.0f}\n",
+            max_delay, (unsigned long long)out_of_range,
+            (unsigned long long)reordered, chi2, chi2_limit);
+    return !out_of_range && !reordered && chi2 < chi2_limit;
+}
+
+static void usage(FILE *stream)
+{
+    fprintf(stream, "Usage: guid-microbench [options]\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream, " --scale=N, -s N\tmultiply iteration counts by N (default: 1)\n");
+    fprintf(stream, " --check, -c\talso check that optimized implementations match the reference ones\n");
+    fprintf(stream, " --help, -h\tshow command help\n");
+}
+
+static struct option longopts[] = {
+    { "scale", required_argument, NULL, 's' },
+    { "check", no_argument, NULL, 'c' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+    int i;
+    uint64_t scale = 1;
+    bool check = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:ch", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            check = true;
+            break;
+        case 's':
+            scale = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(1);
+        }
+    }
+    if (optind != argc || scale == 0) {
+        usage(stderr);
+        exit(1);
+    }
+
+    /* override-redirect 1080p window with its own image */
+    struct shm_clip_geometry window = {
+        .win_width = 1920, .win_height = 1080,
+        .image_width = 1920, .image_height = 1080,
+        .border_width = 2,
+    };
+    /* window partially off the left edge, contents from the screen image */
+    struct shm_clip_geometry screen = {
+        .screen_image = true,
+        .win_x = -100, .win_y = 200,
+        .win_width = 1920, .win_height = 1080,
+        .image_width = 3840, .image_height = 2160,
+        .border_width = 2,
+    };
+    bench_shm_clip("shm_update_clip/window", &window, scale * 20000000);
+    bench_shm_clip("shm_update_clip/screen", &screen, scale * 20000000);
+
+    bench_utf8_char(scale * 20000000);
+    for (i = 0; i < 2; i++) {
+        void (*sanitize)(unsigned char *, int) = i ?
+            sanitize_string_from_vm_scalar : sanitize_string_from_vm;
+        const char *variant = i ? "_scalar" : "";
+        char name[64];
+
+        snprintf(name, sizeof(name), "sanitize_string_from_vm%s/ascii", variant);
+        bench_sanitize(name, sanitize,
+                "Inbox (3) - user@example.com - Mozilla Thunderbird",
+                1, scale * 2000000);
+        snprintf(name, sizeof(name), "sanitize_string_from_vm%s/utf8", variant);
+        bench_sanitize(name, sanitize,
+                "Zażółć gęślą jaźń – Καλημέρα κόσμε – こんにちは世界 😀",
+                1, scale * 2000000);
+        snprintf(name, sizeof(name), "sanitize_string_from_vm%s/no-utf8", variant);
+        bench_sanitize(name, sanitize,
+                "Zażółć gęślą jaźń – Καλημέρα κόσμε – こんにちは世界 😀",
+                0, scale * 2000000);
+    }
+
+    bench_tint(22, scale * 20000);
+    bench_hash(22, scale * 200000);
+    bench_bg_mask(22, scale * 200000);
+    bench_chacha_rng(scale * 20000000);
+    bench_ebuf(scale * 20000000);
+
+    if (check && !(check_sanitize() & check_tint() & check_bg_mask() &
+                check_chacha20() & check_ebuf()))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/* qubes-guid-replay - act as the GUI agent and feed a stream recorded with
+ * "qubes-guid --record=PATH" back into qubes-guid.
+ *
+ * Only the agent -> qubes-guid direction is replayed, whatever qubes-guid
+ * sends is read and thrown away. Window contents in the recording refer to
+ * grant references of the recorded VM, which are not valid anymore - replay
+ * against "qubes-guid --invisible" (window dumps are only acknowledged then),
+ * unless the recorded VM still runs with the same windows.
+ *
+ * Per-message handler time and number of X requests are measured by
+ * qubes-guid itself; use --stats-pid to collect them at the end of the
+ * replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <qubes-gui-protocol.h>
+#include <vchan-record.h>
+#include "vchan-agent.h"
+#include "stats.h"
+
+/* split the agent -> qubes-guid stream into messages, for statistics */
+struct stream_parser {
+    size_t skip;        /* bytes of the current message body left */
+    size_t hdr_len;     /* bytes of the current header collected so far */
+    struct msg_hdr hdr;
+    uint64_t messages;
+    uint64_t per_type[MSG_MAX - MSG_MIN];
+};
+
+static void parser_feed(struct stream_parser *p, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        if (p->skip) {
+            size_t n = len < p->skip ? len : p->skip;
+            p->skip -= n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+        size_t n = sizeof(p->hdr) - p->hdr_len;
+        if (n > len)
+            n = len;
+        memcpy((uint8_t *)&p->hdr + p->hdr_len, buf, n);
+        p->hdr_len += n;
+        buf += n;
+        len -= n;
+        if (p->hdr_len < sizeof(p->hdr))
+            continue;
+        p->messages++;
+        if (p->hdr.type > MSG_MIN && p->hdr.type < MSG_MAX)
+            p->per_type[p->hdr.type - MSG_MIN]++;
+        p->skip = p->hdr.untrusted_len;
+        p->hdr_len = 0;
+    }
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* ask qubes-guid to dump its statistics and wait for the file to appear */
+static char *collect_guid_stats(pid_t pid, const char *path)
+{
+    struct stat st;
+    struct timespec before = { 0, 0 };
+    char *data;
+    FILE *f;
+    long size;
+    int i;
+
+    if (stat(path, &st) == 0)
+        before = st.st_mtim;
+    if (kill(pid, SIGUSR2) < 0)
+        err(1, "kill(%d, SIGUSR2)", (int)pid);
+    for (i = 0; i < 500; i++) {
+        if (stat(path, &st) == 0 &&
+                (st.st_mtim.tv_sec != before.tv_sec ||
+                 st.st_mtim.tv_nsec != before.tv_nsec))
+            break;
+        usleep(10000);
+    }
+    if (i == 500) {
+        warnx("qubes-guid did not write %s", path);
+        return NULL;
+    }
+    if (!(f = fopen(path, "r")))
+        err(1, "open %s", path);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    if (!(data = calloc(1, size + 1)))
+        err(1, "calloc");
+    if (fread(data, 1, size, f) != (size_t)size)
+        err(1, "read %s", path);
+    fclose(f);
+    /* strip the trailing newline, the object is embedded in our output */
+    while (size > 0 && data[size - 1] == '\n')
+        data[--size] = '\0';
+    return data;
+}
+
+static void usage(FILE *stream)
+{
+    fprintf(stream, "Usage: qubes-guid-replay [options] RECORDING\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream, " --domid=ID, -d ID\tdomain ID running qubes-guid (default: 0)\n");
+    fprintf(stream, " --realtime, -r\thonour the recorded timing (default: as fast as possible)\n");
+    fprintf(stream, " --speed=FACTOR, -s FACTOR\tscale the recorded timing, implies -r\n");
+    fprintf(stream, " --stats-pid=PID\tqubes-guid process to collect statistics from\n");
+    fprintf(stream, " --stats-file=PATH\tstatistics file of that process (/run/qubes/guid-stats.DOMID on its side)\n");
+    fprintf(stream, " --help, -h\tshow command help\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Results are printed as JSON on stdout.\n");
+}
+
+static struct option longopts[] = {
+    { "domid", required_argument, NULL, 'd' },
+    { "realtime", no_argument, NULL, 'r' },
+    { "speed", required_argument, NULL, 's' },
+    { "stats-pid", required_argument, NULL, 'P' },
+    { "stats-file", required_argument, NULL, 'F' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+    struct vchan_agent agent = { 0 };
+    struct stream_parser parser = { .skip = sizeof(uint32_t) /* protocol version */ };
+    int guid_domid = 0;
+    int realtime = 0;
+    double speed = 1.0;
+    pid_t stats_pid = 0;
+    const char *stats_file = NULL;
+    const char *path;
+    char *guid_stats = NULL;
+    struct stat st;
+    uint8_t *data;
+    size_t off;
+    uint64_t first_ns = UINT64_MAX, last_ns = 0;
+    int64_t start, end;
+    int opt, fd, i, first;
+    int sessions = 1;
+
+    while ((opt = getopt_long(argc, argv, "d:rs:h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            guid_domid = atoi(optarg);
+            break;
+        case 'r':
+            realtime = 1;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (speed <= 0)
+                errx(1, "invalid speed '%s'", optarg);
+            realtime = 1;
+            break;
+        case 'P':
+            stats_pid = atoi(optarg);
+            break;
+        case 'F':
+            stats_file = optarg;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(0);
+        default:
+            usage(stderr);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(stderr);
+        exit(1);
+    }
+    path = argv[optind];
+    if (stats_pid && !stats_file)
+        errx(1, "--stats-pid requires --stats-file");
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        err(1, "open %s", path);
+    if (fstat(fd, &st) < 0)
+        err(1, "stat %s", path);
+    if ((size_t)st.st_size < VCHAN_RECORD_MAGIC_LEN)
+        errx(1, "%s: not a qubes-guid recording", path);
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        err(1, "mmap %s", path);
+    close(fd);
+    if (memcmp(data, VCHAN_RECORD_MAGIC, VCHAN_RECORD_MAGIC_LEN))
+        errx(1, "%s: not a qubes-guid recording", path);
+
+    vchan_agent_listen(&agent, guid_domid);
+    start = bench_now_ns();
+    off = VCHAN_RECORD_MAGIC_LEN;
+    while (off < (size_t)st.st_size) {
+        struct vchan_record_hdr hdr;
+
+        if ((size_t)st.st_size - off < sizeof(hdr))
+            errx(1, "%s: truncated at offset %zu", path, off);
+        memcpy(&hdr, data + off, sizeof(hdr));
+        off += sizeof(hdr);
+        if ((size_t)st.st_size - off < hdr.len)
+            errx(1, "%s: truncated at offset %zu", path, off);
+        if (hdr.dir == VCHAN_RECORD_FROM_AGENT) {
+            if (first_ns == UINT64_MAX)
+                first_ns = hdr.time_ns;
+            last_ns = hdr.time_ns;
+            if (realtime) {
+                int64_t due = start + (int64_t)((hdr.time_ns - first_ns) / speed);
+                int64_t now;
+                while ((now = bench_now_ns()) < due)
+                    vchan_agent_poll(&agent, (due - now + 999999) / 1000000);
+            }
+            parser_feed(&parser, data + off, hdr.len);
+            vchan_agent_write(&agent, data + off, hdr.len);
+        } else if (hdr.dir == VCHAN_RECORD_NEW_SESSION) {
+            /* disconnecting makes qubes-guid restart and connect again */
+            vchan_agent_wait_consumed(&agent);
+            libvchan_close(agent.vchan);
+            vchan_agent_listen(&agent, guid_domid);
+            parser.skip = sizeof(uint32_t); /* protocol version */
+            parser.hdr_len = 0;
+            sessions++;
+        }
+        off += hdr.len;
+    }
+    vchan_agent_wait_consumed(&agent);
+    end = bench_now_ns();
+    if (stats_pid)
+        guid_stats = collect_guid_stats(stats_pid, stats_file);
+
+    printf("{\n");
+    printf("\"recording\":");
+    print_json_string(path);
+    printf(",\n");
+    printf("\"realtime\":%d,\n", realtime);
+    printf("\"speed\":%g,\n", speed);
+    printf("\"sessions\":%d,\n", sessions);
+    printf("\"recorded_duration_s\":%.6f,\n",
+            first_ns == UINT64_MAX ? 0.0 : (last_ns - first_ns) / 1e9);
+    printf("\"replay_duration_s\":%.6f,\n", (end - start) / 1e9);
+    printf("\"bytes_to_guid\":%" PRIu64 ",\n", agent.bytes_sent);
+    printf("\"bytes_from_guid\":%" PRIu64 ",\n", agent.bytes_received);
+    printf("\"messages\":%" PRIu64 ",\n", parser.messages);
+    printf("\"messages_per_s\":%.1f,\n", parser.messages * 1e9 / (end - start));
+    printf("\"mbytes_per_s\":%.3f,\n", agent.bytes_sent * 1e3 / (end - start));
+    printf("\"message_types\":{");
+    for (i = 0, first = 1; i < MSG_MAX - MSG_MIN; i++) {
+        const char *name = stats_msg_name(MSG_MIN + i);
+        if (!parser.per_type[i] || !name)
+            continue;
+        printf("%s\"%s\":%" PRIu64, first ? "" : ",", name, parser.per_type[i]);
+        first = 0;
+    }
+    printf("}");
+    if (guid_stats)
+        printf(",\n\"guid\":%s", guid_stats);
+    printf("\n}\n");
+    free(guid_stats);
+    libvchan_close(agent.vchan);
+    munmap(data, st.st_size);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+# The Qubes OS Project, http://www.qubes-os.org
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+#
+
+# End-to-end performance suite: runs qubes-guid on a private Xvfb server
+# (with shmoverride.so preloaded) against guid-bench-agent, one qubes-guid
+# instance per scenario, and prints all results as a single JSON object.
+#
+# Must run in a Xen domain (for grant tables and vchan), as root or as a user
+# with access to /dev/xen/gntdev, /dev/xen/gntalloc and /run/qubes.
+#
+# Environment:
+#   PERF_SCENARIOS  scenarios to run (default: all)
+#   PERF_DURATION   seconds per throughput scenario (default: 5)
+#   PERF_COUNT      windows/exposes/input events/root changes (default: 500)
+#   PERF_DISPLAY    X display number for Xvfb (default: 99)
+#   PERF_TRAY_MODES trayicon modes to run tray scenarios with
+#                   (default: tint tint+render bg bg+render)
+#   PERF_STARTUP_RUNS qubes-guid instances started for the startup scenario
+#                   (default: 10)
+#   PERF_GUID       qubes-guid binary to test (default: the one built here),
+#                   e.g. to compare startup before and after a change
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+scenarios=${PERF_SCENARIOS:-"shm-1080p shm-4k small-rects windows expose-storm input-latency tray tray-static idle-root startup"}
+tray_modes=${PERF_TRAY_MODES:-"tint tint+render bg bg+render"}
+duration=${PERF_DURATION:-5}
+count=${PERF_COUNT:-500}
+startup_runs=${PERF_STARTUP_RUNS:-10}
+display=:${PERF_DISPLAY:-99}
+
+guid=${PERF_GUID:-$top/gui-daemon/qubes-guid}
+agent=$top/bench/guid-bench-agent
+shmoverride=$top/shmoverride/shmoverride.so
+
+for f in "$guid" "$agent" "$shmoverride"; do
+    if ! [ -e "$f" ]; then
+        echo "$f missing, run 'make perf'" >&2
+        exit 1
+    fi
+done
+
+domid=$(xenstore-read domid)
+tmpdir=$(mktemp -d)
+xvfb_pid=
+guid_pid=
+
+cleanup() {
+    [ -n "$guid_pid" ] && kill "$guid_pid" 2>/dev/null || :
+    [ -n "$xvfb_pid" ] && kill "$xvfb_pid" 2>/dev/null || :
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT INT TERM
+
+# send events to the agent immediately, do not batch them
+cat > "$tmpdir/guid.conf" <<CONF
+global: {
+    events_max_delay = 0;
+};
+CONF
+
+LD_PRELOAD=$shmoverride Xvfb "$display" -screen 0 3840x2160x24 -nolisten tcp \
+    >"$tmpdir/Xvfb.log" 2>&1 &
+xvfb_pid=$!
+export DISPLAY=$display
+for _ in $(seq 50); do
+    xdpyinfo >/dev/null 2>&1 && break
+    sleep 0.1
+done
+
+printf '{"date":"%s","commit":"%s","domid":%s,"results":[' \
+    "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+    "$(git -C "$top" describe --always --dirty 2>/dev/null || echo unknown)" \
+    "$domid"
+sep=
+# run_scenario SCENARIO [TRAYICON_MODE]
+run_scenario() {
+    "$guid" -f -C "$tmpdir/guid.conf" -d "$domid" -N perf-test \
+        -c 0x0000ff -l 1 ${2:+--trayicon-mode="$2"} \
+        >"$tmpdir/guid-$1.log" 2>&1 &
+    guid_pid=$!
+    result=$("$agent" -d "$domid" -t "$duration" -n "$count" \
+        --stats-pid="$guid_pid" --stats-file="/run/qubes/guid-stats.$domid" \
+        ${2:+--variant="$2"} "$1")
+    kill "$guid_pid" 2>/dev/null || :
+    wait "$guid_pid" || :
+    guid_pid=
+    printf '%s%s' "$sep" "$result"
+    sep=,
+}
+
+for scenario in $scenarios; do
+    case "$scenario" in
+        tray*)
+            for mode in $tray_modes; do
+                run_scenario "$scenario" "$mode"
+            done
+            ;;
+        startup)
+            # one result per fresh qubes-guid, startup time is noisy
+            for _ in $(seq "$startup_runs"); do
+                run_scenario "$scenario"
+            done
+            ;;
+        *)
+            run_scenario "$scenario"
+            ;;
+    esac
+done
+printf ']}\n'
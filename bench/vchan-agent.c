@@ -0,0 +1,109 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <err.h>
+#include "vchan-agent.h"
+
+int64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* wait for qubes-guid to connect */
+void vchan_agent_listen(struct vchan_agent *a, int guid_domid)
+{
+    a->vchan = libvchan_server_init(guid_domid, GUI_VCHAN_PORT, 4096, 4096);
+    if (!a->vchan)
+        errx(1, "libvchan_server_init failed");
+    while (libvchan_is_open(a->vchan) == VCHAN_WAITING)
+        libvchan_wait(a->vchan);
+    if (!libvchan_is_open(a->vchan))
+        errx(1, "qubes-guid did not connect");
+    a->ring_space = libvchan_buffer_space(a->vchan);
+}
+
+/* read (and discard) everything qubes-guid has sent so far, so it never
+ * blocks on us */
+static void vchan_agent_drain(struct vchan_agent *a)
+{
+    char buf[4096];
+    int ret;
+
+    while (libvchan_data_ready(a->vchan) > 0) {
+        ret = libvchan_read(a->vchan, buf, sizeof(buf));
+        if (ret <= 0)
+            errx(1, "qubes-guid disconnected");
+        a->bytes_received += ret;
+        if (a->on_receive)
+            a->on_receive(a, buf, ret);
+    }
+}
+
+/* wait up to timeout_ms for vchan activity and drain incoming data */
+void vchan_agent_poll(struct vchan_agent *a, int timeout_ms)
+{
+    struct pollfd fd = {
+        .fd = libvchan_fd_for_select(a->vchan),
+        .events = POLLIN,
+    };
+
+    vchan_agent_drain(a);
+    if (poll(&fd, 1, timeout_ms) < 0 && errno != EINTR)
+        err(1, "poll");
+    if (fd.revents)
+        libvchan_wait(a->vchan);
+    if (!libvchan_is_open(a->vchan))
+        errx(1, "qubes-guid disconnected");
+    vchan_agent_drain(a);
+}
+
+void vchan_agent_write(struct vchan_agent *a, const void *buf, size_t len)
+{
+    const char *p = buf;
+    int ret;
+
+    while (len > 0) {
+        if (libvchan_buffer_space(a->vchan) == 0) {
+            vchan_agent_poll(a, 1000);
+            continue;
+        }
+        ret = libvchan_write(a->vchan, p, len);
+        if (ret < 0)
+            errx(1, "qubes-guid disconnected");
+        p += ret;
+        len -= ret;
+        a->bytes_sent += ret;
+    }
+}
+
+/* wait until qubes-guid has read everything we have written */
+void vchan_agent_wait_consumed(struct vchan_agent *a)
+{
+    while (libvchan_buffer_space(a->vchan) < a->ring_space)
+        vchan_agent_poll(a, 10);
+}
@@ -0,0 +1,49 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_BENCH_VCHAN_AGENT_H
+#define QUBES_BENCH_VCHAN_AGENT_H QUBES_BENCH_VCHAN_AGENT_H
+
+/* Minimal GUI-agent side of the vchan connection, shared by the benchmark
+ * tools. qubes-guid is the vchan client, so we are the server on port 6000.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libvchan.h>
+
+#define GUI_VCHAN_PORT 6000
+
+struct vchan_agent {
+    libvchan_t *vchan;
+    int ring_space;           /* free space of the empty ring */
+    uint64_t bytes_sent;      /* to qubes-guid */
+    uint64_t bytes_received;  /* from qubes-guid */
+    /* called for each chunk received from qubes-guid, may be NULL */
+    void (*on_receive)(struct vchan_agent *a, const char *buf, size_t len);
+    void *priv;
+};
+
+int64_t bench_now_ns(void);
+void vchan_agent_listen(struct vchan_agent *a, int guid_domid);
+void vchan_agent_poll(struct vchan_agent *a, int timeout_ms);
+void vchan_agent_write(struct vchan_agent *a, const void *buf, size_t len);
+void vchan_agent_wait_consumed(struct vchan_agent *a);
+
+#endif /* QUBES_BENCH_VCHAN_AGENT_H */
@@ -26,8 +26,13 @@
 #include <errno.h>
 #include <poll.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <double-buffer.h>
+#include <vchan-record.h>
 #include "../include/txrx.h"
 
 void (*vchan_at_eof)(void) = NULL;
@@ -38,10 +43,115 @@ int vchan_is_closed = 0;
  */
 int double_buffered = 1;
 
+uint64_t vchan_bytes_queued;
+uint64_t vchan_bytes_sent;
+
 void vchan_register_at_eof(void (*new_vchan_at_eof)(void)) {
     vchan_at_eof = new_vchan_at_eof;
 }
 
+/* called whenever vchan_bytes_sent advances */
+static void (*vchan_at_sent)(uint64_t bytes_sent) = NULL;
+void vchan_register_at_sent(void (*new_vchan_at_sent)(uint64_t bytes_sent)) {
+    vchan_at_sent = new_vchan_at_sent;
+}
+
+/* optional capture of the whole vchan stream, see vchan-record.h */
+static FILE *record_file;
+static struct timespec record_start;
+
+/* Start of the recording (CLOCK_MONOTONIC, in ns) passed over the restart
+ * execv(), so the restarted qubes-guid appends to the same recording with
+ * continuous timestamps. */
+#define VCHAN_RECORD_START_ENV "QUBES_GUID_RECORD_START"
+
+static void vchan_record(uint8_t dir, const char *buf, int size)
+{
+    struct vchan_record_hdr hdr;
+    struct timespec now;
+
+    if (!record_file || size < 0 ||
+            (size == 0 && dir != VCHAN_RECORD_NEW_SESSION))
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.time_ns = (uint64_t)(now.tv_sec - record_start.tv_sec) * 1000000000 +
+        now.tv_nsec - record_start.tv_nsec;
+    hdr.len = size;
+    hdr.dir = dir;
+    if (fwrite(&hdr, sizeof(hdr), 1, record_file) != 1 ||
+            (size && fwrite(buf, size, 1, record_file) != 1)) {
+        /* do not kill the session just because the recording failed */
+        perror("vchan record");
+        vchan_record_close();
+    }
+}
+
+int vchan_record_open(const char *path)
+{
+    const char *start_env = getenv(VCHAN_RECORD_START_ENV);
+    unsigned long long start_ns = 0;
+    char *end;
+    struct stat st;
+    int flags = O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC;
+    int fd;
+
+    if (start_env) {
+        errno = 0;
+        start_ns = strtoull(start_env, &end, 10);
+        if (errno || end == start_env || *end)
+            start_env = NULL;
+        unsetenv(VCHAN_RECORD_START_ENV);
+    }
+    flags |= start_env ? O_APPEND : O_TRUNC;
+    fd = open(path, flags, 0600);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    record_file = fdopen(fd, "a");
+    if (!record_file) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0 &&
+            fwrite(VCHAN_RECORD_MAGIC, VCHAN_RECORD_MAGIC_LEN, 1, record_file) != 1) {
+        fclose(record_file);
+        record_file = NULL;
+        return -1;
+    }
+    if (start_env) {
+        record_start.tv_sec = start_ns / 1000000000;
+        record_start.tv_nsec = start_ns % 1000000000;
+    } else
+        clock_gettime(CLOCK_MONOTONIC, &record_start);
+    if (st.st_size > 0)
+        vchan_record(VCHAN_RECORD_NEW_SESSION, NULL, 0);
+    return 0;
+}
+
+void vchan_record_keep_for_restart(void)
+{
+    char buf[32];
+
+    if (!record_file)
+        return;
+    snprintf(buf, sizeof(buf), "%llu",
+             (unsigned long long)record_start.tv_sec * 1000000000 +
+             record_start.tv_nsec);
+    setenv(VCHAN_RECORD_START_ENV, buf, 1);
+}
+
+void vchan_record_close(void)
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
 static void handle_vchan_error(libvchan_t *vchan, const char *op)
 {
     if (!libvchan_is_open(vchan)) {
@@ -71,8 +181,15 @@ static int write_data_exact(libvchan_t *vchan, char *buf, int size)
 int write_data(libvchan_t *vchan, char *buf, int size)
 {
     int count;
-    if (!double_buffered)
-        return write_data_exact(vchan, buf, size); // this may block
+    vchan_record(VCHAN_RECORD_TO_AGENT, buf, size);
+    vchan_bytes_queued += size;
+    if (!double_buffered) {
+        write_data_exact(vchan, buf, size); // this may block
+        vchan_bytes_sent += size;
+        if (size && vchan_at_sent)
+            vchan_at_sent(vchan_bytes_sent);
+        return size;
+    }
     double_buffer_append(buf, size);
     count = libvchan_buffer_space(vchan);
     if (count > double_buffer_datacount())
@@ -81,6 +198,9 @@ int write_data(libvchan_t *vchan, char *buf, int size)
         // blocking; remainder of data stays in the double buffer
     write_data_exact(vchan, double_buffer_data(), count);
     double_buffer_substract(count);
+    vchan_bytes_sent += count;
+    if (count && vchan_at_sent)
+        vchan_at_sent(vchan_bytes_sent);
     return size;
 }
 
@@ -101,21 +221,25 @@ int read_data(libvchan_t *vchan, char *buf, int size)
         ret = libvchan_read(vchan, buf + written, size - written);
         if (ret <= 0)
             handle_vchan_error(vchan, "read data");
+        vchan_record(VCHAN_RECORD_FROM_AGENT, buf + written, ret);
         written += ret;
     }
 //      fprintf(stderr, "read %d bytes\n", size);
     return size;
 }
 
-int wait_for_vchan_or_argfd_once(libvchan_t *vchan, int fd, int timeout)
+static int wait_for_vchan_or_argfd(libvchan_t *vchan, int fd,
+        const struct timespec *timeout)
 {
     int ret;
     write_data(vchan, NULL, 0);    // trigger write of queued data, if any present
+    if (record_file)
+        fflush(record_file);    // about to sleep, good time to hit the disk
     struct pollfd fds[] = {
         { .fd = libvchan_fd_for_select(vchan), .events = POLLIN, .revents = 0 },
         { .fd = fd, .events = POLLIN, .revents = 0 },
     };
-    ret = poll(fds, fd == -1 ? 1 : 2, timeout);
+    ret = ppoll(fds, fd == -1 ? 1 : 2, timeout, NULL);
     if (ret < 0) {
         if (errno == EINTR)
             return -1;
@@ -138,3 +262,27 @@ int wait_for_vchan_or_argfd_once(libvchan_t *vchan, int fd, int timeout)
     }
     return ret;
 }
+
+int wait_for_vchan_or_argfd_once(libvchan_t *vchan, int fd, int timeout)
+{
+    struct timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000L,
+    };
+
+    return wait_for_vchan_or_argfd(vchan, fd, timeout < 0 ? NULL : &ts);
+}
+
+int wait_for_vchan_or_argfd_until(libvchan_t *vchan, int fd, int64_t deadline_ns)
+{
+    struct timespec now, ts = { 0, 0 };
+    int64_t timeout;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout = deadline_ns - ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+    }
+    return wait_for_vchan_or_argfd(vchan, fd, &ts);
+}
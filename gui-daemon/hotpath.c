@@ -0,0 +1,713 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <qubes-gui-protocol.h>
+#include "hotpath.h"
+
+static inline int min_int(int a, int b) {
+    return a > b ? b : a;
+}
+
+enum shm_clip_result shm_update_clip(const struct shm_clip_geometry *geo,
+        int *px, int *py, int *pw, int *ph, bool *do_border)
+{
+    int untrusted_x = *px, untrusted_y = *py;
+    int untrusted_w = *pw, untrusted_h = *ph;
+    int border_width = geo->border_width;
+    int x, y, w, h;
+
+    assert(untrusted_x >= 0 && untrusted_y >= 0 &&
+           untrusted_w >= 0 && untrusted_h >= 0);
+    assert(geo->win_x >= -MAX_WINDOW_WIDTH && geo->win_x <= MAX_WINDOW_WIDTH);
+    assert(geo->win_y >= -MAX_WINDOW_HEIGHT && geo->win_y <= MAX_WINDOW_HEIGHT);
+    assert(geo->image_width >= 0 && geo->image_width <= MAX_WINDOW_WIDTH);
+    assert(geo->image_height >= 0 && geo->image_height <= MAX_WINDOW_HEIGHT);
+    *do_border = false;
+
+    if (!geo->screen_image) {
+        x = min_int(untrusted_x, geo->image_width);
+        // now: x is not negative and not greater than image_width
+        y = min_int(untrusted_y, geo->image_height);
+        // now: y is not negative and not greater than image_height
+        w = min_int(untrusted_w, geo->image_width - x);
+        // now: w is not negative and not greater than image_width
+        h = min_int(untrusted_h, geo->image_height - y);
+        // now: h is not negative and not greater than image_height
+    } else {
+        /* update only onscreen window part */
+        if (geo->win_x >= geo->image_width || geo->win_y >= geo->image_height) {
+            // window is entirely off-screen
+            return SHM_CLIP_NOTHING;
+        }
+        // now: image_width - win_x > 0 and image_height - win_y > 0
+
+        if (geo->win_x < 0 && geo->win_x + untrusted_x < 0) {
+            // we know win_x is not less than -MAX_WINDOW_WIDTH, so this
+            // is not UB.
+            untrusted_x = -geo->win_x;
+        }
+        // now: untrusted_x + win_x is not negative and untrusted_x is not
+        // negative
+
+        if (geo->win_y < 0 && geo->win_y + untrusted_y < 0) {
+            untrusted_y = -geo->win_y;
+        }
+        // now: untrusted_y + win_y is not negative and untrusted_y is
+        // not negative
+
+        // win_x is greater than INT_MIN + MAX_WINDOW_WIDTH, so this is not UB
+        x = min_int(untrusted_x, geo->image_width - geo->win_x);
+        // now: x + win_x is not negative and not greater than image_width
+        y = min_int(untrusted_y, geo->image_height - geo->win_y);
+        // now: y + win_y is not negative and not greater than image_height
+
+        w = min_int(untrusted_w, geo->image_width - geo->win_x - x);
+        // now: image_width >= (win_x + x + w)
+        // so if the code that forces the window on-screen makes win_x + x
+        // exceed image_width, w will become negative, causing the code to
+        // return early.
+        h = min_int(untrusted_h, geo->image_height - geo->win_y - y);
+        // same for the height
+
+        // if the requested area is outside of the window, this will be caught
+        // by the code below that checks for frames being overwritten
+    }
+
+    assert(border_width >= 0);
+
+    if (geo->win_width <= border_width * 2
+        || geo->win_height <= border_width * 2) {
+        /* window contains only (forced) frame, so no content to update */
+        return SHM_CLIP_FRAME_ONLY;
+    }
+
+    const int right = x + w, bottom = y + h;
+    /* force frame to be visible: */
+    /*   * left */
+    if (border_width > x) { // window would cover left border
+        if (w <= border_width - x)
+            return SHM_CLIP_NOTHING; /* nothing left to update */
+        w -= border_width - x;
+        x = border_width;
+        *do_border = true;
+    }
+    /*   * right */
+    const int right_allowed = geo->win_width - border_width;
+    if (right > right_allowed) { // window would cover right border
+        if (right_allowed <= x)
+            return SHM_CLIP_NOTHING; /* nothing left to update */
+        w = right_allowed - x;
+        *do_border = true;
+    }
+    /*   * top */
+    if (border_width > y) { // window would cover top border
+        if (h <= border_width - y)
+            return SHM_CLIP_NOTHING; /* nothing left to update */
+        h -= (border_width - y);
+        y = border_width;
+        *do_border = true;
+    }
+    /*   * bottom */
+    const int bottom_allowed = geo->win_height - border_width;
+    if (bottom > bottom_allowed) { // window would cover bottom border
+        if (bottom_allowed <= y)
+            return SHM_CLIP_NOTHING; /* nothing left to update */
+        h = bottom_allowed - y;
+        *do_border = true;
+    }
+
+    /* again check if something left to update */
+    if (w <= 0 || h <= 0)
+        return SHM_CLIP_NOTHING;
+
+    *px = x;
+    *py = y;
+    *pw = w;
+    *ph = h;
+    return SHM_CLIP_UPDATE;
+}
+
+/* validate single UTF-8 character
+ * return bytes count of this character, or 0 if the character is invalid */
+int validate_utf8_char(unsigned char *untrusted_c) {
+    int tails_count = 0;
+    int total_size = 0;
+    /* it is safe to access byte pointed by the parameter and the next one
+     * (which can be terminating NULL), but every next byte can access only if
+     * neither of previous bytes was NULL
+     */
+
+    /* According to http://www.ietf.org/rfc/rfc3629.txt:
+     *   UTF8-char   = UTF8-1 / UTF8-2 / UTF8-3 / UTF8-4
+     *   UTF8-1      = %x00-7F
+     *   UTF8-2      = %xC2-DF UTF8-tail
+     *   UTF8-3      = %xE0 %xA0-BF UTF8-tail / %xE1-EC 2( UTF8-tail ) /
+     *                 %xED %x80-9F UTF8-tail / %xEE-EF 2( UTF8-tail )
+     *   UTF8-4      = %xF0 %x90-BF 2( UTF8-tail ) / %xF1-F3 3( UTF8-tail ) /
+     *                 %xF4 %x80-8F 2( UTF8-tail )
+     *   UTF8-tail   = %x80-BF
+     */
+
+    if (*untrusted_c <= 0x7F) {
+        return 1;
+    } else if (*untrusted_c >= 0xC2 && *untrusted_c <= 0xDF) {
+        total_size = 2;
+        tails_count = 1;
+    } else switch (*untrusted_c) {
+        case 0xE0:
+            untrusted_c++;
+            total_size = 3;
+            if (*untrusted_c >= 0xA0 && *untrusted_c <= 0xBF)
+                tails_count = 1;
+            else
+                return 0;
+            break;
+        case 0xE1: case 0xE2: case 0xE3: case 0xE4:
+        case 0xE5: case 0xE6: case 0xE7: case 0xE8:
+        case 0xE9: case 0xEA: case 0xEB: case 0xEC:
+            /* 0xED */
+        case 0xEE:
+        case 0xEF:
+            total_size = 3;
+            tails_count = 2;
+            break;
+        case 0xED:
+            untrusted_c++;
+            total_size = 3;
+            if (*untrusted_c >= 0x80 && *untrusted_c <= 0x9F)
+                tails_count = 1;
+            else
+                return 0;
+            break;
+        case 0xF0:
+            untrusted_c++;
+            total_size = 4;
+            if (*untrusted_c >= 0x90 && *untrusted_c <= 0xBF)
+                tails_count = 2;
+            else
+                return 0;
+            break;
+        case 0xF1:
+        case 0xF2:
+        case 0xF3:
+            total_size = 4;
+            tails_count = 3;
+            break;
+        case 0xF4:
+            untrusted_c++;
+            if (*untrusted_c >= 0x80 && *untrusted_c <= 0x8F)
+                tails_count = 2;
+            else
+                return 0;
+            break;
+        default:
+            return 0;
+    }
+
+    while (tails_count-- > 0) {
+        untrusted_c++;
+        if (!(*untrusted_c >= 0x80 && *untrusted_c <= 0xBF))
+            return 0;
+    }
+    return total_size;
+}
+
+/* replace non-printable characters with '_'
+ * given string must be NULL terminated already */
+void sanitize_string_from_vm_scalar(unsigned char *untrusted_s, int allow_utf8)
+{
+    int utf8_ret;
+    for (; *untrusted_s; untrusted_s++) {
+        // allow only non-control ASCII chars
+        if (*untrusted_s >= 0x20 && *untrusted_s <= 0x7E)
+            continue;
+        if (allow_utf8 && *untrusted_s >= 0x80) {
+            utf8_ret = validate_utf8_char(untrusted_s);
+            if (utf8_ret > 0) {
+                /* loop will do one additional increment */
+                untrusted_s += utf8_ret - 1;
+                continue;
+            }
+        }
+        *untrusted_s = '_';
+    }
+}
+
+/* sanitize single character, which is not printable ASCII; return number of
+ * bytes it takes */
+static inline size_t sanitize_char(unsigned char *untrusted_c, int allow_utf8)
+{
+    int utf8_ret;
+
+    if (allow_utf8 && *untrusted_c >= 0x80) {
+        /* the most common 2 and 3 byte sequences inline, all of the tail
+         * bytes must be checked in order, as NUL ends the string */
+        if (*untrusted_c >= 0xC2 && *untrusted_c <= 0xDF &&
+                (untrusted_c[1] & 0xC0) == 0x80)
+            return 2;
+        if (*untrusted_c >= 0xE1 && *untrusted_c <= 0xEF &&
+                *untrusted_c != 0xED && (untrusted_c[1] & 0xC0) == 0x80 &&
+                (untrusted_c[2] & 0xC0) == 0x80)
+            return 3;
+        utf8_ret = validate_utf8_char(untrusted_c);
+        if (utf8_ret > 0)
+            return utf8_ret;
+    }
+    *untrusted_c = '_';
+    return 1;
+}
+
+/* sanitize single character; return number of bytes it takes */
+static inline size_t sanitize_ascii_or_char(unsigned char *untrusted_c,
+        int allow_utf8)
+{
+    if (*untrusted_c >= 0x20 && *untrusted_c <= 0x7E)
+        return 1;
+    return sanitize_char(untrusted_c, allow_utf8);
+}
+
+static inline __attribute__((always_inline)) void sanitize_string(
+        unsigned char *untrusted_s, int allow_utf8)
+{
+    /* the length is known first, so vector loads stay within the string */
+    size_t len = strlen((const char *)untrusted_s);
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+
+    /* skip 16 bytes of printable ASCII at once; as signed bytes these are
+     * greater than 0x1F, except 0x7F */
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(untrusted_s + i));
+        unsigned int bad = ~_mm_movemask_epi8(_mm_andnot_si128(
+                    _mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, ctl))) & 0xFFFF;
+        size_t block_end = i + 16;
+
+        if (!bad) {
+            i = block_end;
+            continue;
+        }
+        /* the rest of the block byte by byte, the last character may
+         * continue in the next one */
+        i += __builtin_ctz(bad);
+        while (i < block_end)
+            i += sanitize_ascii_or_char(untrusted_s + i, allow_utf8);
+    }
+#endif
+    while (i < len)
+        i += sanitize_ascii_or_char(untrusted_s + i, allow_utf8);
+}
+
+void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8)
+{
+    /* separate copies for both modes, without the check in the loop */
+    if (allow_utf8)
+        sanitize_string(untrusted_s, 1);
+    else
+        sanitize_string(untrusted_s, 0);
+}
+
+/* based on /usr/share/awesome/lib/gears/colors.lua */
+
+static inline double max3(double a, double b, double c) {
+    double r = a;
+    if (b > r)
+        r = b;
+    if (c > r)
+        r = c;
+    return r;
+}
+
+static inline double min3(double a, double b, double c) {
+    double r = a;
+    if (b < r)
+        r = b;
+    if (c < r)
+        r = c;
+    return r;
+}
+
+void rgb_to_hls(uint32_t rgb, double *out_h, double *out_l, double *out_s) {
+    double r, g, b;
+    double maxc, minc, l, h, s, rc, gc, bc;
+
+    r = ((rgb >> 16) & 0xff) * 1.0 / 255.0;
+    g = ((rgb >>  8) & 0xff) * 1.0 / 255.0;
+    b = ((rgb >>  0) & 0xff) * 1.0 / 255.0;
+
+
+    maxc = max3(r, g, b);
+    minc = min3(r, g, b);
+    // XXX Can optimize (maxc+minc) and (maxc-minc)
+    l = (minc+maxc)/2.0;
+    if (minc == maxc) {
+        *out_h = 0.0;
+        *out_l = l;
+        *out_s = 0.0;
+        return;
+    }
+    if (l <= 0.5) {
+        s = (maxc-minc) / (maxc+minc);
+    } else {
+        s = (maxc-minc) / (2.0-maxc-minc);
+    }
+    rc = (maxc-r) / (maxc-minc);
+    gc = (maxc-g) / (maxc-minc);
+    bc = (maxc-b) / (maxc-minc);
+    if (r == maxc) {
+        h = bc-gc;
+    } else if (g == maxc) {
+        h = 2.0+rc-bc;
+    } else {
+        h = 4.0+gc-rc;
+    }
+    h = (h/6.0) - floor(h/6.0);
+
+    *out_h = h;
+    *out_l = l;
+    *out_s = s;
+}
+
+/* based on /usr/share/awesome/lib/gears/colors.lua */
+static uint8_t v(double m1, double m2, double hue) {
+    hue = hue - floor(hue);
+    if (hue < 1.0/6.0)
+        return (m1 + (m2-m1)*hue*6.0) * 0xff;
+    if (hue < 0.5)
+        return (m2) * 0xff;
+    if (hue < 2.0/3.0)
+        return (m1 + (m2-m1)*(2.0/3.0-hue)*6.0) * 0xff;
+    return m1 * 0xff;
+}
+
+uint32_t hls_to_rgb(double h, double l, double s) {
+    double m1, m2;
+
+    if (s == 0.0)
+        return
+            (int)(l * 0xff) << 16 |
+            (int)(l * 0xff) <<  8 |
+            (int)(l * 0xff) <<  0;
+    if (l <= 0.5)
+        m2 = l * (1.0+s);
+    else
+        m2 = l+s-(l*s);
+    m1 = 2.0*l - m2;
+    return
+        (uint32_t)v(m1, m2, h+1.0/3.0) << 16 |
+        (uint32_t)v(m1, m2, h)         <<  8 |
+        (uint32_t)v(m1, m2, h-1.0/3.0) <<  0;
+}
+
+uint32_t tint_pixel(uint32_t pixel, double tint_h, double tint_s, bool whitehack) {
+    double h_ignore, l, s_ignore;
+
+    if (whitehack && pixel == 0xffffff)
+        return 0xfefefe;
+    rgb_to_hls(pixel, &h_ignore, &l, &s_ignore);
+    return hls_to_rgb(tint_h, l, tint_s);
+}
+
+void tint_lut_init(struct tint_lut *lut, double tint_h, double tint_s) {
+    for (int i = 0; i < TINT_LUT_SIZE; i++)
+        lut->rgb[i] = hls_to_rgb(tint_h, i / 510.0, tint_s);
+}
+
+void tint_pixels_scalar(const struct tint_lut *lut, uint32_t *pixels,
+        size_t count, bool whitehack) {
+    for (size_t i = 0; i < count; i++)
+        pixels[i] = tint_lut_pixel(lut, pixels[i], whitehack);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void tint_pixels_sse2(const struct tint_lut *lut, uint32_t *pixels,
+        size_t count, bool whitehack) {
+    const __m128i rgb_mask = _mm_set1_epi32(0xffffff);
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i whitehack_mask = _mm_set1_epi32(whitehack ? -1 : 0);
+    const __m128i almost_white = _mm_set1_epi32(0xfefefe);
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i px = _mm_loadu_si128((__m128i *)(pixels + i));
+        __m128i rgb = _mm_and_si128(px, rgb_mask);
+        __m128i idx, white, out;
+
+        /* max + min of the channels; lane bytes are B, G, R, X */
+        __m128i g = _mm_srli_epi32(rgb, 8), r = _mm_srli_epi32(rgb, 16);
+        __m128i maxc = _mm_max_epu8(_mm_max_epu8(rgb, g), r);
+        __m128i minc = _mm_min_epu8(_mm_min_epu8(rgb, g), r);
+        idx = _mm_add_epi32(_mm_and_si128(maxc, byte_mask),
+                            _mm_and_si128(minc, byte_mask));
+        white = _mm_and_si128(whitehack_mask, _mm_cmpeq_epi32(rgb, rgb_mask));
+        /* no gather in SSE2 */
+        out = _mm_set_epi32(lut->rgb[_mm_cvtsi128_si32(_mm_srli_si128(idx, 12))],
+                            lut->rgb[_mm_cvtsi128_si32(_mm_srli_si128(idx, 8))],
+                            lut->rgb[_mm_cvtsi128_si32(_mm_srli_si128(idx, 4))],
+                            lut->rgb[_mm_cvtsi128_si32(idx)]);
+        out = _mm_or_si128(_mm_andnot_si128(white, out),
+                           _mm_and_si128(white, almost_white));
+        _mm_storeu_si128((__m128i *)(pixels + i), out);
+    }
+    tint_pixels_scalar(lut, pixels + i, count - i, whitehack);
+}
+
+__attribute__((target("avx2")))
+void tint_pixels_avx2(const struct tint_lut *lut, uint32_t *pixels,
+        size_t count, bool whitehack) {
+    const __m256i rgb_mask = _mm256_set1_epi32(0xffffff);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i whitehack_mask = _mm256_set1_epi32(whitehack ? -1 : 0);
+    const __m256i almost_white = _mm256_set1_epi32(0xfefefe);
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m256i px = _mm256_loadu_si256((__m256i *)(pixels + i));
+        __m256i rgb = _mm256_and_si256(px, rgb_mask);
+        __m256i idx, white, out;
+
+        __m256i g = _mm256_srli_epi32(rgb, 8), r = _mm256_srli_epi32(rgb, 16);
+        __m256i maxc = _mm256_max_epu8(_mm256_max_epu8(rgb, g), r);
+        __m256i minc = _mm256_min_epu8(_mm256_min_epu8(rgb, g), r);
+        idx = _mm256_add_epi32(_mm256_and_si256(maxc, byte_mask),
+                               _mm256_and_si256(minc, byte_mask));
+        white = _mm256_and_si256(whitehack_mask,
+                                 _mm256_cmpeq_epi32(rgb, rgb_mask));
+        out = _mm256_i32gather_epi32((const int *)lut->rgb, idx, 4);
+        out = _mm256_blendv_epi8(out, almost_white, white);
+        _mm256_storeu_si256((__m256i *)(pixels + i), out);
+    }
+    tint_pixels_scalar(lut, pixels + i, count - i, whitehack);
+}
+#endif
+
+tint_pixels_fn *tint_pixels_select(const char **name) {
+    const char *dummy;
+
+    if (!name)
+        name = &dummy;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return tint_pixels_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return tint_pixels_sse2;
+    }
+#endif
+    *name = "scalar";
+    return tint_pixels_scalar;
+}
+
+void tray_bg_mask_rows(const uint8_t *data, size_t stride, int w, int rows,
+        uint32_t back, uint8_t *mask) {
+    size_t mask_stride = tray_bg_mask_stride(w);
+    uint32_t pixel;
+
+    back &= 0xffffff;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *row = data + (size_t)y * stride;
+        uint8_t *mask_row = mask + (size_t)y * mask_stride;
+        int x = 0;
+
+#ifdef __SSE2__
+        const __m128i rgb_mask = _mm_set1_epi32(0xffffff);
+        const __m128i back4 = _mm_set1_epi32(back);
+
+        /* 8 pixels -> 1 mask byte */
+        for (; x + 8 <= w; x += 8) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 4));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(row + (size_t)x * 4 + 16));
+            int eq_lo = _mm_movemask_ps(_mm_castsi128_ps(
+                        _mm_cmpeq_epi32(_mm_and_si128(lo, rgb_mask), back4)));
+            int eq_hi = _mm_movemask_ps(_mm_castsi128_ps(
+                        _mm_cmpeq_epi32(_mm_and_si128(hi, rgb_mask), back4)));
+            mask_row[x / 8] = ~(eq_lo | eq_hi << 4);
+        }
+#endif
+        for (; x < w; x++) {
+            memcpy(&pixel, row + (size_t)x * 4, 4);
+            if ((pixel & 0xffffff) != back)
+                mask_row[x / 8] |= 1 << (x % 8);
+            else
+                mask_row[x / 8] &= ~(1 << (x % 8));
+        }
+    }
+}
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 27) | (h >> 37);
+    return h * 0xbf58476d1ce4e5b9ULL;
+}
+
+uint64_t hash_image_region(const uint8_t *data, size_t stride,
+        int x, int y, int w, int h) {
+    uint64_t hash = hash_mix(0, ((uint64_t)w << 32) | (uint32_t)h);
+
+    for (int row = 0; row < h; row++) {
+        const uint8_t *p = data + (size_t)(y + row) * stride + (size_t)x * 4;
+        size_t len = (size_t)w * 4, i;
+        uint64_t v;
+
+        for (i = 0; i + 8 <= len; i += 8) {
+            memcpy(&v, p + i, 8);
+            hash = hash_mix(hash, v);
+        }
+        if (i < len) {
+            uint32_t tail;
+            memcpy(&tail, p + i, 4);
+            hash = hash_mix(hash, tail);
+        }
+    }
+    return hash ^ (hash >> 31);
+}
+
+uint32_t ebuf_delay_lower_bound(int64_t prev_release_time, int64_t current_time,
+        uint32_t max_delay)
+{
+    int64_t lower_bound = prev_release_time - current_time;
+
+    if (lower_bound < 0)
+        return 0;
+    if (lower_bound > max_delay)
+        return max_delay;
+    return (uint32_t)lower_bound;
+}
+
+bool ebuf_delay_from_random(uint32_t random, uint32_t upper_bound,
+        uint32_t lower_bound, uint32_t *delay)
+{
+    uint32_t maxval;
+
+    assert(lower_bound < upper_bound);
+    maxval = upper_bound - lower_bound + 1;
+    if (random > UINT32_MAX - ((uint32_t)((((uint64_t)UINT32_MAX) + 1) % maxval)))
+        return false;
+    *delay = lower_bound + random % maxval;
+    return true;
+}
+
+int64_t ebuf_release_time(int64_t prev_release_time, int64_t current_time,
+        uint32_t max_delay_ms, uint32_t (*random)(void *opaque), void *opaque)
+{
+    uint32_t upper_bound = max_delay_ms * 1000;
+    uint32_t lower_bound, delay;
+    /* round up, so the event is never released before it was received;
+     * release times are always whole us */
+    int64_t current_us = (current_time + 999) / 1000;
+
+    /*
+     * Each event is scheduled by taking the current time and adding a delay.
+     * We do not want events later in the queue having a release timestamp
+     * that is *less* than an event earlier in the queue. This means that
+     * whatever delay we add *must* be at least enough to give a release
+     * timestamp larger than the one generated last time. To facilitate this,
+     * we set lower_bound to the scheduled release time of the last event
+     * minus the current time. Some sanity checks are included to make sure
+     * lower_bound is never less than 0 or greater than the maximum delay.
+     */
+    lower_bound = ebuf_delay_lower_bound(prev_release_time / 1000, current_us,
+            upper_bound);
+    if (lower_bound >= upper_bound)
+        delay = upper_bound;
+    else
+        while (!ebuf_delay_from_random(random(opaque), upper_bound,
+                    lower_bound, &delay))
+            ;
+    return (current_us + delay) * 1000;
+}
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) do { \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7); \
+} while (0)
+
+void chacha20_block(const uint32_t key[8], uint32_t counter,
+        const uint32_t nonce[3], uint32_t out[16])
+{
+    uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        counter, nonce[0], nonce[1], nonce[2],
+    };
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++)
+        out[i] = x[i] + in[i];
+}
+
+void chacha_rng_seed(struct chacha_rng *rng, const uint32_t seed[8])
+{
+    memcpy(rng->key, seed, sizeof(rng->key));
+    memset(rng->buf, 0, sizeof(rng->buf));
+    rng->avail = 0;
+}
+
+static void chacha_rng_refill(struct chacha_rng *rng)
+{
+    static const uint32_t nonce[3];
+    uint32_t b;
+
+    /* each key is used only once, so the counter can always start at 0 */
+    for (b = 0; b < CHACHA_RNG_BLOCKS; b++)
+        chacha20_block(rng->key, b, nonce, rng->buf + 16 * b);
+    memcpy(rng->key, rng->buf, sizeof(rng->key));
+    memset(rng->buf, 0, sizeof(rng->key));
+    rng->avail = 16 * CHACHA_RNG_BLOCKS - 8;
+}
+
+uint32_t chacha_rng_u32(struct chacha_rng *rng)
+{
+    uint32_t *word;
+    uint32_t val;
+
+    if (!rng->avail)
+        chacha_rng_refill(rng);
+    word = &rng->buf[16 * CHACHA_RNG_BLOCKS - rng->avail--];
+    val = *word;
+    *word = 0;
+    return val;
+}
@@ -0,0 +1,161 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_GUID_HOTPATH_H
+#define QUBES_GUID_HOTPATH_H QUBES_GUID_HOTPATH_H
+
+/* Pure helpers used on hot paths of qubes-guid. They do not touch X server,
+ * vchan or global state, so they are also built as libguid-hotpath.a for
+ * bench/guid-microbench. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* do_shm_update() */
+
+struct shm_clip_geometry {
+    bool screen_image;          /* clip against the full-screen image, window
+                                   at (win_x, win_y) */
+    int win_x, win_y;
+    int win_width, win_height;  /* window size */
+    int image_width, image_height; /* window (or screen) image size, window
+                                      size if there is no image */
+    int border_width;           /* forced frame, 0 if none */
+};
+
+enum shm_clip_result {
+    SHM_CLIP_NOTHING,       /* nothing to update */
+    SHM_CLIP_FRAME_ONLY,    /* window is entirely covered by the forced frame */
+    SHM_CLIP_UPDATE,        /* update the returned rectangle */
+};
+
+/* clip non-negative update rectangle x, y, w, h to the image and to the
+ * inside of the forced frame; *do_border is set if the frame needs to be
+ * redrawn */
+enum shm_clip_result shm_update_clip(const struct shm_clip_geometry *geo,
+        int *x, int *y, int *w, int *h, bool *do_border);
+
+/* strings from VM */
+
+/* return bytes count of UTF-8 character, or 0 if the character is invalid */
+int validate_utf8_char(unsigned char *untrusted_c);
+/* replace non-printable characters with '_'
+ * given string must be NULL terminated already */
+void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8);
+/* byte by byte reference implementation of the above */
+void sanitize_string_from_vm_scalar(unsigned char *untrusted_s, int allow_utf8);
+
+/* tray icon tinting */
+
+void rgb_to_hls(uint32_t rgb, double *out_h, double *out_l, double *out_s);
+uint32_t hls_to_rgb(double h, double l, double s);
+/* tint single 0xRRGGBB pixel, double precision reference */
+uint32_t tint_pixel(uint32_t pixel, double tint_h, double tint_s, bool whitehack);
+
+/* Tinting keeps only the lightness of a pixel, which is (max + min) / 2 of
+ * its channels. tint_lut maps max + min (0..510) to the tinted color, so
+ * the kernels are integer only and all produce identical output. */
+#define TINT_LUT_SIZE 511
+
+struct tint_lut {
+    uint32_t rgb[TINT_LUT_SIZE];
+};
+
+void tint_lut_init(struct tint_lut *lut, double tint_h, double tint_s);
+
+static inline uint32_t tint_lut_pixel(const struct tint_lut *lut,
+        uint32_t pixel, bool whitehack) {
+    uint32_t r = (pixel >> 16) & 0xff, g = (pixel >> 8) & 0xff, b = pixel & 0xff;
+    uint32_t maxc = r > g ? r : g, minc = r < g ? r : g;
+
+    if (whitehack && (pixel & 0xffffff) == 0xffffff)
+        return 0xfefefe;
+    if (b > maxc)
+        maxc = b;
+    if (b < minc)
+        minc = b;
+    return lut->rgb[maxc + minc];
+}
+
+/* tint count 32bpp 0x??RRGGBB pixels in place */
+typedef void tint_pixels_fn(const struct tint_lut *lut, uint32_t *pixels,
+        size_t count, bool whitehack);
+
+tint_pixels_fn tint_pixels_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+tint_pixels_fn tint_pixels_sse2;
+tint_pixels_fn tint_pixels_avx2;
+#endif
+/* best implementation for this CPU; its name is stored in *name if not NULL */
+tint_pixels_fn *tint_pixels_select(const char **name);
+
+/* Transparency mask of a 32bpp tray icon (TRAY_BACKGROUND mode): bit set
+ * for pixels different from the background (top-left) one. The mask is in
+ * XCreateBitmapFromData() format: LSB first, rows padded to whole bytes. */
+static inline size_t tray_bg_mask_stride(int w) {
+    return ((size_t)w + 7) / 8;
+}
+/* compute given number of mask rows from image rows of width w */
+void tray_bg_mask_rows(const uint8_t *data, size_t stride, int w, int rows,
+        uint32_t back, uint8_t *mask);
+
+/* fast non-cryptographic hash of a w x h region of 32bpp image with given
+ * stride (in bytes) */
+uint64_t hash_image_region(const uint8_t *data, size_t stride,
+        int x, int y, int w, int h);
+
+/* input events buffering */
+
+/* Release time (CLOCK_MONOTONIC ns) of an input event received at
+ * current_time: current time plus a uniformly distributed random delay of
+ * at most max_delay_ms, but not before the previously queued event, so the
+ * order is kept. The delay has us resolution. */
+int64_t ebuf_release_time(int64_t prev_release_time, int64_t current_time,
+        uint32_t max_delay_ms, uint32_t (*random)(void *opaque), void *opaque);
+
+/* minimal delay of the next event, so it is not released before previous one */
+uint32_t ebuf_delay_lower_bound(int64_t prev_release_time, int64_t current_time,
+        uint32_t max_delay);
+/* map random value uniformly to [lower_bound, upper_bound], lower_bound must
+ * be less than upper_bound; returns false if the value needs to be rejected
+ * (and new one drawn) to avoid modulo bias */
+bool ebuf_delay_from_random(uint32_t random, uint32_t upper_bound,
+        uint32_t lower_bound, uint32_t *delay);
+
+/* ChaCha20 block function (RFC 7539) */
+void chacha20_block(const uint32_t key[8], uint32_t counter,
+        const uint32_t nonce[3], uint32_t out[16]);
+
+/* Buffered random number generator for the delays: ChaCha20 keystream,
+ * generated a few blocks at a time. After each refill the key is replaced
+ * with the first part of the new output and used words are cleared, so
+ * already returned values cannot be recovered from the state. */
+#define CHACHA_RNG_BLOCKS 4
+struct chacha_rng {
+    uint32_t key[8];
+    uint32_t buf[16 * CHACHA_RNG_BLOCKS];
+    unsigned int avail;      /* unused words at the end of buf */
+};
+
+/* seed must come from a CSPRNG (getrandom()) */
+void chacha_rng_seed(struct chacha_rng *rng, const uint32_t seed[8]);
+uint32_t chacha_rng_u32(struct chacha_rng *rng);
+
+#endif /* QUBES_GUID_HOTPATH_H */
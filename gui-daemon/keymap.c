@@ -0,0 +1,275 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XKBfile.h>
+#include <X11/extensions/XKBrules.h>
+#include <qubesdb-client.h>
+#include "keymap.h"
+
+#define XKB_RULES_DIR "/usr/share/X11/xkb/rules/"
+/* one file per X server, shared by all guids running there */
+#define KEYMAP_CACHE_PREFIX "/var/run/qubes/guid-keymap."
+#define KEYMAP_MAX_SIZE 16384
+
+/* The cache is valid only for the XKB rules names it was generated from,
+ * and the version of the rules file (its mtime and size, so an
+ * xkeyboard-config update invalidates it); they are stored in front of the
+ * keymap, one per line. */
+static char *rules_names_key(const char *rules_path, const XkbRF_VarDefsRec *vd)
+{
+    struct stat st;
+    char *key;
+
+    if (stat(rules_path, &st) < 0) {
+        fprintf(stderr, "Cannot stat XKB rules %s: %s\n", rules_path,
+                strerror(errno));
+        return NULL;
+    }
+    if (asprintf(&key, "%s\n%lld.%09ld %lld\n%s\n%s\n%s\n%s\n\n", rules_path,
+                 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                 (long long)st.st_size,
+                 vd->model ? vd->model : "",
+                 vd->layout ? vd->layout : "",
+                 vd->variant ? vd->variant : "",
+                 vd->options ? vd->options : "") < 0)
+        return NULL;
+    return key;
+}
+
+static void keymap_cache_path(Display *dpy, char *path, size_t size)
+{
+    const char *display = DisplayString(dpy);
+    size_t len = strlen(KEYMAP_CACHE_PREFIX);
+    size_t i;
+
+    if (size <= len)
+        abort();
+    memcpy(path, KEYMAP_CACHE_PREFIX, len);
+    for (i = 0; display[i] && len + 1 < size; i++, len++) {
+        char c = display[i];
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') || c == ':' || c == '.')
+            path[len] = c;
+        else
+            path[len] = '_';
+    }
+    path[len] = '\0';
+}
+
+static char *read_cached_keymap(const char *path, const char *key)
+{
+    char buf[KEYMAP_MAX_SIZE + 1];
+    size_t key_len = strlen(key);
+    size_t len = 0;
+    ssize_t ret = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY|O_NOCTTY|O_NOFOLLOW|O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    while (len < sizeof(buf)) {
+        ret = read(fd, buf + len, sizeof(buf) - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len += ret;
+    }
+    close(fd);
+    if (ret < 0 || len > KEYMAP_MAX_SIZE || len <= key_len ||
+            memcmp(buf, key, key_len) != 0)
+        return NULL;
+    return strndup(buf + key_len, len - key_len);
+}
+
+static void write_cached_keymap(const char *path, const char *key,
+                                const char *keymap)
+{
+    char tmp_path[PATH_MAX];
+    FILE *f;
+    int fd;
+
+    if ((unsigned)snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path)
+            >= sizeof(tmp_path))
+        return;
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        perror("mkostemp keymap cache");
+        return;
+    }
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    if (fputs(key, f) == EOF || fputs(keymap, f) == EOF) {
+        fclose(f);
+        unlink(tmp_path);
+        return;
+    }
+    /* rename() makes the new cache visible to other guids atomically */
+    if (fclose(f) == EOF || rename(tmp_path, path) < 0) {
+        perror("write keymap cache");
+        unlink(tmp_path);
+    }
+}
+
+/* equivalent of "setxkbmap -print" */
+static char *build_keymap(char *rules_path, XkbRF_VarDefsPtr vd)
+{
+    XkbRF_RulesPtr rules;
+    XkbComponentNamesRec names;
+    XkbDescPtr xkb = NULL;
+    char *keymap = NULL;
+    size_t len = 0;
+    FILE *f = NULL;
+    bool ok = false;
+
+    rules = XkbRF_Load(rules_path, "C", True, True);
+    if (!rules) {
+        fprintf(stderr, "Cannot load XKB rules %s\n", rules_path);
+        return NULL;
+    }
+    memset(&names, 0, sizeof(names));
+    if (!XkbRF_GetComponents(rules, vd, &names)) {
+        fprintf(stderr, "Cannot resolve XKB components from %s\n", rules_path);
+        goto out;
+    }
+    xkb = XkbAllocKeyboard();
+    f = open_memstream(&keymap, &len);
+    if (!xkb || !f)
+        goto out;
+    ok = XkbWriteXKBKeymapForNames(f, &names, NULL, xkb, 0, 0);
+out:
+    if (f && fclose(f) == EOF)
+        ok = false;
+    if (!ok) {
+        fprintf(stderr, "Cannot build keymap description\n");
+        free(keymap);
+        keymap = NULL;
+    }
+    if (xkb)
+        XkbFreeKeyboard(xkb, 0, True);
+    free(names.keymap);
+    free(names.keycodes);
+    free(names.types);
+    free(names.compat);
+    free(names.symbols);
+    free(names.geometry);
+    XkbRF_Free(rules, True);
+    return keymap;
+}
+
+static void export_keymap_child(char *rules_file, XkbRF_VarDefsPtr vd,
+                                const char *cache_path, const char *vmname)
+{
+    char qdb_path[] = "/qubes-keyboard";
+    char rules_path[PATH_MAX];
+    char *key, *keymap;
+    qdb_handle_t qdb;
+
+    if ((unsigned)snprintf(rules_path, sizeof(rules_path), "%s%s",
+                rules_file[0] == '/' ? "" : XKB_RULES_DIR, rules_file)
+            >= sizeof(rules_path))
+        return;
+    key = rules_names_key(rules_path, vd);
+    if (!key)
+        return;
+    keymap = read_cached_keymap(cache_path, key);
+    if (!keymap) {
+        keymap = build_keymap(rules_path, vd);
+        if (!keymap)
+            return;
+        write_cached_keymap(cache_path, key, keymap);
+    }
+    /* qubesdb API does not take const strings */
+    qdb = qdb_open((char *)vmname);
+    if (!qdb) {
+        fprintf(stderr, "Cannot connect to QubesDB of %s: %s\n",
+                vmname, strerror(errno));
+        return;
+    }
+    if (!qdb_write(qdb, qdb_path, keymap, strlen(keymap)))
+        fprintf(stderr, "Failed to write QubesDB %s: %s\n",
+                qdb_path, strerror(errno));
+    qdb_close(qdb);
+}
+
+pid_t export_keymap_start(Display *dpy, const char *vmname)
+{
+    char cache_path[PATH_MAX];
+    char *rules_file = NULL;
+    XkbRF_VarDefsRec vd;
+    pid_t pid = -1;
+
+    memset(&vd, 0, sizeof(vd));
+    /* the only part that talks to the X server: _XKB_RULES_NAMES property */
+    if (!XkbRF_GetNamesProp(dpy, &rules_file, &vd) || !rules_file) {
+        fprintf(stderr, "Cannot get XKB rules names, keyboard layout not exported\n");
+        goto out;
+    }
+    keymap_cache_path(dpy, cache_path, sizeof(cache_path));
+
+    switch (pid = fork()) {
+        case -1:
+            perror("fork");
+            break;
+        case 0:
+            /* in case of error do not use exit() in child to not fire
+             * atexit() registered functions; use _exit() instead.
+             * The caller may not have dropped root privileges yet. */
+            if (setgid(getgid()) < 0 || setuid(getuid()) < 0) {
+                perror("drop privileges");
+                _exit(1);
+            }
+            export_keymap_child(rules_file, &vd, cache_path, vmname);
+            _exit(0);
+    }
+out:
+    free(rules_file);
+    free(vd.model);
+    free(vd.layout);
+    free(vd.variant);
+    free(vd.options);
+    return pid;
+}
+
+void export_keymap_wait(pid_t pid)
+{
+    int status;
+
+    if (pid <= 0)
+        return;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+}
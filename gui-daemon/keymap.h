@@ -0,0 +1,35 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_GUID_KEYMAP_H
+#define QUBES_GUID_KEYMAP_H QUBES_GUID_KEYMAP_H
+
+#include <sys/types.h>
+#include <X11/Xlib.h>
+
+/* Start writing the keyboard layout of dpy (in "setxkbmap -print" format)
+ * to /qubes-keyboard in QubesDB of the given VM. Only the XKB rules names
+ * are read synchronously; the keymap is resolved and written by a child
+ * process, using a cache shared by all guids of the same X server. Returns
+ * its pid, or -1 if nothing is being written. */
+pid_t export_keymap_start(Display *dpy, const char *vmname);
+/* wait until the child started by export_keymap_start() is done */
+void export_keymap_wait(pid_t pid);
+
+#endif /* QUBES_GUID_KEYMAP_H */
@@ -0,0 +1,368 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *const msg_names[STATS_MSG_TYPES] = {
+    [MSG_KEYPRESS - MSG_MIN] = "KEYPRESS",
+    [MSG_BUTTON - MSG_MIN] = "BUTTON",
+    [MSG_MOTION - MSG_MIN] = "MOTION",
+    [MSG_CROSSING - MSG_MIN] = "CROSSING",
+    [MSG_FOCUS - MSG_MIN] = "FOCUS",
+    [MSG_RESIZE - MSG_MIN] = "RESIZE",
+    [MSG_CREATE - MSG_MIN] = "CREATE",
+    [MSG_DESTROY - MSG_MIN] = "DESTROY",
+    [MSG_MAP - MSG_MIN] = "MAP",
+    [MSG_UNMAP - MSG_MIN] = "UNMAP",
+    [MSG_CONFIGURE - MSG_MIN] = "CONFIGURE",
+    [MSG_MFNDUMP - MSG_MIN] = "MFNDUMP",
+    [MSG_SHMIMAGE - MSG_MIN] = "SHMIMAGE",
+    [MSG_CLOSE - MSG_MIN] = "CLOSE",
+    [MSG_EXECUTE - MSG_MIN] = "EXECUTE",
+    [MSG_CLIPBOARD_REQ - MSG_MIN] = "CLIPBOARD_REQ",
+    [MSG_CLIPBOARD_DATA - MSG_MIN] = "CLIPBOARD_DATA",
+    [MSG_WMNAME - MSG_MIN] = "WMNAME",
+    [MSG_KEYMAP_NOTIFY - MSG_MIN] = "KEYMAP_NOTIFY",
+    [MSG_DOCK - MSG_MIN] = "DOCK",
+    [MSG_WINDOW_HINTS - MSG_MIN] = "WINDOW_HINTS",
+    [MSG_WINDOW_FLAGS - MSG_MIN] = "WINDOW_FLAGS",
+    [MSG_WMCLASS - MSG_MIN] = "WMCLASS",
+    [MSG_WINDOW_DUMP - MSG_MIN] = "WINDOW_DUMP",
+    [MSG_CURSOR - MSG_MIN] = "CURSOR",
+    [MSG_WINDOW_DUMP_ACK - MSG_MIN] = "WINDOW_DUMP_ACK",
+};
+
+static const char *const xevent_names[LASTEvent] = {
+    [KeyPress] = "KeyPress",
+    [KeyRelease] = "KeyRelease",
+    [ButtonPress] = "ButtonPress",
+    [ButtonRelease] = "ButtonRelease",
+    [MotionNotify] = "MotionNotify",
+    [EnterNotify] = "EnterNotify",
+    [LeaveNotify] = "LeaveNotify",
+    [FocusIn] = "FocusIn",
+    [FocusOut] = "FocusOut",
+    [KeymapNotify] = "KeymapNotify",
+    [Expose] = "Expose",
+    [GraphicsExpose] = "GraphicsExpose",
+    [NoExpose] = "NoExpose",
+    [VisibilityNotify] = "VisibilityNotify",
+    [CreateNotify] = "CreateNotify",
+    [DestroyNotify] = "DestroyNotify",
+    [UnmapNotify] = "UnmapNotify",
+    [MapNotify] = "MapNotify",
+    [MapRequest] = "MapRequest",
+    [ReparentNotify] = "ReparentNotify",
+    [ConfigureNotify] = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [GravityNotify] = "GravityNotify",
+    [ResizeRequest] = "ResizeRequest",
+    [CirculateNotify] = "CirculateNotify",
+    [CirculateRequest] = "CirculateRequest",
+    [PropertyNotify] = "PropertyNotify",
+    [SelectionClear] = "SelectionClear",
+    [SelectionRequest] = "SelectionRequest",
+    [SelectionNotify] = "SelectionNotify",
+    [ColormapNotify] = "ColormapNotify",
+    [ClientMessage] = "ClientMessage",
+    [MappingNotify] = "MappingNotify",
+    [GenericEvent] = "GenericEvent",
+};
+
+int64_t stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* short message name (without MSG_ prefix), NULL if unknown */
+const char *stats_msg_name(uint32_t type)
+{
+    if (type <= MSG_MIN || type >= MSG_MAX)
+        return NULL;
+    return msg_names[type - MSG_MIN];
+}
+
+void stats_init(struct guid_stats *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->start_ns = stats_now_ns();
+}
+
+static const char *const startup_phase_names[STATS_STARTUP_PHASES] = {
+    [STATS_STARTUP_CONFIG] = "config",
+    [STATS_STARTUP_BOOT_LOCK] = "boot_lock",
+    [STATS_STARTUP_DAEMONIZE] = "daemonize",
+    [STATS_STARTUP_X_CONNECT] = "x_connect",
+    [STATS_STARTUP_VCHAN] = "vchan_connect",
+    [STATS_STARTUP_PROTOCOL] = "protocol_version",
+    [STATS_STARTUP_KEYMAP] = "keymap_written",
+    [STATS_STARTUP_FIRST_CREATE] = "first_create",
+    [STATS_STARTUP_FIRST_DUMP] = "first_window_dump",
+    [STATS_STARTUP_FIRST_SHMIMAGE] = "first_shmimage",
+};
+
+static void startup_phase_log(const struct guid_stats *s,
+        enum stats_startup_phase phase)
+{
+    fprintf(stderr, "startup: %s after %.3f ms\n", startup_phase_names[phase],
+            s->startup_ns[phase] / 1e6);
+}
+
+/* record when a startup phase was first reached */
+void stats_startup_phase(struct guid_stats *s, enum stats_startup_phase phase)
+{
+    if (s->startup_ns[phase])
+        return;
+    s->startup_ns[phase] = stats_now_ns() - s->start_ns;
+    /* 0 means "not reached" */
+    if (!s->startup_ns[phase])
+        s->startup_ns[phase] = 1;
+    if (s->startup_logging)
+        startup_phase_log(s, phase);
+}
+
+/* start logging phases, once stderr goes to the log; phases reached so far
+ * are logged now */
+void stats_startup_log(struct guid_stats *s)
+{
+    int i;
+
+    s->startup_logging = true;
+    for (i = 0; i < STATS_STARTUP_PHASES; i++)
+        if (s->startup_ns[i])
+            startup_phase_log(s, i);
+}
+
+void stats_account_message(struct guid_stats *s, uint32_t type, uint32_t len,
+        int64_t handler_ns, unsigned long x_requests)
+{
+    struct msg_type_stats *m;
+
+    if (type <= MSG_MIN || type >= MSG_MAX)
+        return;
+    m = &s->msg[type - MSG_MIN];
+    m->count++;
+    m->bytes += len;
+    if (handler_ns > 0) {
+        m->handler_ns += handler_ns;
+        if ((uint64_t)handler_ns > m->handler_max_ns)
+            m->handler_max_ns = handler_ns;
+    }
+    m->x_requests += x_requests;
+    if (m->count == 1) {
+        if (type == MSG_CREATE)
+            stats_startup_phase(s, STATS_STARTUP_FIRST_CREATE);
+        else if (type == MSG_WINDOW_DUMP)
+            stats_startup_phase(s, STATS_STARTUP_FIRST_DUMP);
+        else if (type == MSG_SHMIMAGE)
+            stats_startup_phase(s, STATS_STARTUP_FIRST_SHMIMAGE);
+    }
+}
+
+void stats_account_xevent(struct guid_stats *s, int type, int64_t handler_ns)
+{
+    struct xevent_type_stats *e;
+
+    if (type < 0 || type >= LASTEvent)
+        return;
+    e = &s->xevent[type];
+    e->count++;
+    if (handler_ns > 0) {
+        e->handler_ns += handler_ns;
+        if ((uint64_t)handler_ns > e->handler_max_ns)
+            e->handler_max_ns = handler_ns;
+    }
+}
+
+static const char *const input_class_names[STATS_INPUT_CLASSES] = {
+    [STATS_INPUT_KEY] = "key",
+    [STATS_INPUT_BUTTON] = "button",
+    [STATS_INPUT_MOTION] = "motion",
+};
+
+/* latency class of an X event, -1 if it is not an input event */
+int stats_input_class(int xevent_type)
+{
+    switch (xevent_type) {
+    case KeyPress:
+    case KeyRelease:
+        return STATS_INPUT_KEY;
+    case ButtonPress:
+    case ButtonRelease:
+        return STATS_INPUT_BUTTON;
+    case MotionNotify:
+        return STATS_INPUT_MOTION;
+    default:
+        return -1;
+    }
+}
+
+static void latency_account(struct latency_histogram *h, int64_t ns)
+{
+    uint64_t us;
+    int bucket = 0;
+
+    if (ns < 0)
+        ns = 0;
+    h->count++;
+    h->sum_ns += ns;
+    if ((uint64_t)ns > h->max_ns)
+        h->max_ns = ns;
+    for (us = ns / 1000; us && bucket < STATS_LATENCY_BUCKETS - 1; us >>= 1)
+        bucket++;
+    h->buckets[bucket]++;
+}
+
+/* input event handler queued a message ending at given vchan byte offset */
+void stats_input_queued(struct guid_stats *s, enum stats_input_class cls,
+        uint64_t end_offset, int64_t recv_ns, int64_t release_ns,
+        int64_t queued_ns)
+{
+    struct stats_pending_input *p;
+
+    if (s->pending_count == STATS_PENDING_INPUTS) {
+        s->pending_dropped++;
+        return;
+    }
+    p = &s->pending[(s->pending_head + s->pending_count) % STATS_PENDING_INPUTS];
+    p->end_offset = end_offset;
+    p->recv_ns = recv_ns;
+    p->release_ns = release_ns;
+    p->queued_ns = queued_ns;
+    p->cls = cls;
+    s->pending_count++;
+}
+
+/* account input events whose messages were fully written to the vchan */
+void stats_input_sent(struct guid_stats *s, uint64_t sent_offset)
+{
+    int64_t now = 0;
+
+    while (s->pending_count) {
+        const struct stats_pending_input *p = &s->pending[s->pending_head];
+        struct input_latency_stats *l = &s->input[p->cls];
+
+        if (p->end_offset > sent_offset)
+            break;
+        if (!now)
+            now = stats_now_ns();
+        latency_account(&l->total, now - p->recv_ns);
+        latency_account(&l->ebuf, p->release_ns - p->recv_ns);
+        latency_account(&l->backpressure, now - p->queued_ns);
+        s->pending_head = (s->pending_head + 1) % STATS_PENDING_INPUTS;
+        s->pending_count--;
+    }
+}
+
+static void latency_write_json(const struct latency_histogram *h, FILE *file)
+{
+    int i, last = -1;
+
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++)
+        if (h->buckets[i])
+            last = i;
+    fprintf(file, "{\"count\":%" PRIu64 ",\"sum_ns\":%" PRIu64
+            ",\"max_ns\":%" PRIu64 ",\"buckets_log2_us\":[",
+            h->count, h->sum_ns, h->max_ns);
+    for (i = 0; i <= last; i++)
+        fprintf(file, "%s%" PRIu64, i ? "," : "", h->buckets[i]);
+    fprintf(file, "]}");
+}
+
+/* Save in JSON format, keys always inside "" (double-quotes) */
+void stats_write_json(const struct guid_stats *s, const char *vmname, FILE *file)
+{
+    int i, first = 1;
+
+    fprintf(file, "{\n");
+    fprintf(file, "\"vmname\":\"%s\",\n", vmname);
+    fprintf(file, "\"uptime_ns\":%" PRId64 ",\n", stats_now_ns() - s->start_ns);
+    fprintf(file, "\"startup_ns\":{");
+    for (i = 0; i < STATS_STARTUP_PHASES; i++) {
+        if (!s->startup_ns[i])
+            continue;
+        fprintf(file, "%s\"%s\":%" PRId64, first ? "" : ",",
+                startup_phase_names[i], s->startup_ns[i]);
+        first = 0;
+    }
+    fprintf(file, "},\n");
+    fprintf(file, "\"messages\":{");
+    for (i = 0, first = 1; i < STATS_MSG_TYPES; i++) {
+        const struct msg_type_stats *m = &s->msg[i];
+
+        if (!m->count || !msg_names[i])
+            continue;
+        fprintf(file, "%s\n\"%s\":{\"count\":%" PRIu64 ",\"bytes\":%" PRIu64
+                ",\"handler_ns\":%" PRIu64 ",\"handler_max_ns\":%" PRIu64
+                ",\"x_requests\":%" PRIu64 "}",
+                first ? "" : ",", msg_names[i], m->count, m->bytes,
+                m->handler_ns, m->handler_max_ns, m->x_requests);
+        first = 0;
+    }
+    fprintf(file, "\n},\n");
+    fprintf(file, "\"xevents\":{");
+    for (i = 0, first = 1; i < LASTEvent; i++) {
+        const struct xevent_type_stats *e = &s->xevent[i];
+
+        if (!e->count || !xevent_names[i])
+            continue;
+        fprintf(file, "%s\n\"%s\":{\"count\":%" PRIu64 ",\"handler_ns\":%" PRIu64
+                ",\"handler_max_ns\":%" PRIu64 "}",
+                first ? "" : ",", xevent_names[i], e->count, e->handler_ns,
+                e->handler_max_ns);
+        first = 0;
+    }
+    fprintf(file, "\n},\n");
+    fprintf(file, "\"tray_cache\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "}\n",
+            s->tray_cache_hits, s->tray_cache_misses);
+    fprintf(file, ",\"keymap\":{\"cached\":%" PRIu64 ",\"events\":%" PRIu64
+            ",\"queries\":%" PRIu64 "}\n",
+            s->keymap_cached, s->keymap_events, s->keymap_queries);
+    fprintf(file, ",\"frame_geometry\":{\"local\":%" PRIu64 ",\"queries\":%" PRIu64
+            ",\"mismatches\":%" PRIu64 "}\n",
+            s->frame_local, s->frame_queries, s->frame_mismatches);
+    fprintf(file, ",\"xevent_batches\":{\"count\":%" PRIu64
+            ",\"motion_coalesced\":%" PRIu64 "}\n",
+            s->xevent_batches, s->motion_coalesced);
+    fprintf(file, ",\"titles_suppressed\":%" PRIu64 "\n",
+            s->titles_suppressed);
+    fprintf(file, ",\"input_latency\":{");
+    for (i = 0; i < STATS_INPUT_CLASSES; i++) {
+        const struct input_latency_stats *l = &s->input[i];
+
+        fprintf(file, "%s\n\"%s\":{\"total\":", i ? "," : "",
+                input_class_names[i]);
+        latency_write_json(&l->total, file);
+        fprintf(file, ",\"ebuf\":");
+        latency_write_json(&l->ebuf, file);
+        fprintf(file, ",\"backpressure\":");
+        latency_write_json(&l->backpressure, file);
+        fprintf(file, "}");
+    }
+    fprintf(file, ",\n\"pending\":%u,\"dropped\":%" PRIu64 "\n}\n",
+            s->pending_count, s->pending_dropped);
+    fprintf(file, "}\n");
+}
@@ -0,0 +1,141 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef QUBES_GUID_STATS_H
+#define QUBES_GUID_STATS_H QUBES_GUID_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <X11/X.h>
+#include <qubes-gui-protocol.h>
+
+/* index into guid_stats.msg is (msg type - MSG_MIN) */
+#define STATS_MSG_TYPES (MSG_MAX - MSG_MIN)
+
+/* counters for a single VM message type */
+struct msg_type_stats {
+    uint64_t count;          /* messages handled */
+    uint64_t bytes;          /* body bytes, as declared in the header */
+    uint64_t handler_ns;     /* total handling time, including reading the body */
+    uint64_t handler_max_ns; /* slowest single message */
+    uint64_t x_requests;     /* X requests issued while handling (as counted by Xlib) */
+};
+
+/* counters for a single local X event type */
+struct xevent_type_stats {
+    uint64_t count;
+    uint64_t handler_ns;
+    uint64_t handler_max_ns;
+};
+
+/* log2 of microseconds: bucket 0 is < 1us, bucket i is [2^(i-1), 2^i) us,
+ * the last one collects everything above */
+#define STATS_LATENCY_BUCKETS 24
+
+struct latency_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_LATENCY_BUCKETS];
+};
+
+enum stats_input_class {
+    STATS_INPUT_KEY,
+    STATS_INPUT_BUTTON,
+    STATS_INPUT_MOTION,
+    STATS_INPUT_CLASSES
+};
+
+/* latency of local input events, until their message is written to vchan */
+struct input_latency_stats {
+    struct latency_histogram total;        /* X event received -> written to vchan */
+    struct latency_histogram ebuf;         /* part spent in the ebuf delay queue */
+    struct latency_histogram backpressure; /* part spent in the double buffer */
+};
+
+/* input event whose message is still (partly) in the double buffer */
+struct stats_pending_input {
+    uint64_t end_offset;     /* vchan_bytes_queued after the message */
+    int64_t recv_ns;         /* received from the X server */
+    int64_t release_ns;      /* released from the ebuf queue */
+    int64_t queued_ns;       /* message passed to write_data() */
+    enum stats_input_class cls;
+};
+
+#define STATS_PENDING_INPUTS 256
+
+/* startup milestones, in the order they are normally reached */
+enum stats_startup_phase {
+    STATS_STARTUP_CONFIG,          /* command line and config file parsed */
+    STATS_STARTUP_BOOT_LOCK,       /* got the boot lock */
+    STATS_STARTUP_DAEMONIZE,       /* forked and redirected output to the log */
+    STATS_STARTUP_X_CONNECT,       /* connected to X, mkghandles() done */
+    STATS_STARTUP_VCHAN,           /* libvchan_client_init() returned */
+    STATS_STARTUP_PROTOCOL,        /* protocol version negotiated */
+    STATS_STARTUP_KEYMAP,          /* keyboard layout written to QubesDB */
+    STATS_STARTUP_FIRST_CREATE,    /* first MSG_CREATE handled */
+    STATS_STARTUP_FIRST_DUMP,      /* first MSG_WINDOW_DUMP handled */
+    STATS_STARTUP_FIRST_SHMIMAGE,  /* first MSG_SHMIMAGE handled */
+    STATS_STARTUP_PHASES
+};
+
+/* runtime statistics, dumped to /run/qubes/guid-stats.<domid> on SIGUSR2
+ * and at exit */
+struct guid_stats {
+    int64_t start_ns;        /* when the collection started */
+    /* time of each startup phase since start_ns, 0 if not reached yet */
+    int64_t startup_ns[STATS_STARTUP_PHASES];
+    bool startup_logging;    /* log phases to stderr when reached */
+    struct msg_type_stats msg[STATS_MSG_TYPES];
+    struct xevent_type_stats xevent[LASTEvent];
+    uint64_t tray_cache_hits;   /* tray icon updates reusing cached result */
+    uint64_t tray_cache_misses;
+    uint64_t keymap_cached;     /* MSG_KEYMAP_NOTIFY sent from tracked state */
+    uint64_t keymap_events;     /* MSG_KEYMAP_NOTIFY sent from KeymapNotify */
+    uint64_t keymap_queries;    /* MSG_KEYMAP_NOTIFY needing XQueryKeymap() */
+    uint64_t xevent_batches;    /* batches of X events fetched from XCB */
+    uint64_t motion_coalesced;  /* MotionNotify dropped for a later one in the same batch */
+    uint64_t titles_suppressed; /* MSG_WMNAME not applied, unchanged or superseded */
+    uint64_t frame_local;       /* window positions computed from frame geometry */
+    uint64_t frame_queries;     /* window positions needing XTranslateCoordinates() */
+    uint64_t frame_mismatches;  /* periodic checks not matching the local result */
+    struct input_latency_stats input[STATS_INPUT_CLASSES];
+    /* FIFO of input events waiting for their bytes to leave the double buffer */
+    struct stats_pending_input pending[STATS_PENDING_INPUTS];
+    unsigned int pending_head, pending_count;
+    uint64_t pending_dropped;   /* not measured because the FIFO was full */
+};
+
+int64_t stats_now_ns(void);
+const char *stats_msg_name(uint32_t type);
+void stats_init(struct guid_stats *s);
+void stats_account_message(struct guid_stats *s, uint32_t type, uint32_t len,
+        int64_t handler_ns, unsigned long x_requests);
+void stats_startup_phase(struct guid_stats *s, enum stats_startup_phase phase);
+void stats_startup_log(struct guid_stats *s);
+void stats_account_xevent(struct guid_stats *s, int type, int64_t handler_ns);
+int stats_input_class(int xevent_type);
+void stats_input_queued(struct guid_stats *s, enum stats_input_class cls,
+        uint64_t end_offset, int64_t recv_ns, int64_t release_ns,
+        int64_t queued_ns);
+void stats_input_sent(struct guid_stats *s, uint64_t sent_offset);
+void stats_write_json(const struct guid_stats *s, const char *vmname, FILE *file);
+
+#endif /* QUBES_GUID_STATS_H */
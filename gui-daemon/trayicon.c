@@ -22,59 +22,253 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
 #include <xcb/xcb.h>
-#include <math.h>
+#include <xen/gntdev.h>
 #include "xside.h"
 #include <util.h>
 #include "trayicon.h"
 
-/* initialization required for TRAY_BACKGROUND mode */
-void init_tray_bg(Ghandles *g) {
-    /* prepare graphic context for tray background */
-    XGCValues values;
-    values.foreground = WhitePixel(g->display, g->screen);
-    g->tray_gc =
-        XCreateGC(g->display, g->root_win, GCForeground, &values);
+/* Tray icons are often redrawn by the VM with unchanged content. To avoid
+ * redoing the (server round trip + per-pixel) work each time, the final
+ * result of tinting/masking is kept in a server-side pixmap, keyed by a hash
+ * of the source region. The hash is computed on a local read-only mapping
+ * of the icon grant refs. Hash collisions can only make the icon show
+ * content the VM sent earlier, so a non-cryptographic hash is fine here. */
+#define TRAY_CACHE_ENTRIES 8
+/* do not map larger images - 128x128 icon */
+#define TRAY_CACHE_MAX_PAGES 64
+
+struct tray_cache_entry {
+    uint64_t hash;
+    int x, y, w, h;             /* source region */
+    unsigned width, height;     /* result size */
+    Pixmap result;              /* None if the entry is unused */
+    uint64_t last_used;
+};
+
+struct tray_cache {
+    uint32_t refs[TRAY_CACHE_MAX_PAGES]; /* grant refs of the current image */
+    uint32_t count;             /* 0 if the image is not mappable */
+    const uint8_t *map;         /* local mapping, mapped on first use */
+    size_t map_len;
+    bool map_failed;
+    uint64_t clock;
+    struct tray_cache_entry entries[TRAY_CACHE_ENTRIES];
+    /* TRAY_BACKGROUND mode: persistent copy of the icon and its mask,
+     * updated only in the damaged rows */
+    Pixmap bg_icon, bg_mask;
+    GC bg_mask_gc;
+    uint8_t *bg_mask_bits;
+    int bg_width, bg_height;    /* 0 if not allocated */
+    uint32_t bg_back;           /* background pixel of the mask */
+    uint64_t bg_hash;           /* hash of the whole mapped image */
+    bool bg_valid;
+};
+
+/* byte order of XImage data matching uint32_t access on this machine */
+static int host_byte_order(void) {
+    const uint32_t one = 1;
+    return *(const uint8_t *)&one ? LSBFirst : MSBFirst;
 }
 
-/* Color tray icon background (use top-left corner as a "transparent" base),
- * and update image on screen. Do the operation on given area only.
- */
-void fill_tray_bg_and_update(Ghandles *g, struct windowdata *vm_window,
-        int x, int y, int w, int h) {
-    char *data, *datap;
-    size_t data_sz;
-    int xp, yp;
+static struct tray_cache *tray_cache_get(struct windowdata *vm_window) {
+    if (!vm_window->tray_cache) {
+        vm_window->tray_cache = calloc(1, sizeof(*vm_window->tray_cache));
+        if (!vm_window->tray_cache)
+            err(1, "calloc");
+    }
+    return vm_window->tray_cache;
+}
 
-    if (vm_window->shmseg == QUBES_NO_SHM_SEGMENT) {
-        /* TODO: implement screen_window handling */
+void tray_cache_set_image(Ghandles *g, struct windowdata *vm_window,
+        const uint32_t *refs, uint32_t count) {
+    struct tray_cache *cache;
+
+    tray_cache_release_image(vm_window);
+    /* only tray icons are processed locally, do not allocate the cache for
+     * every small window (menus, tooltips) */
+    if (!vm_window->is_docked || g->trayicon_mode == TRAY_BORDER ||
+            count > TRAY_CACHE_MAX_PAGES)
         return;
+    cache = tray_cache_get(vm_window);
+    memcpy(cache->refs, refs, count * sizeof(*refs));
+    cache->count = count;
+}
+
+void tray_cache_release_image(struct windowdata *vm_window) {
+    struct tray_cache *cache = vm_window->tray_cache;
+
+    if (!cache)
+        return;
+    if (cache->map)
+        munmap((void *)cache->map, cache->map_len);
+    cache->map = NULL;
+    cache->count = 0;
+    cache->map_failed = false;
+    /* new buffer, the whole mask needs to be recomputed */
+    cache->bg_valid = false;
+}
+
+static void tray_bg_free(Ghandles *g, struct tray_cache *cache) {
+    if (!cache->bg_width)
+        return;
+    XFreePixmap(g->display, cache->bg_icon);
+    XFreePixmap(g->display, cache->bg_mask);
+    XFreeGC(g->display, cache->bg_mask_gc);
+    free(cache->bg_mask_bits);
+    cache->bg_mask_bits = NULL;
+    cache->bg_width = cache->bg_height = 0;
+    cache->bg_valid = false;
+}
+
+void tray_cache_free(Ghandles *g, struct windowdata *vm_window) {
+    struct tray_cache *cache = vm_window->tray_cache;
+
+    if (!cache)
+        return;
+    tray_cache_release_image(vm_window);
+    for (int i = 0; i < TRAY_CACHE_ENTRIES; i++)
+        if (cache->entries[i].result != None)
+            XFreePixmap(g->display, cache->entries[i].result);
+    tray_bg_free(g, cache);
+    free(cache);
+    vm_window->tray_cache = NULL;
+}
+
+/* get local mapping of the window image, NULL if not available */
+static const uint8_t *tray_image_data(Ghandles *g, struct windowdata *vm_window) {
+    struct tray_cache *cache = vm_window->tray_cache;
+    struct ioctl_gntdev_map_grant_ref *gref;
+    void *map;
+    int fd;
+
+    if (!cache || !cache->count || cache->map_failed)
+        return NULL;
+    if (cache->map)
+        return cache->map;
+    /* the data is interpreted as the X server would */
+    if (ImageByteOrder(g->display) != host_byte_order())
+        goto fail;
+
+    gref = malloc(offsetof(struct ioctl_gntdev_map_grant_ref, refs) +
+            cache->count * sizeof(struct ioctl_gntdev_grant_ref));
+    if (!gref)
+        err(1, "malloc");
+    gref->count = cache->count;
+    gref->pad = 0;
+    gref->index = 0;
+    for (uint32_t i = 0; i < cache->count; i++) {
+        gref->refs[i].domid = g->domid;
+        gref->refs[i].ref = cache->refs[i];
+    }
+    if ((fd = openat(g->xen_dir_fd, "gntdev", O_RDWR|O_CLOEXEC|O_NOCTTY)) == -1) {
+        perror("open(\"/dev/xen/gntdev\")");
+        free(gref);
+        goto fail;
+    }
+    if (ioctl(fd, IOCTL_GNTDEV_MAP_GRANT_REF, gref) != 0) {
+        perror("ioctl(IOCTL_GNTDEV_MAP_GRANT_REF)");
+        free(gref);
+        close(fd);
+        goto fail;
+    }
+    cache->map_len = cache->count * 4096;
+    map = mmap(NULL, cache->map_len, PROT_READ, MAP_SHARED, fd, gref->index);
+    free(gref);
+    /* the mapping keeps the grants mapped */
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap tray icon");
+        goto fail;
     }
-    /* allocate image_width _bits_ for each image line */
-    data_sz =
-        (vm_window->image_width / 8 +
-         1) * vm_window->image_height;
-    data = datap = calloc(1, data_sz);
-    if (!data) {
-        fprintf(stderr, "malloc(%dx%x -> %zu\n",
-                vm_window->image_width, vm_window->image_height, data_sz);
-        exit(1);
+    cache->map = map;
+    return cache->map;
+
+fail:
+    /* use the X server path for this image */
+    cache->map_failed = true;
+    return NULL;
+}
+
+static struct tray_cache_entry *tray_cache_lookup(Ghandles *g,
+        struct windowdata *vm_window, uint64_t hash, int x, int y, int w, int h,
+        unsigned width, unsigned height) {
+    struct tray_cache *cache = vm_window->tray_cache;
+
+    for (int i = 0; i < TRAY_CACHE_ENTRIES; i++) {
+        struct tray_cache_entry *e = &cache->entries[i];
+
+        if (e->result != None && e->hash == hash &&
+                e->x == x && e->y == y && e->w == w && e->h == h &&
+                e->width == width && e->height == height) {
+            e->last_used = ++cache->clock;
+            g->stats.tray_cache_hits++;
+            return e;
+        }
+    }
+    g->stats.tray_cache_misses++;
+    return NULL;
+}
+
+/* replace least recently used entry, with a new result pixmap */
+static struct tray_cache_entry *tray_cache_insert(Ghandles *g,
+        struct windowdata *vm_window, uint64_t hash, int x, int y, int w, int h,
+        unsigned width, unsigned height) {
+    struct tray_cache *cache = vm_window->tray_cache;
+    struct tray_cache_entry *e = &cache->entries[0];
+
+    for (int i = 1; i < TRAY_CACHE_ENTRIES && e->result != None; i++)
+        if (cache->entries[i].result == None ||
+                cache->entries[i].last_used < e->last_used)
+            e = &cache->entries[i];
+    if (e->result != None)
+        XFreePixmap(g->display, e->result);
+    *e = (struct tray_cache_entry) {
+        .hash = hash, .x = x, .y = y, .w = w, .h = h,
+        .width = width, .height = height,
+        .result = XCreatePixmap(g->display, vm_window->local_winid,
+                width, height, 24),
+        .last_used = ++cache->clock,
+    };
+    return e;
+}
+
+/* get given region of the window image, either from the local mapping (data)
+ * or from the X server */
+static XImage *tray_get_image(Ghandles *g, struct windowdata *vm_window,
+        const uint8_t *data, int x, int y, int w, int h) {
+    XImage *image;
+
+    if (data) {
+        size_t stride = (size_t)vm_window->image_width * 4;
+        char *copy = malloc((size_t)w * h * 4);
+
+        if (!copy)
+            err(1, "malloc");
+        for (int row = 0; row < h; row++)
+            memcpy(copy + (size_t)row * w * 4,
+                    data + (size_t)(y + row) * stride + (size_t)x * 4,
+                    (size_t)w * 4);
+        image = XCreateImage(g->display, DefaultVisual(g->display, g->screen),
+                24, ZPixmap, 0, copy, w, h, 32, w * 4);
+        if (!image)
+            errx(1, "XCreateImage failed");
+        return image;
     }
 
     /* Create local pixmap, put vmside image to it
      * then get local image of the copy.
      * This is needed because XGetPixel does not seem to work
      * with XShmImage data.
-     *
-     * Always use 0,0 w+x,h+y coordinates to generate proper mask. */
-    w = w + x;
-    h = h + y;
-    if (w > vm_window->image_width)
-        w = vm_window->image_width;
-    if (h > vm_window->image_height)
-        h = vm_window->image_height;
+     */
     Pixmap pixmap =
         XCreatePixmap(g->display, vm_window->local_winid,
                 vm_window->image_width,
@@ -85,196 +279,370 @@ void fill_tray_bg_and_update(Ghandles *g, struct windowdata *vm_window,
         vm_window->image_width,
         vm_window->image_height,
         0, 0);
-    XImage *image = XGetImage(g->display, pixmap, 0, 0, w, h,
+    image = XGetImage(g->display, pixmap, x, y, w, h,
             0xFFFFFFFF, ZPixmap);
-    /* Use top-left corner pixel color as transparency color */
-    unsigned long back = XGetPixel(image, 0, 0);
-    /* Generate data for transparency mask Bitmap */
-    for (yp = 0; yp < h; yp++) {
-        int step = 0;
-        for (xp = 0; xp < w; xp++) {
-            if (datap >= data + data_sz) {
-                fprintf(stderr,
-                        "Impossible internal error\n");
-                exit(1);
-            }
-            if (XGetPixel(image, xp, yp) != back)
-                *datap |= 1 << (step % 8);
-            if (step % 8 == 7)
-                datap++;
-            step++;
-        }
-        /* ensure that new line will start at new byte */
-        if ((step - 1) % 8 != 7)
-            datap++;
+    XFreePixmap(g->display, pixmap);
+    return image;
+}
+
+/* check if RENDER extension of at least given minor version is available */
+static bool tray_render_available(Ghandles *g, int minor) {
+    int event_base, error_base, major_version = 0, minor_version = 0;
+
+    if (!XRenderQueryExtension(g->display, &event_base, &error_base) ||
+            !XRenderQueryVersion(g->display, &major_version, &minor_version) ||
+            (major_version == 0 && minor_version < minor)) {
+        fprintf(stderr, "RENDER extension 0.%d not available, "
+                "processing tray icons on the client side\n", minor);
+        return false;
     }
-    Pixmap mask = XCreateBitmapFromData(g->display,
-            vm_window->local_winid,
-            data, w, h);
-    /* set trayicon background to white color */
-    XFillRectangle(g->display, vm_window->local_winid,
-            g->tray_gc, 0, 0, vm_window->width,
-            vm_window->height);
-    /* Paint clipped Image */
-    XSetClipMask(g->display, g->context, mask);
-    XPutImage(g->display, vm_window->local_winid,
-            g->context, image, 0, 0, 0, 0, w, h);
-    /* Remove clipping */
-    XSetClipMask(g->display, g->context, None);
+    return true;
+}
 
-    XFreePixmap(g->display, mask);
-    XDestroyImage(image);
-    XFreePixmap(g->display, pixmap);
-    free(data);
+/* picture for a depth 24 pixmap */
+static Picture tray_pixmap_picture(Ghandles *g, Pixmap pixmap) {
+    return XRenderCreatePicture(g->display, pixmap,
+            XRenderFindStandardFormat(g->display, PictStandardRGB24), 0, NULL);
 }
 
+/* initialization required for TRAY_BACKGROUND mode */
+void init_tray_bg(Ghandles *g) {
+    /* prepare graphic context for tray background */
+    XGCValues values;
+    values.foreground = WhitePixel(g->display, g->screen);
+    g->tray_gc =
+        XCreateGC(g->display, g->root_win, GCForeground, &values);
+    values.graphics_exposures = False;
+    g->tray_copy_gc =
+        XCreateGC(g->display, g->root_win, GCGraphicsExposures, &values);
+    if (g->trayicon_render)
+        g->trayicon_render = tray_render_available(g, 0);
+}
 
-/* based on /usr/share/awesome/lib/gears/colors.lua */
+/* (re)allocate TRAY_BACKGROUND state for the current image size */
+static void tray_bg_alloc(Ghandles *g, struct windowdata *vm_window,
+        struct tray_cache *cache) {
+    XGCValues values;
+    int w = vm_window->image_width, h = vm_window->image_height;
 
-static inline double max3(double a, double b, double c) {
-    double r = a;
-    if (b > r)
-        r = b;
-    if (c > r)
-        r = c;
-    return r;
+    tray_bg_free(g, cache);
+    cache->bg_mask_bits = calloc(tray_bg_mask_stride(w), h);
+    if (!cache->bg_mask_bits)
+        err(1, "calloc");
+    cache->bg_icon = XCreatePixmap(g->display, vm_window->local_winid,
+            w, h, 24);
+    cache->bg_mask = XCreatePixmap(g->display, vm_window->local_winid,
+            w, h, 1);
+    /* XYBitmap images: 1 bits are painted with foreground */
+    values.foreground = 1;
+    values.background = 0;
+    values.graphics_exposures = False;
+    cache->bg_mask_gc = XCreateGC(g->display, cache->bg_mask,
+            GCForeground | GCBackground | GCGraphicsExposures, &values);
+    cache->bg_width = w;
+    cache->bg_height = h;
+    cache->bg_valid = false;
 }
 
-static inline double min3(double a, double b, double c) {
-    double r = a;
-    if (b < r)
-        r = b;
-    if (c < r)
-        r = c;
-    return r;
+/* compute mask rows from an XImage not in the host 32bpp format */
+static void tray_bg_mask_rows_slow(XImage *image, int w, int rows,
+        uint32_t back, uint8_t *mask) {
+    size_t mask_stride = tray_bg_mask_stride(w);
+
+    for (int y = 0; y < rows; y++) {
+        uint8_t *mask_row = mask + (size_t)y * mask_stride;
+
+        memset(mask_row, 0, mask_stride);
+        for (int x = 0; x < w; x++)
+            if (XGetPixel(image, x, y) != back)
+                mask_row[x / 8] |= 1 << (x % 8);
+    }
 }
 
-static void rgb_to_hls(uint32_t rgb, double *out_h, double *out_l, double *out_s) {
-    double r, g, b;
-    double maxc, minc, l, h, s, rc, gc, bc;
+/* upload given mask rows to the mask pixmap */
+static void tray_bg_put_mask(Ghandles *g, struct tray_cache *cache,
+        int row0, int rows) {
+    size_t mask_stride = tray_bg_mask_stride(cache->bg_width);
+    XImage *image = XCreateImage(g->display,
+            DefaultVisual(g->display, g->screen), 1, XYBitmap, 0,
+            (char *)cache->bg_mask_bits + (size_t)row0 * mask_stride,
+            cache->bg_width, rows, 8, mask_stride);
 
-    r = ((rgb >> 16) & 0xff) * 1.0 / 255.0;
-    g = ((rgb >>  8) & 0xff) * 1.0 / 255.0;
-    b = ((rgb >>  0) & 0xff) * 1.0 / 255.0;
+    if (!image)
+        errx(1, "XCreateImage failed");
+    image->byte_order = LSBFirst;
+    image->bitmap_bit_order = LSBFirst;
+    XPutImage(g->display, cache->bg_mask, cache->bg_mask_gc, image,
+            0, 0, 0, row0, cache->bg_width, rows);
+    /* the data is owned by the cache */
+    image->data = NULL;
+    XDestroyImage(image);
+}
 
+/* bring the icon copy and the mask up to date with the damaged area */
+static void tray_bg_update(Ghandles *g, struct windowdata *vm_window,
+        struct tray_cache *cache, const uint8_t *data,
+        int x, int y, int w, int h) {
+    int width = cache->bg_width, height = cache->bg_height;
+    size_t mask_stride = tray_bg_mask_stride(width);
+    int row0 = y, rows = h;
+    uint32_t back;
+    XImage *image = NULL;
 
-    maxc = max3(r, g, b);
-    minc = min3(r, g, b);
-    // XXX Can optimize (maxc+minc) and (maxc-minc)
-    l = (minc+maxc)/2.0;
-    if (minc == maxc) {
-        *out_h = 0.0;
-        *out_l = l;
-        *out_s = 0.0;
-        return;
+    if (!cache->bg_valid) {
+        x = row0 = 0;
+        w = width;
+        rows = height;
     }
-    if (l <= 0.5) {
-        s = (maxc-minc) / (maxc+minc);
+    put_shm_image(g, cache->bg_icon, vm_window, x, row0, w, rows, x, row0);
+
+    if (data) {
+        size_t stride = (size_t)width * 4;
+
+        /* Use top-left corner pixel color as transparency color */
+        memcpy(&back, data, 4);
+        back &= 0xffffff;
+        if (cache->bg_valid && back != cache->bg_back) {
+            row0 = 0;
+            rows = height;
+        }
+        tray_bg_mask_rows(data + (size_t)row0 * stride, stride, width, rows,
+                back, cache->bg_mask_bits + (size_t)row0 * mask_stride);
     } else {
-        s = (maxc-minc) / (2.0-maxc-minc);
+        /* Get back the updated rows of the icon copy. This is needed because
+         * XGetPixel does not seem to work with XShmImage data. */
+        image = XGetImage(g->display, cache->bg_icon, 0, row0, width, rows,
+                0xFFFFFFFF, ZPixmap);
+        if (!image)
+            return;
+        back = row0 == 0 ? XGetPixel(image, 0, 0) & 0xffffff : cache->bg_back;
+        if (cache->bg_valid && back != cache->bg_back && rows != height) {
+            XDestroyImage(image);
+            row0 = 0;
+            rows = height;
+            image = XGetImage(g->display, cache->bg_icon, 0, 0, width, height,
+                    0xFFFFFFFF, ZPixmap);
+            if (!image)
+                return;
+        }
+        if (image->bits_per_pixel == 32 &&
+                image->byte_order == host_byte_order())
+            tray_bg_mask_rows((const uint8_t *)image->data,
+                    image->bytes_per_line, width, rows, back,
+                    cache->bg_mask_bits + (size_t)row0 * mask_stride);
+        else
+            tray_bg_mask_rows_slow(image, width, rows, back,
+                    cache->bg_mask_bits + (size_t)row0 * mask_stride);
+        XDestroyImage(image);
     }
-    rc = (maxc-r) / (maxc-minc);
-    gc = (maxc-g) / (maxc-minc);
-    bc = (maxc-b) / (maxc-minc);
-    if (r == maxc) {
-        h = bc-gc;
-    } else if (g == maxc) {
-        h = 2.0+rc-bc;
-    } else {
-        h = 4.0+gc-rc;
+    tray_bg_put_mask(g, cache, row0, rows);
+    cache->bg_back = back;
+    cache->bg_valid = true;
+}
+
+/* Color tray icon background (use top-left corner as a "transparent" base),
+ * and update image on screen. Only the damaged rows of the mask are
+ * recomputed, the whole icon is drawn from the kept copy.
+ */
+void fill_tray_bg_and_update(Ghandles *g, struct windowdata *vm_window,
+        int x, int y, int w, int h) {
+    struct tray_cache *cache;
+    const uint8_t *data;
+
+    if (vm_window->shmseg == QUBES_NO_SHM_SEGMENT) {
+        /* TODO: implement screen_window handling */
+        return;
     }
-    h = (h/6.0) - floor(h/6.0);
+    if (vm_window->image_width <= 0 || vm_window->image_height <= 0)
+        return;
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (w > vm_window->image_width - x)
+        w = vm_window->image_width - x;
+    if (h > vm_window->image_height - y)
+        h = vm_window->image_height - y;
+    if (w <= 0 || h <= 0)
+        return;
 
-    *out_h = h;
-    *out_l = l;
-    *out_s = s;
-}
+    cache = tray_cache_get(vm_window);
+    if (cache->bg_width != vm_window->image_width ||
+            cache->bg_height != vm_window->image_height)
+        tray_bg_alloc(g, vm_window, cache);
 
-/* based on /usr/share/awesome/lib/gears/colors.lua */
-static uint8_t v(double m1, double m2, double hue) {
-    hue = hue - floor(hue);
-    if (hue < 1.0/6.0)
-        return (m1 + (m2-m1)*hue*6.0) * 0xff;
-    if (hue < 0.5)
-        return (m2) * 0xff;
-    if (hue < 2.0/3.0)
-        return (m1 + (m2-m1)*(2.0/3.0-hue)*6.0) * 0xff;
-    return m1 * 0xff;
-}
+    data = tray_image_data(g, vm_window);
+    if (data) {
+        uint64_t hash = hash_image_region(data,
+                (size_t)vm_window->image_width * 4, 0, 0,
+                vm_window->image_width, vm_window->image_height);
+
+        if (cache->bg_valid && hash == cache->bg_hash) {
+            g->stats.tray_cache_hits++;
+        } else {
+            g->stats.tray_cache_misses++;
+            tray_bg_update(g, vm_window, cache, data, x, y, w, h);
+            cache->bg_hash = hash;
+        }
+    } else
+        tray_bg_update(g, vm_window, cache, NULL, x, y, w, h);
+    if (!cache->bg_valid)
+        return;
+
+    if (g->trayicon_render) {
+        const XRenderColor white = { 0xffff, 0xffff, 0xffff, 0xffff };
+        Picture dst_pic = XRenderCreatePicture(g->display,
+                vm_window->local_winid,
+                XRenderFindVisualFormat(g->display,
+                    DefaultVisual(g->display, g->screen)), 0, NULL);
+        Picture icon_pic = tray_pixmap_picture(g, cache->bg_icon);
+        Picture mask_pic = XRenderCreatePicture(g->display, cache->bg_mask,
+                XRenderFindStandardFormat(g->display, PictStandardA1), 0, NULL);
 
-static uint32_t hls_to_rgb(double h, double l, double s) {
-    double m1, m2;
-
-    if (s == 0.0)
-        return
-            (int)(l * 0xff) << 16 |
-            (int)(l * 0xff) <<  8 |
-            (int)(l * 0xff) <<  0;
-    if (l <= 0.5)
-        m2 = l * (1.0+s);
-    else
-        m2 = l+s-(l*s);
-    m1 = 2.0*l - m2;
-    return
-        (uint32_t)v(m1, m2, h+1.0/3.0) << 16 |
-        (uint32_t)v(m1, m2, h)         <<  8 |
-        (uint32_t)v(m1, m2, h-1.0/3.0) <<  0;
+        /* set trayicon background to white color */
+        XRenderFillRectangle(g->display, PictOpSrc, dst_pic, &white, 0, 0,
+                vm_window->width, vm_window->height);
+        /* paint opaque icon through the mask */
+        XRenderComposite(g->display, PictOpOver, icon_pic, mask_pic, dst_pic,
+                0, 0, 0, 0, 0, 0, cache->bg_width, cache->bg_height);
+        XRenderFreePicture(g->display, mask_pic);
+        XRenderFreePicture(g->display, icon_pic);
+        XRenderFreePicture(g->display, dst_pic);
+        return;
+    }
+
+    /* set trayicon background to white color */
+    XFillRectangle(g->display, vm_window->local_winid,
+            g->tray_gc, 0, 0, vm_window->width,
+            vm_window->height);
+    /* Paint clipped icon */
+    XSetClipMask(g->display, g->tray_copy_gc, cache->bg_mask);
+    XCopyArea(g->display, cache->bg_icon, vm_window->local_winid,
+            g->tray_copy_gc, 0, 0, cache->bg_width, cache->bg_height, 0, 0);
+    /* Remove clipping */
+    XSetClipMask(g->display, g->tray_copy_gc, None);
 }
 
 void init_tray_tint(Ghandles *g) {
     double l_ignore;
+    const char *impl;
+    XGCValues values;
+
     rgb_to_hls(g->label_color_rgb, &g->tint_h, &l_ignore, &g->tint_s);
 
     if (g->trayicon_tint_reduce_saturation)
         g->tint_s *= 0.5;
+    tint_lut_init(&g->tint_lut, g->tint_h, g->tint_s);
+    g->tint_pixels = tint_pixels_select(&impl);
+    if (g->log_level > 0)
+        fprintf(stderr, "Using %s tray icon tint kernel\n", impl);
+    values.graphics_exposures = False;
+    g->tray_copy_gc =
+        XCreateGC(g->display, g->root_win, GCGraphicsExposures, &values);
+
+    if (g->trayicon_render && g->trayicon_tint_whitehack) {
+        fprintf(stderr, "tint+whitehack cannot be done with RENDER, "
+                "processing tray icons on the client side\n");
+        g->trayicon_render = false;
+    }
+    /* PictOpHSLColor needs RENDER 0.11 */
+    if (g->trayicon_render)
+        g->trayicon_render = tray_render_available(g, 11);
+    if (g->trayicon_render) {
+        /* PictOpHSLColor takes hue and saturation from the source */
+        uint32_t rgb = hls_to_rgb(g->tint_h, 0.5, g->tint_s);
+        XRenderColor color = {
+            .red = ((rgb >> 16) & 0xff) * 0x101,
+            .green = ((rgb >> 8) & 0xff) * 0x101,
+            .blue = (rgb & 0xff) * 0x101,
+            .alpha = 0xffff,
+        };
+        g->tray_tint_fill = XRenderCreateSolidFill(g->display, &color);
+    }
+}
+
+/* tint w x h pixmap on the X server side */
+static void tint_tray_render(Ghandles *g, Pixmap pixmap, int w, int h) {
+    Picture pic = tray_pixmap_picture(g, pixmap);
+
+    XRenderComposite(g->display, PictOpHSLColor, g->tray_tint_fill, None, pic,
+            0, 0, 0, 0, 0, 0, w, h);
+    XRenderFreePicture(g->display, pic);
 }
 
 void tint_tray_and_update(Ghandles *g, struct windowdata *vm_window,
         int x, int y, int w, int h) {
+    struct tray_cache_entry *entry;
+    const uint8_t *data;
+    uint64_t hash = 0;
     int yp, xp;
     uint32_t pixel;
-    double h_ignore, l, s_ignore;
 
     if (vm_window->shmseg == QUBES_NO_SHM_SEGMENT) {
         /* TODO: implement screen_window handling */
         return;
     }
-    /* Create local pixmap, put vmside image to it
-     * then get local image of the copy.
-     * This is needed because XGetPixel does not seem to work
-     * with XShmImage data.
-     */
-    Pixmap pixmap =
-        XCreatePixmap(g->display, vm_window->local_winid,
-                vm_window->image_width,
-                vm_window->image_height,
-                24);
-    put_shm_image(g, pixmap, vm_window,
-        0, 0,
-        vm_window->image_width,
-        vm_window->image_height,
-        0, 0);
-    XImage *image = XGetImage(g->display, pixmap, x, y, w, h,
-            0xFFFFFFFF, ZPixmap);
+    data = tray_image_data(g, vm_window);
+    if (data) {
+        hash = hash_image_region(data, (size_t)vm_window->image_width * 4,
+                x, y, w, h);
+        entry = tray_cache_lookup(g, vm_window, hash, x, y, w, h, w, h);
+        if (entry) {
+            XCopyArea(g->display, entry->result, vm_window->local_winid,
+                    g->tray_copy_gc, 0, 0, w, h, x, y);
+            return;
+        }
+    }
+    if (g->trayicon_render) {
+        Pixmap result;
+
+        if (data)
+            result = tray_cache_insert(g, vm_window, hash, x, y, w, h, w, h)->result;
+        else
+            result = XCreatePixmap(g->display, vm_window->local_winid, w, h, 24);
+        put_shm_image(g, result, vm_window, x, y, w, h, 0, 0);
+        tint_tray_render(g, result, w, h);
+        XCopyArea(g->display, result, vm_window->local_winid,
+                g->tray_copy_gc, 0, 0, w, h, x, y);
+        if (!data)
+            XFreePixmap(g->display, result);
+        return;
+    }
+    XImage *image = tray_get_image(g, vm_window, data, x, y, w, h);
     /* tint image */
-    for (yp = 0; yp < h; yp++) {
-        for (xp = 0; xp < w; xp++) {
-            pixel = XGetPixel(image, xp, yp);
-            if (g->trayicon_tint_whitehack && pixel == 0xffffff)
-                pixel = 0xfefefe;
-            else {
-                rgb_to_hls(pixel, &h_ignore, &l, &s_ignore);
-                pixel = hls_to_rgb(g->tint_h, l, g->tint_s);
-            }
-            if (!XPutPixel(image, xp, yp, pixel)) {
-                fprintf(stderr, "Failed to update pixel %d,%d of tray window 0x%lx(remote 0x%lx)\n",
-                        xp, yp, vm_window->local_winid, vm_window->remote_winid);
-                exit(1);
+    if (image->bits_per_pixel == 32 && image->byte_order == host_byte_order() &&
+            image->red_mask == 0xff0000 && image->green_mask == 0xff00 &&
+            image->blue_mask == 0xff) {
+        /* work directly on the image data, row by row */
+        for (yp = 0; yp < h; yp++)
+            g->tint_pixels(&g->tint_lut,
+                    (uint32_t *)(image->data + yp * image->bytes_per_line),
+                    w, g->trayicon_tint_whitehack);
+    } else {
+        for (yp = 0; yp < h; yp++) {
+            for (xp = 0; xp < w; xp++) {
+                pixel = tint_lut_pixel(&g->tint_lut, XGetPixel(image, xp, yp),
+                        g->trayicon_tint_whitehack);
+                if (!XPutPixel(image, xp, yp, pixel)) {
+                    fprintf(stderr, "Failed to update pixel %d,%d of tray window 0x%lx(remote 0x%lx)\n",
+                            xp, yp, vm_window->local_winid, vm_window->remote_winid);
+                    exit(1);
+                }
             }
         }
     }
-    XPutImage(g->display, vm_window->local_winid,
-            g->context, image, 0, 0, x, y, w, h);
+    if (data) {
+        entry = tray_cache_insert(g, vm_window, hash, x, y, w, h, w, h);
+        XPutImage(g->display, entry->result,
+                g->context, image, 0, 0, 0, 0, w, h);
+        XCopyArea(g->display, entry->result, vm_window->local_winid,
+                g->tray_copy_gc, 0, 0, w, h, x, y);
+    } else
+        XPutImage(g->display, vm_window->local_winid,
+                g->context, image, 0, 0, x, y, w, h);
     XDestroyImage(image);
-    XFreePixmap(g->display, pixmap);
 }
@@ -26,3 +26,9 @@ void fill_tray_bg_and_update(Ghandles *g, struct windowdata *vm_window,
 void init_tray_tint(Ghandles *g);
 void tint_tray_and_update(Ghandles *g, struct windowdata *vm_window,
         int x, int y, int w, int h);
+
+/* cache of tinted/masked tray icons */
+void tray_cache_set_image(Ghandles *g, struct windowdata *vm_window,
+        const uint32_t *refs, uint32_t count);
+void tray_cache_release_image(struct windowdata *vm_window);
+void tray_cache_free(Ghandles *g, struct windowdata *vm_window);
@@ -37,7 +37,6 @@
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <sys/uio.h>
-#include <sys/queue.h>
 #include <sys/random.h>
 #include <signal.h>
 #include <poll.h>
@@ -46,6 +45,7 @@
 #include <getopt.h>
 #include <X11/X.h>
 #include <X11/Xproto.h>
+#include <X11/Xlibint.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/shmproto.h>
 #include <X11/Xatom.h>
@@ -64,6 +64,7 @@
 #include "error.h"
 #include "png.h"
 #include "trayicon.h"
+#include "keymap.h"
 #include "shm-args.h"
 #include "util.h"
 #include "unistd.h"
@@ -116,6 +117,7 @@ static Ghandles ghandles;
 #define ignore_result(x) do { __typeof__(x) __attribute__((unused)) _ignore=(x); } while (0)
 
 static int (*default_x11_io_error_handler)(Display *dpy);
+static bool x11_connection_lost; /* set by x11_io_error_handler() */
 static void inter_appviewer_lock(Ghandles *g, int mode);
 static void release_mapped_mfns(Ghandles * g, struct windowdata *vm_window);
 static void print_backtrace(void);
@@ -263,8 +265,12 @@ static int x11_error_handler(Display * dpy, XErrorEvent * ev)
         fprintf(stderr, "  likely window manager restart in progress, ignoring\n");
         return 0;
     }
-    /* Permit XGetWindowAttributes errors, as long as they're not for root_win */
-    if (ev->request_code == X_GetWindowAttributes &&
+    /* Permit XGetWindowAttributes errors, as long as they're not for root_win;
+     * same for requests about frame windows, see frame_track() */
+    if ((ev->request_code == X_GetWindowAttributes ||
+         ev->request_code == X_ChangeWindowAttributes ||
+         ev->request_code == X_QueryTree ||
+         ev->request_code == X_TranslateCoords) &&
         ev->error_code == BadWindow &&
         ev->resourceid != ghandles.root_win) {
 
@@ -284,6 +290,7 @@ static int x11_error_handler(Display * dpy, XErrorEvent * ev)
  */
 static int x11_io_error_handler(Display * dpy)
 {
+    x11_connection_lost = true;
     print_backtrace();
     if (default_x11_io_error_handler)
         default_x11_io_error_handler(dpy);
@@ -352,110 +359,174 @@ static void get_frame_gc(Ghandles * g, const char *name)
         XCreateGC(g->display, g->root_win, GCForeground, &values);
 }
 
-/* create local window - on VM request.
- * parameters are sanitized already
- */
-static Window mkwindow(Ghandles * g, struct windowdata *vm_window)
+/* add property to set on each window; for format 32 data is an array of
+ * longs, as for XChangeProperty() */
+static void add_window_prop(Ghandles * g, Atom prop, Atom type, int format,
+        const void *data, int nelements)
 {
-    char *gargv[1] = { NULL };
-    Window child_win;
-    XSizeHints my_size_hints;    /* hints for the window manager */
+    struct window_prop *p;
+    size_t item_size = format / 8;
+    uint32_t *items;
     int i;
-    XSetWindowAttributes attr;
 
-    my_size_hints.flags = PSize;
-    my_size_hints.width = vm_window->width;
-    my_size_hints.height = vm_window->height;
+    if (g->window_props_count >= MAX_WINDOW_PROPS) {
+        fprintf(stderr, "Too many window properties\n");
+        exit(1);
+    }
+    p = &g->window_props[g->window_props_count++];
+    p->prop = prop;
+    p->type = type;
+    p->format = format;
+    p->nelements = nelements;
+    p->data = malloc(nelements ? nelements * item_size : 1);
+    if (!p->data) {
+        perror("malloc");
+        exit(1);
+    }
+    if (format == 32) {
+        items = p->data;
+        for (i = 0; i < nelements; i++)
+            items[i] = ((const long *)data)[i];
+    } else {
+        memcpy(p->data, data, nelements * item_size);
+    }
+}
 
-    attr.override_redirect = vm_window->override_redirect;
-    attr.background_pixel = g->window_background_pixel;
-    child_win = XCreateWindow(g->display, g->root_win,
-                    vm_window->x, vm_window->y,
-                    vm_window->width,
-                    vm_window->height, 0,
-                    CopyFromParent,
-                    CopyFromParent,
-                    CopyFromParent,
-                    CWOverrideRedirect | CWBackPixel, &attr);
-    /* pass my size hints to the window manager, along with window
-       and icon names */
-    (void) XSetStandardProperties(g->display, child_win,
-                      "VMapp command", "Pixmap", None,
-                      gargv, 0, &my_size_hints);
-    if (g->time_win != None)
-        XChangeProperty(g->display, child_win, g->wm_user_time_window,
-               XA_WINDOW, 32, PropModeReplace,
-               (const unsigned char *)&g->time_win,
-               1);
-    (void) XSelectInput(g->display, child_win,
-                ExposureMask | KeyPressMask | KeyReleaseMask |
-                ButtonPressMask | ButtonReleaseMask |
-                PointerMotionMask | EnterWindowMask | LeaveWindowMask |
-                FocusChangeMask | StructureNotifyMask | PropertyChangeMask);
+/* Serialize the properties that are the same for all the windows once, so
+ * mkwindow() only needs to send them. Their order follows what the separate
+ * Xlib calls used to do. */
+static void prepare_window_props(Ghandles * g)
+{
+    long value;
+    int i;
 
-    /* setting WM_CLIENT_MACHINE, _NET_WM_PID, _NET_WM_PING */
-    XSetWMClientMachine(g->display, child_win, &g->hostname);
-    XChangeProperty(g->display, child_win, g->wm_pid, XA_CARDINAL,
-            32 /* bits */ , PropModeReplace,
-            (unsigned char *) &g->pid, 1);
-    Atom protocols[2];
-    protocols[0] = g->wmDeleteMessage;
-    protocols[1] = g->wm_ping;
-    XSetWMProtocols(g->display, child_win, protocols, 2);
+    /* XSetStandardProperties() */
+    add_window_prop(g, XA_WM_NAME, XA_STRING, 8, "VMapp command",
+            strlen("VMapp command"));
+    add_window_prop(g, XA_WM_ICON_NAME, XA_STRING, 8, "Pixmap",
+            strlen("Pixmap"));
+    add_window_prop(g, XA_WM_COMMAND, XA_STRING, 8, "", 0);
+    if (g->time_win != None) {
+        value = g->time_win;
+        add_window_prop(g, g->wm_user_time_window, XA_WINDOW, 32, &value, 1);
+    }
 
+    /* setting WM_CLIENT_MACHINE, _NET_WM_PID, _NET_WM_PING */
+    add_window_prop(g, XA_WM_CLIENT_MACHINE, g->hostname.encoding,
+            g->hostname.format, g->hostname.value, g->hostname.nitems);
+    value = g->pid;
+    add_window_prop(g, g->wm_pid, XA_CARDINAL, 32, &value, 1);
+    long protocols[2] = { g->wmDeleteMessage, g->wm_ping };
+    add_window_prop(g, g->wm_protocols, XA_ATOM, 32, protocols, 2);
+
+    const char *class_name = NULL;
     if (g->icon_data) {
-        XChangeProperty(g->display, child_win, g->net_wm_icon, XA_CARDINAL, 32,
-                PropModeReplace, (unsigned char *) g->icon_data,
+        add_window_prop(g, g->net_wm_icon, XA_CARDINAL, 32, g->icon_data,
                 g->icon_data_len);
-        XClassHint class_hint =
-            { g->vmname, g->vmname };
-        XSetClassHint(g->display, child_win, &class_hint);
+        class_name = g->vmname;
         // perhaps set also icon_pixmap property in WM_HINTS (two Pixmaps -
         // icon and the mask), but hopefully all window managers supports
         // _NET_WM_ICON
     } else if (g->cmdline_icon) {
-        XClassHint class_hint =
-            { g->cmdline_icon, g->cmdline_icon };
-        XSetClassHint(g->display, child_win, &class_hint);
+        class_name = g->cmdline_icon;
+    }
+    if (class_name) {
+        /* XSetClassHint() format: res_name and res_class, both terminated */
+        size_t len = strlen(class_name) + 1;
+        char *class_hint = malloc(2 * len);
+
+        if (!class_hint) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(class_hint, class_name, len);
+        memcpy(class_hint + len, class_name, len);
+        add_window_prop(g, XA_WM_CLASS, XA_STRING, 8, class_hint, 2 * len);
+        free(class_hint);
     }
     // Set '_QUBES_LABEL' property so that Window Manager can read it and draw proper decoration
-    XChangeProperty(g->display, child_win, g->qubes_label, XA_CARDINAL,
-            8 /* 8 bit is enough */ , PropModeReplace,
-            (unsigned char *) &g->label_index, 1);
+    const uint8_t label = g->label_index;
+    add_window_prop(g, g->qubes_label, XA_CARDINAL, 8 /* 8 bit is enough */,
+            &label, 1);
 
     // Set '_QUBES_LABEL_COLOR' property so that Window Manager can read it and draw proper decoration
-    XChangeProperty(g->display, child_win, g->qubes_label_color, XA_CARDINAL,
-            32 /* bits */ , PropModeReplace,
-            (unsigned char *) &g->label_color_rgb, 1);
+    value = g->label_color_rgb;
+    add_window_prop(g, g->qubes_label_color, XA_CARDINAL, 32, &value, 1);
 
     // Set '_QUBES_VMNAME' property so that Window Manager can read it and nicely display it
-    XChangeProperty(g->display, child_win, g->qubes_vmname, XA_STRING,
-            8 /* 8 bit is enough */ , PropModeReplace,
-            (const unsigned char *) g->vmname,
-            strlen(g->vmname));
-
-    // Set '_QUBES_VMWINDOWID' property so that additional plugins can
-    // synchronize window state (icon etc)
-    XChangeProperty(g->display, child_win, g->qubes_vmwindowid, XA_WINDOW,
-            32, PropModeReplace,
-            (const unsigned char *)&vm_window->remote_winid,
-            1);
+    add_window_prop(g, g->qubes_vmname, XA_STRING, 8 /* 8 bit is enough */,
+            g->vmname, strlen(g->vmname));
 
     /* extra properties from command line */
     for (i = 0; i < MAX_EXTRA_PROPS; i++) {
-        if (g->extra_props[i].prop) {
-            XChangeProperty(g->display, child_win, g->extra_props[i].prop,
-                    g->extra_props[i].type, g->extra_props[i].format,
-                    PropModeReplace,
-                    (const unsigned char*)g->extra_props[i].data,
+        if (g->extra_props[i].prop)
+            add_window_prop(g, g->extra_props[i].prop, g->extra_props[i].type,
+                    g->extra_props[i].format, g->extra_props[i].data,
                     g->extra_props[i].nelements);
-        }
     }
+}
 
-    if (vm_window->remote_winid == FULLSCREEN_WINDOW_ID) {
-        /* whole screen window */
-        g->screen_window = vm_window;
+/* events selected on windows of the VM */
+#define VM_WINDOW_EVENT_MASK (XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS | \
+        XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS | \
+        XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION | \
+        XCB_EVENT_MASK_ENTER_WINDOW | XCB_EVENT_MASK_LEAVE_WINDOW | \
+        XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | \
+        XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_KEYMAP_STATE)
+
+/* set properties prepared by prepare_window_props() */
+static void set_window_props(Ghandles * g, xcb_window_t win)
+{
+    int i;
+
+    for (i = 0; i < g->window_props_count; i++) {
+        const struct window_prop *p = &g->window_props[i];
+
+        xcb_change_property(g->cb_connection, XCB_PROP_MODE_REPLACE,
+                win, p->prop, p->type, p->format, p->nelements,
+                p->data);
     }
+}
+
+/* create local window - on VM request.
+ * parameters are sanitized already
+ * the window and all its properties are sent as one burst of XCB requests
+ */
+static Window mkwindow(Ghandles * g, struct windowdata *vm_window)
+{
+    xcb_window_t child_win;
+
+    child_win = xcb_generate_id(g->cb_connection);
+    /* value list in XCB_CW_* bit order */
+    const uint32_t values[] = {
+        g->window_background_pixel,
+        vm_window->override_redirect,
+        VM_WINDOW_EVENT_MASK,
+    };
+    xcb_create_window(g->cb_connection, XCB_COPY_FROM_PARENT, child_win,
+            g->root_win, vm_window->x, vm_window->y,
+            vm_window->width, vm_window->height, 0,
+            XCB_WINDOW_CLASS_COPY_FROM_PARENT, XCB_COPY_FROM_PARENT,
+            XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK,
+            values);
+
+    set_window_props(g, child_win);
+
+    /* pass my size hints to the window manager, XSetNormalHints() format
+     * with only PSize set */
+    uint32_t size_hints[15] = { 0 };
+    size_hints[0] = PSize;
+    size_hints[3] = vm_window->width;
+    size_hints[4] = vm_window->height;
+    xcb_change_property(g->cb_connection, XCB_PROP_MODE_REPLACE, child_win,
+            XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS, 32,
+            sizeof(size_hints) / sizeof(size_hints[0]), size_hints);
+
+    // Set '_QUBES_VMWINDOWID' property so that additional plugins can
+    // synchronize window state (icon etc)
+    const uint32_t remote_winid = vm_window->remote_winid;
+    xcb_change_property(g->cb_connection, XCB_PROP_MODE_REPLACE, child_win,
+            g->qubes_vmwindowid, XCB_ATOM_WINDOW, 32, 1, &remote_winid);
 
     return child_win;
 }
@@ -469,26 +540,44 @@ static const unsigned long max_display_width = 1UL << 20;
  */
 static const int override_redirect_padding = 0;
 
-/* update g when the current desktop changes */
-static void update_work_area(Ghandles *g) {
-    unsigned long *scratch = NULL;
-    unsigned long nitems, bytesleft;
-    Atom act_type;
-    int ret, act_fmt;
+/* maximum number of desktops whose work area is read */
+#define WORKAREA_MAX_DESKTOPS 1024
+
+/* request root window properties needed to update the work area; replies
+ * are processed by finish_work_area() */
+static void request_work_area(Ghandles *g, bool desktop, bool workarea) {
+    if (desktop) {
+        if (g->current_desktop_pending)
+            xcb_discard_reply(g->cb_connection, g->current_desktop_cookie.sequence);
+        g->current_desktop_cookie = xcb_get_property(g->cb_connection, 0,
+                g->root_win, g->net_current_desktop, XCB_ATOM_CARDINAL, 0, 1);
+        g->current_desktop_pending = true;
+    }
+    if (workarea) {
+        if (g->workarea_pending)
+            xcb_discard_reply(g->cb_connection, g->workarea_cookie.sequence);
+        /* all desktops, so switching desktops does not need to read it */
+        g->workarea_cookie = xcb_get_property(g->cb_connection, 0,
+                g->root_win, g->wm_workarea, XCB_ATOM_CARDINAL, 0,
+                WORKAREA_MAX_DESKTOPS * desktop_coordinates_size);
+        g->workarea_pending = true;
+    }
+}
 
-    ret = XGetWindowProperty(g->display, g->root_win, g->net_current_desktop,
-        0, 1, False, XA_CARDINAL, &act_type, &act_fmt, &nitems, &bytesleft,
-        (unsigned char**)&scratch);
-    if (ret != Success || nitems != 1 || act_fmt != 32 ||
-        act_type != XA_CARDINAL || bytesleft) {
-        if (ret == Success && None == act_fmt && !act_fmt && !bytesleft) {
-            if (g->log_level > 0)
-                fprintf(stderr, "Cannot obtain current desktop\n");
-            g->work_x = 0;
-            g->work_y = 0;
-            g->work_width = g->root_width;
-            g->work_height = g->root_height;
-            goto check_width_height;
+/* update cached _NET_CURRENT_DESKTOP */
+static void read_current_desktop(Ghandles *g) {
+    xcb_get_property_reply_t *reply;
+
+    g->current_desktop_pending = false;
+    reply = xcb_get_property_reply(g->cb_connection,
+            g->current_desktop_cookie, NULL);
+    if (!reply || reply->format != 32 || reply->type != XCB_ATOM_CARDINAL ||
+        reply->value_len != 1 || reply->bytes_after) {
+        if (reply && reply->type == XCB_NONE && !reply->format &&
+            !reply->bytes_after) {
+            g->current_desktop = -1;
+            free(reply);
+            return;
         }
         /* Panic!  Serious window manager problem. */
         fputs("PANIC: cannot obtain current desktop\n"
@@ -496,25 +585,66 @@ static void update_work_area(Ghandles *g) {
             stderr);
         exit(1);
     }
-    if (*scratch > max_display_width) {
+    unsigned long current_desktop = *(const uint32_t *)xcb_get_property_value(reply);
+    if (current_desktop > max_display_width) {
         fprintf(stderr, "Absurd current desktop (display width %lu exceeds "
-                "limit %lu), exiting\n", *scratch, max_display_width);
+                "limit %lu), exiting\n", current_desktop, max_display_width);
         exit(1);
     }
-    uint32_t current_desktop = (uint32_t)*scratch;
-    XFree(scratch);
-    scratch = NULL;
-    bool bad_work_area = false;
-    ret = XGetWindowProperty(g->display, g->root_win, g->wm_workarea,
-            current_desktop * desktop_coordinates_size,
-            desktop_coordinates_size, False, XA_CARDINAL, &act_type, &act_fmt,
-            &nitems, &bytesleft, (unsigned char**)&scratch);
-    if (ret != Success) {
-        fprintf(stderr, "Cannot obtain work area (ret %d)\n", ret);
+    g->current_desktop = current_desktop;
+    free(reply);
+}
+
+/* update cached _NET_WORKAREA */
+static void read_workarea(Ghandles *g) {
+    xcb_get_property_reply_t *reply;
+    unsigned len;
+
+    g->workarea_pending = false;
+    reply = xcb_get_property_reply(g->cb_connection, g->workarea_cookie, NULL);
+    if (!reply) {
+        fprintf(stderr, "Cannot obtain work area\n");
         exit(1);
     }
-    if (act_fmt == 0) {
-        scratch = NULL;
+    g->workarea_format = reply->format;
+    g->workarea_type = reply->type;
+    len = reply->format == 32 ? reply->value_len : 0;
+    if (len > g->workarea_size) {
+        uint32_t *workarea = realloc(g->workarea, len * sizeof(uint32_t));
+
+        if (!workarea) {
+            fprintf(stderr, "read_workarea: out of memory\n");
+            exit(1);
+        }
+        g->workarea = workarea;
+        g->workarea_size = len;
+    }
+    if (len)
+        memcpy(g->workarea, xcb_get_property_value(reply), len * sizeof(uint32_t));
+    g->workarea_len = len;
+    free(reply);
+}
+
+/* update g when the current desktop changes */
+static void finish_work_area(Ghandles *g) {
+    unsigned long scratch[4];
+    unsigned long nitems;
+
+    if (g->current_desktop_pending)
+        read_current_desktop(g);
+    if (g->workarea_pending)
+        read_workarea(g);
+    if (g->current_desktop < 0) {
+        if (g->log_level > 0)
+            fprintf(stderr, "Cannot obtain current desktop\n");
+        g->work_x = 0;
+        g->work_y = 0;
+        g->work_width = g->root_width;
+        g->work_height = g->root_height;
+        goto check_width_height;
+    }
+    bool bad_work_area = false;
+    if (g->workarea_format == 0) {
         if (g->log_level > 0)
             fprintf(stderr, "No _NET_WORKAREA on root window\n");
         g->work_x = 0;
@@ -523,7 +653,16 @@ static void update_work_area(Ghandles *g) {
         g->work_height = g->root_height;
         goto check_width_height;
     }
-    if (nitems != desktop_coordinates_size || act_fmt != 32 || act_type != XA_CARDINAL) {
+    /* number of items available for the current desktop */
+    nitems = g->workarea_len;
+    if (nitems > g->current_desktop * desktop_coordinates_size)
+        nitems -= g->current_desktop * desktop_coordinates_size;
+    else
+        nitems = 0;
+    if (nitems > desktop_coordinates_size)
+        nitems = desktop_coordinates_size;
+    if (nitems != desktop_coordinates_size || g->workarea_format != 32 ||
+        g->workarea_type != XCB_ATOM_CARDINAL) {
         fprintf(stderr,
                 "Invalid _NET_WORKAREA property (window manager bug?):\n"
                 "   act_fmt %d (expected 32)\n"
@@ -534,12 +673,13 @@ static void update_work_area(Ghandles *g) {
                 "      y: %d\n"
                 "  width: %d\n"
                 " height: %d\n",
-                act_fmt, nitems, desktop_coordinates_size, act_type, XA_CARDINAL,
+                g->workarea_format, nitems, desktop_coordinates_size,
+                (unsigned long)g->workarea_type, XA_CARDINAL,
                 g->work_x, g->work_y, g->work_width, g->work_height);
-        XFree(scratch);
-        scratch = NULL;
         goto check_width_height;
     }
+    for (unsigned long s = 0; s < desktop_coordinates_size; ++s)
+        scratch[s] = g->workarea[g->current_desktop * desktop_coordinates_size + s];
     for (unsigned long s = 0; s < desktop_coordinates_size; ++s) {
         if (scratch[s] > max_display_width) {
             fprintf(stderr,
@@ -569,8 +709,6 @@ static void update_work_area(Ghandles *g) {
     if (g->log_level > 0)
         fprintf(stderr, "work area %lu %lu %lu %lu\n",
                 scratch[0], scratch[1], scratch[2], scratch[3]);
-    if (scratch != NULL)
-        XFree(scratch);
 
 check_width_height:
     if (g->work_width <= 2 * override_redirect_padding ||
@@ -582,6 +720,12 @@ check_width_height:
     }
 }
 
+/* synchronously update the work area */
+static void update_work_area(Ghandles *g) {
+    request_work_area(g, true, true);
+    finish_work_area(g);
+}
+
 /*
  * Internal all of the atoms we will use.  For performance reasons, we perform
  * all atom interning at startup, and do so using a single XInternAtoms() call.
@@ -616,6 +760,7 @@ static void intern_global_atoms(Ghandles *const g) {
         { &g->net_current_desktop, "_NET_CURRENT_DESKTOP" },
         { &g->wm_user_time_window, "_NET_WM_USER_TIME_WINDOW" },
         { &g->wm_user_time, "_NET_WM_USER_TIME" },
+        { &g->wm_protocols, "WM_PROTOCOLS" },
         { &g->wmDeleteMessage, "WM_DELETE_WINDOW" },
         { &g->net_supported, "_NET_SUPPORTED" },
         { &g->wm_pid, "_NET_WM_PID" },
@@ -678,12 +823,13 @@ static void mkghandles(Ghandles * g)
     g->pid = getpid();
     int ev_base, err_base; /* ignore */
     XWindowAttributes attr;
-    int i;
 
     if (!(g->display = XOpenDisplay(NULL)))
         err(1, "XOpenDisplay");
     if (!(g->cb_connection = XGetXCBConnection(g->display)))
         err(1, "XGetXCBConnection");
+    /* events are read with xcb_poll_for_event(), see process_xevents() */
+    XSetEventQueueOwner(g->display, XCBOwnsEventQueue);
     if ((g->xen_dir_fd = open("/dev/xen", O_DIRECTORY|O_CLOEXEC|O_NOCTTY|O_RDONLY)) == -1)
         err(1, "open /dev/xen");
     if ((g->xen_fd = openat(g->xen_dir_fd, "gntdev", O_PATH|O_CLOEXEC|O_NOCTTY)) == -1)
@@ -712,9 +858,12 @@ static void mkghandles(Ghandles * g)
     if (!XQueryExtension(g->display, "MIT-SHM",
                 &g->shm_major_opcode, &ev_base, &err_base))
         fprintf(stderr, "MIT-SHM X extension missing!\n");
+    /* other root window events are selected only while there are VM
+     * windows, see update_root_events() */
+    XSelectInput(g->display, g->root_win, StructureNotifyMask);
     /* get the work area */
-    XSelectInput(g->display, g->root_win, PropertyChangeMask | StructureNotifyMask);
     update_work_area(g);
+    g->stacking = list_new();
     /* create graphical contexts */
     get_frame_gc(g, g->cmdline_color ? g->cmdline_color : "red");
     if (g->trayicon_mode == TRAY_BACKGROUND)
@@ -730,6 +879,11 @@ static void mkghandles(Ghandles * g)
     /* init window lists */
     g->remote2local = list_new();
     g->wid2windowdata = list_new();
+    g->frame2windowdata = list_new();
+    g->wm_state_reads = list_new();
+    g->title_updates = list_new();
+    g->restored_windows = list_new();
+    g->restore_deadline = INT64_MAX;
     g->screen_window = NULL;
     /* use qrexec for clipboard operations when stubdom GUI is used */
     if (g->domid != g->target_domid)
@@ -753,17 +907,12 @@ static void mkghandles(Ghandles * g)
     /* ignore possible errors */
     fchmod(g->inter_appviewer_lock_fd, 0660);
 
-    g->cursors = malloc(sizeof(Cursor) * XC_num_glyphs);
+    /* cursors are created on first use, see handle_cursor() */
+    g->cursors = calloc(XC_num_glyphs, sizeof(Cursor));
     if (!g->cursors) {
-        perror("malloc");
+        perror("calloc");
         exit(1);
     }
-    for (i = 0; i < XC_num_glyphs; i++) {
-        /* X font cursors have even numbers from 0 up to XC_num_glyphs.
-         * Fill the rest with None.
-         */
-        g->cursors[i] = (i % 2 == 0) ? XCreateFontCursor(g->display, i) : None;
-    }
     long *state_list;
     size_t nitems;
     /* Get the stub window for _NET_WM_USER_TIME */
@@ -795,6 +944,7 @@ static void mkghandles(Ghandles * g)
     }
     if (g->time_win == None)
         fputs("Falling back to setting _NET_WM_USER_TIME on the root window\n", stderr);
+    prepare_window_props(g);
 }
 
 /* reload X server parameters, especially after monitor/screen layout change */
@@ -1529,6 +1679,11 @@ static void handle_cursor(Ghandles *g, struct windowdata *vm_window)
          */
         assert(cursor_id < XC_num_glyphs);
 
+        /* X font cursors have even numbers from 0 up to XC_num_glyphs.
+         * Use None for the rest.
+         */
+        if (cursor_id % 2 == 0 && g->cursors[cursor_id] == None)
+            g->cursors[cursor_id] = XCreateFontCursor(g->display, cursor_id);
         cursor = g->cursors[cursor_id];
     }
     XDefineCursor(g->display, vm_window->local_winid, cursor);
@@ -1626,6 +1781,80 @@ static void update_wm_user_time(Ghandles *const g, const Window window,
             1);
 }
 
+static void write_keymap_notify(Ghandles * g)
+{
+    struct msg_hdr hdr;
+
+    hdr.type = MSG_KEYMAP_NOTIFY;
+    hdr.window = 0;
+    write_message(g->vchan, hdr, g->keymap);
+}
+
+/* Track keyboard state sent with MSG_KEYMAP_NOTIFY. While one of our windows
+ * has the keyboard focus, all key events are delivered to us, so the state
+ * can be kept up to date locally. Any FocusOut (including keyboard grab by
+ * the window manager) makes it stale, KeymapNotify (sent by the X server
+ * right after each EnterNotify and FocusIn) refreshes it.
+ */
+static void keymap_track_xevent(Ghandles * g, const XEvent * ev)
+{
+    unsigned int keycode;
+
+    switch (ev->type) {
+    case KeyPress:
+    case KeyRelease:
+        keycode = ev->xkey.keycode;
+        if (keycode >= sizeof(g->keymap) * 8)
+            break;
+        if (ev->type == KeyPress)
+            g->keymap[keycode / 8] |= 1 << (keycode % 8);
+        else
+            g->keymap[keycode / 8] &= ~(1 << (keycode % 8));
+        break;
+    case KeymapNotify:
+        /* the first byte (keycodes 0-7) is not sent by the X server */
+        g->keymap[0] = 0;
+        memcpy(g->keymap + 1, ev->xkeymap.key_vector + 1,
+                sizeof(g->keymap) - 1);
+        g->keymap_valid = g->keymap_focused;
+        if (g->keymap_notify_pending) {
+            g->keymap_notify_pending = false;
+            g->stats.keymap_events++;
+            write_keymap_notify(g);
+        }
+        break;
+    case FocusIn:
+        /* with NotifyWhileGrabbed key events go to the grabbing client */
+        g->keymap_focused = ev->xfocus.mode == NotifyNormal ||
+            ev->xfocus.mode == NotifyUngrab;
+        if (!g->keymap_focused)
+            g->keymap_valid = false;
+        break;
+    case FocusOut:
+        g->keymap_focused = false;
+        g->keymap_valid = false;
+        break;
+    }
+}
+
+/* send MSG_KEYMAP_NOTIFY; if the tracked state is stale and the X server
+ * is going to send KeymapNotify (after EnterNotify and FocusIn), send it
+ * from that event, otherwise ask the X server */
+static void send_keymap_notify(Ghandles * g, bool keymap_event_follows)
+{
+    if (g->keymap_valid) {
+        g->stats.keymap_cached++;
+    } else if (keymap_event_follows) {
+        g->keymap_notify_pending = true;
+        return;
+    } else {
+        XQueryKeymap(g->display, g->keymap);
+        g->keymap_valid = g->keymap_focused;
+        g->stats.keymap_queries++;
+    }
+    write_keymap_notify(g);
+}
+
 /* handle local Xserver event: XKeyEvent
  * send it to relevant window in VM
  */
@@ -1712,19 +1941,90 @@ static void process_xevent_close(Ghandles * g, XID window)
     write_struct(g->vchan, hdr);
 }
 
+/* window positions computed from tracked frame geometry before one is
+ * verified with XTranslateCoordinates() */
+#define FRAME_CHECK_INTERVAL 64
+
+/* stop tracking geometry of the frame window */
+static void frame_untrack(Ghandles *g, struct windowdata *vm_window)
+{
+    struct genlist *item;
+
+    if (!vm_window->frame_tracked)
+        return;
+    item = list_lookup(g->frame2windowdata, vm_window->local_frame_winid);
+    if (item && item->data == vm_window)
+        list_remove(item);
+    /* the frame may be gone already, BadWindow is ignored */
+    XSelectInput(g->display, vm_window->local_frame_winid, NoEventMask);
+    vm_window->frame_tracked = false;
+}
+
+/* (re)read geometry of the frame window and our window position in it,
+ * false if it is not a direct child of the root window (or is gone) */
+static bool frame_read_geometry(Ghandles *g, struct windowdata *vm_window)
+{
+    Window frame = vm_window->local_frame_winid;
+    Window root, parent, *children, child;
+    unsigned int nchildren;
+    int x, y;
+
+    if (!XQueryTree(g->display, frame, &root, &parent, &children, &nchildren))
+        return false;
+    if (children)
+        XFree(children);
+    if (parent != g->root_win)
+        return false;
+    if (!XTranslateCoordinates(g->display, frame, g->root_win, 0, 0, &x, &y,
+                &child))
+        return false;
+    vm_window->frame_x = x;
+    vm_window->frame_y = y;
+    if (!XTranslateCoordinates(g->display, vm_window->local_winid, frame, 0, 0,
+                &x, &y, &child))
+        return false;
+    vm_window->frame_child_x = x;
+    vm_window->frame_child_y = y;
+    vm_window->frame_translations = 0;
+    return true;
+}
+
+/* start tracking geometry of a new frame window */
+static void frame_track(Ghandles *g, struct windowdata *vm_window)
+{
+    /* docked icons are embedded in a tray, not a frame */
+    if (vm_window->is_docked)
+        return;
+    /* select first, to not miss any change after reading the geometry */
+    XSelectInput(g->display, vm_window->local_frame_winid, StructureNotifyMask);
+    if (!frame_read_geometry(g, vm_window)) {
+        XSelectInput(g->display, vm_window->local_frame_winid, NoEventMask);
+        return;
+    }
+    if (!list_insert(g->frame2windowdata, vm_window->local_frame_winid,
+                vm_window)) {
+        fprintf(stderr, "list_insert(g->frame2windowdata failed\n");
+        exit(1);
+    }
+    vm_window->frame_tracked = true;
+}
+
 /* handle local Xserver event XReparentEvent
  * store information whether the window is reparented into some frame window */
 static void process_xevent_reparent(Ghandles *g, XReparentEvent *ev) {
     CHECK_NONMANAGED_WINDOW(g, ev->window);
 
+    frame_untrack(g, vm_window);
     /* check if current parent matches the one in the VM - this means the
      * window is reparented back into original structure (window manager
      * restart?)
      */
     if (ev->parent == g->root_win)
         vm_window->local_frame_winid = 0;
-    else
+    else {
         vm_window->local_frame_winid = ev->parent;
+        frame_track(g, vm_window);
+    }
     if (g->log_level > 1)
         fprintf(stderr,
             "process_xevent_reparent(synth %d) local 0x%x remote 0x%x, "
@@ -1749,6 +2049,16 @@ static void send_configure(Ghandles * g, struct windowdata *vm_window, int x, in
     write_message(g->vchan, hdr, msg);
 }
 
+/* send current local geometry of the window to the VM and wait for its
+ * confirmation before sending another one */
+static void send_local_configure(Ghandles * g, struct windowdata *vm_window)
+{
+    if (vm_window->remote_winid != FULLSCREEN_WINDOW_ID)
+        vm_window->have_queued_configure = 1;
+    send_configure(g, vm_window, vm_window->x, vm_window->y,
+               vm_window->width, vm_window->height);
+}
+
 /* fix position of docked tray icon;
  * icon position is relative to embedder 0,0 so we must translate it to
  * absolute position */
@@ -2001,6 +2311,60 @@ static int validate_override_redirect(Ghandles * g, struct windowdata *vm_window
     return req_override_redirect;
 }
 
+/* verify locally tracked frame geometry against window position reported by
+ * the X server, re-read it on mismatch */
+static void frame_check_geometry(Ghandles * g, struct windowdata *vm_window,
+        int x, int y)
+{
+    vm_window->frame_translations = 0;
+    if (x == vm_window->frame_x + vm_window->frame_child_x &&
+            y == vm_window->frame_y + vm_window->frame_child_y)
+        return;
+    g->stats.frame_mismatches++;
+    if (g->log_level > 1)
+        fprintf(stderr, "frame geometry of 0x%lx(0x%lx) out of sync: "
+                "%d/%d, X server reports %d/%d\n",
+                vm_window->local_winid, vm_window->remote_winid,
+                vm_window->frame_x + vm_window->frame_child_x,
+                vm_window->frame_y + vm_window->frame_child_y, x, y);
+    if (!frame_read_geometry(g, vm_window))
+        frame_untrack(g, vm_window);
+}
+
+/* apply new local window position/size and send it to the VM */
+static void update_local_geometry(Ghandles * g, struct windowdata *vm_window,
+        int x, int y, int width, int height)
+{
+    if ((int)vm_window->width == width
+        && (int)vm_window->height == height && vm_window->x == x
+        && vm_window->y == y)
+        return;
+    vm_window->width = width;
+    vm_window->height = height;
+    if (!vm_window->is_docked) {
+        vm_window->x = x;
+        vm_window->y = y;
+    } else
+        fix_docked_xy(g, vm_window, "process_xevent_configure");
+
+    if (vm_window->override_redirect
+        && force_on_screen(g, vm_window, override_redirect_padding,
+                           "handle_map")) {
+        if (g->log_level > 0)
+            fprintf(stderr,
+                    "Something moved/resized override-redirect window "
+                    "0x%lx(0x%lx) outside of allowed area, moving it back\n",
+                    vm_window->local_winid, vm_window->remote_winid);
+        moveresize_vm_window(g, vm_window, false);
+        XFlush(g->display);
+    }
+
+// if AppVM has not unacknowledged previous resize msg, do not send another one
+    if (vm_window->have_queued_configure)
+        return;
+    send_local_configure(g, vm_window);
+}
+
 /* handle local Xserver event: XConfigureEvent
  * after some checks/fixes send to relevant window in VM */
 static void process_xevent_configure(Ghandles * g, const XConfigureEvent * ev)
@@ -2026,9 +2390,23 @@ static void process_xevent_configure(Ghandles * g, const XConfigureEvent * ev)
      */
     if (!ev->send_event && vm_window->local_frame_winid) {
         /* needs to translate coordinates */
-        Window child;
-        XTranslateCoordinates(g->display, ev->window, g->root_win,
-                0, 0, &x, &y, &child);
+        if (vm_window->frame_tracked) {
+            vm_window->frame_child_x = ev->x + ev->border_width;
+            vm_window->frame_child_y = ev->y + ev->border_width;
+        }
+        if (vm_window->frame_tracked &&
+                ++vm_window->frame_translations < FRAME_CHECK_INTERVAL) {
+            x = vm_window->frame_x + vm_window->frame_child_x;
+            y = vm_window->frame_y + vm_window->frame_child_y;
+            g->stats.frame_local++;
+        } else {
+            Window child;
+            XTranslateCoordinates(g->display, ev->window, g->root_win,
+                    0, 0, &x, &y, &child);
+            g->stats.frame_queries++;
+            if (vm_window->frame_tracked)
+                frame_check_geometry(g, vm_window, x, y);
+        }
         if (g->log_level > 1)
             fprintf(stderr, "  translated to %d/%d\n", x, y);
     } else {
@@ -2036,37 +2414,39 @@ static void process_xevent_configure(Ghandles * g, const XConfigureEvent * ev)
         y = ev->y;
     }
 
-    if ((int)vm_window->width == ev->width
-        && (int)vm_window->height == ev->height && vm_window->x == x
-        && vm_window->y == y)
-        return;
-    vm_window->width = ev->width;
-    vm_window->height = ev->height;
-    if (!vm_window->is_docked) {
-        vm_window->x = x;
-        vm_window->y = y;
-    } else
-        fix_docked_xy(g, vm_window, "process_xevent_configure");
+    update_local_geometry(g, vm_window, x, y, ev->width, ev->height);
+}
 
-    if (vm_window->override_redirect
-        && force_on_screen(g, vm_window, override_redirect_padding,
-                           "handle_map")) {
-        if (g->log_level > 0)
-            fprintf(stderr,
-                    "Something moved/resized override-redirect window "
-                    "0x%lx(0x%lx) outside of allowed area, moving it back\n",
-                    vm_window->local_winid, vm_window->remote_winid);
-        moveresize_vm_window(g, vm_window, false);
-        XFlush(g->display);
-    }
+/* handle local Xserver event about a frame window with tracked geometry,
+ * returns false if the window is not such a frame */
+static bool process_xevent_frame(Ghandles * g, const XEvent * ev)
+{
+    struct genlist *item = list_lookup(g->frame2windowdata, ev->xany.window);
+    struct windowdata *vm_window;
+    int x, y;
 
-// if AppVM has not unacknowledged previous resize msg, do not send another one
-    if (vm_window->have_queued_configure)
-        return;
-    if (vm_window->remote_winid != FULLSCREEN_WINDOW_ID)
-        vm_window->have_queued_configure = 1;
-    send_configure(g, vm_window, vm_window->x, vm_window->y,
-               vm_window->width, vm_window->height);
+    if (!item)
+        return false;
+    vm_window = item->data;
+    switch (ev->type) {
+    case ConfigureNotify:
+        x = ev->xconfigure.x + ev->xconfigure.border_width;
+        y = ev->xconfigure.y + ev->xconfigure.border_width;
+        if (x == vm_window->frame_x && y == vm_window->frame_y)
+            break;
+        vm_window->frame_x = x;
+        vm_window->frame_y = y;
+        /* frame moved, so did our window */
+        update_local_geometry(g, vm_window, x + vm_window->frame_child_x,
+                y + vm_window->frame_child_y, vm_window->width,
+                vm_window->height);
+        break;
+    case ReparentNotify:
+    case DestroyNotify:
+        frame_untrack(g, vm_window);
+        break;
+    }
+    return true;
 }
 
 /* handle VM message: MSG_CONFIGURE
@@ -2123,9 +2503,7 @@ static void handle_configure_from_vm(Ghandles * g, struct windowdata *vm_window)
 
     if (vm_window->have_queued_configure) {
         if (conf_changed) {
-            send_configure(g, vm_window, vm_window->x,
-                       vm_window->y, vm_window->width,
-                       vm_window->height);
+            send_local_configure(g, vm_window);
             return;
         } else {
             // same dimensions; this is an ack for our previously sent configure req
@@ -2163,13 +2541,8 @@ static void process_xevent_crossing(Ghandles * g, const XCrossingEvent * ev)
     struct msg_crossing k;
     CHECK_NONMANAGED_WINDOW(g, ev->window);
 
-    if (ev->type == EnterNotify) {
-        char keys[32];
-        XQueryKeymap(g->display, keys);
-        hdr.type = MSG_KEYMAP_NOTIFY;
-        hdr.window = 0;
-        write_message(g->vchan, hdr, keys);
-    }
+    if (ev->type == EnterNotify)
+        send_keymap_notify(g, true);
     /* move tray to correct position in VM */
     if (vm_window->is_docked &&
         fix_docked_xy(g, vm_window, "process_xevent_crossing")) {
@@ -2224,13 +2597,8 @@ static void process_xevent_focus(Ghandles * g, const XFocusChangeEvent * ev)
     if (ev->mode != NotifyNormal && ev->mode != NotifyWhileGrabbed)
         return;
 
-    if (ev->type == FocusIn) {
-        char keys[32];
-        XQueryKeymap(g->display, keys);
-        hdr.type = MSG_KEYMAP_NOTIFY;
-        hdr.window = 0;
-        write_message(g->vchan, hdr, keys);
-    }
+    if (ev->type == FocusIn)
+        send_keymap_notify(g, true);
     hdr.type = MSG_FOCUS;
     hdr.window = vm_window->remote_winid;
     k.type = ev->type;
@@ -2254,6 +2622,13 @@ static void do_shm_update(Ghandles * g, struct windowdata *vm_window,
     int border_width = BORDER_WIDTH;
     int border_padding = 0; /* start forced border x pixels from the edge */
     int x = 0, y = 0, w = 0, h = 0;
+    bool do_border = false;
+    struct shm_clip_geometry geo = {
+        .win_x = vm_window->x,
+        .win_y = vm_window->y,
+        .win_width = vm_window->width,
+        .win_height = vm_window->height,
+    };
     ASSERT_WIDTH_UNSIGNED(vm_window->width);
     ASSERT_HEIGHT_UNSIGNED(vm_window->height);
 
@@ -2279,95 +2654,21 @@ static void do_shm_update(Ghandles * g, struct windowdata *vm_window,
         // (checked in handle_mfndump and handle_window_dump)
         ASSERT_WIDTH(vm_window->image_width);
         ASSERT_HEIGHT(vm_window->image_height);
-
-        // now do actual calculations
-        x = min(untrusted_x, vm_window->image_width);
-        // now: x is not negative and not greater than vm_window->image_width
-        y = min(untrusted_y, vm_window->image_height);
-        // now: y is not negative and not greater than vm_window->image_height
-        w = min(untrusted_w, vm_window->image_width - x);
-        // now: w is not negative and not greater than vm_window->image_width
-        h = min(untrusted_h, vm_window->image_height - y);
-        // now: h is not negative and not greater than vm_window->image_height
+        geo.image_width = vm_window->image_width;
+        geo.image_height = vm_window->image_height;
     } else if (g->screen_window) {
         /* update only onscreen window part */
-        // image_width and image_height are not negative
-        // (checked in handle_mfndump and handle_window_dump)
         ASSERT_WIDTH(g->screen_window->image_width);
         ASSERT_HEIGHT(g->screen_window->image_height);
-
-        // now do actual calculations
-        if (vm_window->x >= g->screen_window->image_width ||
-                vm_window->y >= g->screen_window->image_height) {
-            // window is entirely off-screen
-            return;
-        }
-        // now: vm_window->x is less than g->screen_window->image_width
-        // now: vm_window->y is less than g->screen_window->image_height
-        // now: g->screen_window->image_width - vm_window->x > 0
-        // now: g->screen_window->image_height - vm_window->y > 0
-
-        if (vm_window->x < 0 && vm_window->x+untrusted_x < 0) {
-            // we know vm_window->x is not less than -MAX_WINDOW_WIDTH, so this
-            // is not UB.
-            untrusted_x = -vm_window->x;
-        }
-        // now: untrusted_x + vm_window->x is not negative and untrusted_x is not
-        // negative
-
-        if (vm_window->y < 0 && vm_window->y+untrusted_y < 0) {
-            // we know vm_window->y is not less than -MAX_WINDOW_HEIGHT, so this
-            // is not UB.
-            untrusted_y = -vm_window->y;
-        }
-        // now: untrusted_y + vm_window->y is not negative and untrusted_y is
-        // not negative
-
-        // vm_window->x is greater than INT_MIN + MAX_WINDOW_WIDTH, so this is not UB
-        x = min(untrusted_x, g->screen_window->image_width - vm_window->x);
-        // now: x is not negative and x + vm_window->x is not negative
-        // now: x + vm_window->x is not greater than g->screen_window->image_width
-
-        // vm_window->y is greater than INT_MIN + MAX_WINDOW_HEIGHT, so this is not UB
-        y = min(untrusted_y, g->screen_window->image_height - vm_window->y);
-        // now: y is not negative and y + vm_window->y is not negative
-        // now: y + vm_window->y is not greater than g->screen_window->image_height
-
-        w = min(untrusted_w, g->screen_window->image_width - vm_window->x - x);
-        // now: w is not negative and not greater than g->screen_window->image_width
-        // also: g->screen_window->image_width >= (vm_window->x + x + w)
-        // so if the code that forces the window on-screen makes vm_window->x + x
-        // exceed g->screen_window->image_width, w will become negative, causing
-        // the code to return early.
-
-        h = min(untrusted_h, g->screen_window->image_height - vm_window->y - y);
-        // now: h is not negative and not greater than g->screen_window->image_height
-        // also: g->screen_window->image_height >= (vm_window->y + y + h)
-        // so if the code that forces the window on-screen makes vm_window->y + y
-        // exceed g->screen_window->image_height, h will become negative, causing
-        // the code to return early.
-
-        // if the requested area is outside of the window, this will be caught
-        // by the code below that checks for frames being overwritten
+        geo.screen_image = true;
+        geo.image_width = g->screen_window->image_width;
+        geo.image_height = g->screen_window->image_height;
     } else {
         /* no image to update, will return after possibly drawing a frame */
-        // width and height are not negative
-        // (checked in handle_mfndump and handle_window_dump)
-        ASSERT_WIDTH(vm_window->image_width);
-        ASSERT_HEIGHT(vm_window->image_height);
-
-        x = min(untrusted_x, (int)vm_window->width);
-        // now: x is not negative and not greater than vm_window->width
-        y = min(untrusted_y, (int)vm_window->height);
-        // now: y is not negative and not greater than vm_window->height
-        w = min(untrusted_w, (int)vm_window->width - x);
-        // now: w is not negative and not greater than vm_window->width
-        h = min(untrusted_h, (int)vm_window->height - y);
-        // now: h is not negative and not greater than vm_window->height
+        geo.image_width = vm_window->width;
+        geo.image_height = vm_window->height;
     }
 
-    /* sanitize end */
-
     if (!vm_window->override_redirect) {
         // Window Manager will take care of the frame...
         border_width = 0;
@@ -2380,60 +2681,26 @@ static void do_shm_update(Ghandles * g, struct windowdata *vm_window,
         } else
             border_width = 0;
     }
+    geo.border_width = border_width;
 
-    assert(x >= 0 && y >= 0 && w >= 0 && h >= 0);
-    assert(border_width >= 0);
-
-    bool do_border = false;
-    if ((int)vm_window->width <= border_width * 2
-        || (int)vm_window->height <= border_width * 2) {
+    x = untrusted_x;
+    y = untrusted_y;
+    w = untrusted_w;
+    h = untrusted_h;
+    switch (shm_update_clip(&geo, &x, &y, &w, &h, &do_border)) {
+    case SHM_CLIP_NOTHING:
+        return;
+    case SHM_CLIP_FRAME_ONLY:
         /* window contains only (forced) frame, so no content to update */
         XFillRectangle(g->display, vm_window->local_winid,
                    g->frame_gc, 0, 0,
                    vm_window->width,
                    vm_window->height);
         return;
+    case SHM_CLIP_UPDATE:
+        break;
     }
 
-    const int right = x + w, bottom = y + h;
-    /* force frame to be visible: */
-    /*   * left */
-    if (border_width > x) { // window would cover left border
-        if (w <= border_width - x)
-            return; /* nothing left to update */
-        w -= border_width - x;
-        x = border_width;
-        do_border = 1;
-    }
-    /*   * right */
-    const int right_allowed = vm_window->width - border_width;
-    if (right > right_allowed) { // window would cover right border
-        if (right_allowed <= x)
-            return; /* nothing left to update */
-        w = right_allowed - x;
-        do_border = 1;
-    }
-    /*   * top */
-    if (border_width > y) { // window would cover top border
-        if (h <= border_width - y)
-            return; /* nothing left to update */
-        h -= (border_width - y);
-        y = border_width;
-        do_border = 1;
-    }
-    /*   * bottom */
-    const int bottom_allowed = vm_window->height - border_width;
-    if (bottom > bottom_allowed) { // window would cover bottom border
-        if (bottom_allowed <= y)
-            return; /* nothing left to update */
-        h = bottom_allowed - y;
-        do_border = 1;
-    }
-
-    /* again check if something left to update */
-    if (w <= 0 || h <= 0)
-        return;
-
     if (g->log_level > 1)
         fprintf(stderr,
                 "  do_shm_update for 0x%x(remote 0x%x), after border calc: x=%d, y=%d, w=%d, h=%d\n",
@@ -2534,76 +2801,146 @@ static inline uint32_t flags_from_atom(Ghandles * g, Atom a) {
     return 0;
 }
 
-/* handle local Xserver event: XPropertyEvent
- * currently only _NET_WM_STATE is examined */
-static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent *const ev)
+/* maximum number of _NET_WM_STATE atoms read */
+#define WM_STATE_MAX_ATOMS 1024
+
+/* send MSG_WINDOW_FLAGS if window flags changed */
+static void send_window_flags(Ghandles *g, struct windowdata *vm_window,
+        uint32_t flags)
 {
-    long *state_list;
-    size_t nitems;
-    unsigned long i;
-    int maximize_flags_seen;
-    uint32_t flags;
     struct msg_hdr hdr;
     struct msg_window_flags msg;
 
+    if (flags == vm_window->flags_set) {
+        /* no change */
+        return;
+    }
+    hdr.type = MSG_WINDOW_FLAGS;
+    hdr.window = vm_window->remote_winid;
+    msg.flags_set = flags & ~vm_window->flags_set;
+    msg.flags_unset = ~flags & vm_window->flags_set;
+    write_message(g->vchan, hdr, msg);
+    vm_window->flags_set = flags;
+}
+
+/* send window flags based on _NET_WM_STATE atoms */
+static void update_wm_state(Ghandles *g, struct windowdata *vm_window,
+        const xcb_atom_t *state_list, size_t nitems)
+{
+    size_t i;
+    int maximize_flags_seen;
+    uint32_t flags;
+
+    flags = 0;
+    /* check if both VERT and HORZ states are set */
+    maximize_flags_seen = 0;
+    for (i = 0; i < nitems; i++) {
+        const Atom state = (Atom)state_list[i];
+        flags |= flags_from_atom(g, state);
+        if (state == g->wm_state_maximized_vert)
+            maximize_flags_seen |= 1;
+        if (state == g->wm_state_maximized_horz)
+            maximize_flags_seen |= 2;
+    }
+    if (flags & WINDOW_FLAG_FULLSCREEN) {
+        /* if user triggered real fullscreen, forget about the fake
+         * one, otherwise application will not be notified when going
+         * back from fullscreen to maximize ("fake fullscreen") */
+        vm_window->fullscreen_maximize_requested = 0;
+    }
+    if (vm_window->fullscreen_maximize_requested) {
+        if (maximize_flags_seen == 3) {
+            /* if fullscreen request was converted to maximize request,
+             * then convert maximize ack to fullscreen ack */
+            flags |= WINDOW_FLAG_FULLSCREEN;
+        } else {
+            /* going out of emulated fullscreen mode */
+            vm_window->fullscreen_maximize_requested = 0;
+        }
+    }
+    send_window_flags(g, vm_window, flags);
+}
+
+/* forget not yet resolved _NET_WM_STATE read of the window */
+static void cancel_wm_state_read(Ghandles *g, struct windowdata *vm_window)
+{
+    struct genlist *item;
+
+    if (!vm_window->wm_state_pending)
+        return;
+    xcb_discard_reply(g->cb_connection, vm_window->wm_state_cookie.sequence);
+    item = list_lookup(g->wm_state_reads, vm_window->local_winid);
+    if (item)
+        list_remove(item);
+    vm_window->wm_state_pending = false;
+}
+
+/* Property reads are only requested when the PropertyNotify event is
+ * handled, and the replies are processed once all the queued X events are
+ * handled, so many changes (e.g. switching to a desktop with many VM
+ * windows) take one round trip instead of one per event. A newer change
+ * of the same property replaces a request still in flight. */
+static void process_pending_property_reads(Ghandles *g)
+{
+    struct genlist *item, *next;
+
+    if (g->current_desktop_pending || g->workarea_pending)
+        finish_work_area(g);
+    for (item = g->wm_state_reads->next; item != g->wm_state_reads; item = next) {
+        struct windowdata *vm_window = item->data;
+        xcb_get_property_reply_t *reply;
+
+        next = item->next;
+        list_remove(item);
+        vm_window->wm_state_pending = false;
+        reply = xcb_get_property_reply(g->cb_connection,
+                vm_window->wm_state_cookie, NULL);
+        if (!reply || reply->format != 32) {
+            if (g->log_level > 0)
+                fprintf(stderr, "Failed to get 0x%x window state details\n",
+                        (int)vm_window->local_winid);
+            free(reply);
+            continue;
+        }
+        update_wm_state(g, vm_window, xcb_get_property_value(reply),
+                xcb_get_property_value_length(reply) / sizeof(xcb_atom_t));
+        free(reply);
+    }
+}
+
+/* handle local Xserver event: XPropertyEvent
+ * currently only _NET_WM_STATE is examined */
+static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent *const ev)
+{
     if (ev->window == g->root_win) {
-        if (ev->state == PropertyNewValue)
-            update_work_area(g);
+        /* other root window properties change often, e.g.
+         * _NET_ACTIVE_WINDOW, and are not interesting */
+        if (ev->state != PropertyNewValue)
+            return;
+        if (ev->atom == g->net_current_desktop)
+            request_work_area(g, true, false);
+        else if (ev->atom == g->wm_workarea)
+            request_work_area(g, false, true);
         return;
     }
     CHECK_NONMANAGED_WINDOW(g, ev->window);
     if (ev->atom == g->wm_state) {
         if (!vm_window->is_mapped)
             return;
+        cancel_wm_state_read(g, vm_window);
         if (ev->state == PropertyNewValue) {
-            if (!qubes_get_all_atom_properties(g->display,
-                    vm_window->local_winid, g->wm_state, &state_list, &nitems)) {
-                if (g->log_level > 0) {
-                    fprintf(stderr, "Failed to get 0x%x window state details\n", (int)ev->window);
-                    return;
-                }
-            }
-            flags = 0;
-            /* check if both VERT and HORZ states are set */
-            maximize_flags_seen = 0;
-            for (i = 0; i < nitems; i++) {
-                const Atom state = (Atom)state_list[i];
-                flags |= flags_from_atom(g, state);
-                if (state == g->wm_state_maximized_vert)
-                    maximize_flags_seen |= 1;
-                if (state == g->wm_state_maximized_horz)
-                    maximize_flags_seen |= 2;
-            }
-            if (flags & WINDOW_FLAG_FULLSCREEN) {
-                /* if user triggered real fullscreen, forget about the fake
-                 * one, otherwise application will not be notified when going
-                 * back from fullscreen to maximize ("fake fullscreen") */
-                vm_window->fullscreen_maximize_requested = 0;
-            }
-            if (vm_window->fullscreen_maximize_requested) {
-                if (maximize_flags_seen == 3) {
-                    /* if fullscreen request was converted to maximize request,
-                     * then convert maximize ack to fullscreen ack */
-                    flags |= WINDOW_FLAG_FULLSCREEN;
-                } else {
-                    /* going out of emulated fullscreen mode */
-                    vm_window->fullscreen_maximize_requested = 0;
-                }
+            vm_window->wm_state_cookie = xcb_get_property(g->cb_connection,
+                    0, vm_window->local_winid, g->wm_state, XCB_ATOM_ATOM,
+                    0, WM_STATE_MAX_ATOMS);
+            if (!list_insert(g->wm_state_reads, vm_window->local_winid,
+                        vm_window)) {
+                fprintf(stderr, "list_insert(g->wm_state_reads) failed\n");
+                exit(1);
             }
-            XFree(state_list);
+            vm_window->wm_state_pending = true;
         } else { /* PropertyDelete */
-            flags = 0;
+            send_window_flags(g, vm_window, 0);
         }
-        if (flags == vm_window->flags_set) {
-            /* no change */
-            return;
-        }
-        hdr.type = MSG_WINDOW_FLAGS;
-        hdr.window = vm_window->remote_winid;
-        msg.flags_set = flags & ~vm_window->flags_set;
-        msg.flags_unset = ~flags & vm_window->flags_set;
-        write_message(g->vchan, hdr, msg);
-        vm_window->flags_set = flags;
     }
 }
 
@@ -2631,11 +2968,7 @@ static void process_xevent_xembed(Ghandles * g, const XClientMessageEvent * ev)
     } else if (ev->data.l[1] == XEMBED_FOCUS_IN) {
         struct msg_hdr hdr;
         struct msg_focus k;
-        char keys[32];
-        XQueryKeymap(g->display, keys);
-        hdr.type = MSG_KEYMAP_NOTIFY;
-        hdr.window = 0;
-        write_message(g->vchan, hdr, keys);
+        send_keymap_notify(g, false);
         hdr.type = MSG_FOCUS;
         hdr.window = vm_window->remote_winid;
         k.type = FocusIn;
@@ -2681,96 +3014,375 @@ static void dock_all_windows(Ghandles *g, Window tray)
     }
 }
 
-/* get current time */
-static int64_t ebuf_current_time_ms()
+/* top-level window in the stacking order cache */
+struct stack_window {
+    bool override_redirect;
+    bool mapped;
+    bool keep_on_top;               /* valid if class_known */
+    bool class_known;
+    bool class_pending;             /* class_cookie not yet resolved */
+    xcb_get_property_cookie_t class_cookie;   /* WM_CLASS read in flight */
+};
+
+/* request WM_CLASS of a mapped override-redirect window not created by us,
+ * needed to tell if it is a screensaver; resolved when restacking */
+static void stacking_request_class(Ghandles *g, Window w, struct stack_window *sw)
+{
+    if (sw->class_pending)
+        xcb_discard_reply(g->cb_connection, sw->class_cookie.sequence);
+    sw->class_pending = false;
+    sw->class_known = true;
+    sw->keep_on_top = false;
+    if (!sw->override_redirect || !sw->mapped ||
+            list_lookup(g->wid2windowdata, w))
+        return;
+    sw->class_cookie = xcb_get_property(g->cb_connection, 0, w,
+            XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 256);
+    sw->class_pending = true;
+    sw->class_known = false;
+}
+
+/* Check if we should keep this window on top of others */
+static bool stacking_keep_on_top(Ghandles *g, struct stack_window *sw)
+{
+    xcb_get_property_reply_t *reply;
+    const char *res_name;
+    int len, i;
+
+    if (!sw->override_redirect || !sw->mapped)
+        return false;
+    if (sw->class_known)
+        return sw->keep_on_top;
+    sw->class_pending = false;
+    sw->class_known = true;
+    sw->keep_on_top = false;
+    /* Check if this is a dom0 screensaver window by looking at window class.
+     * (VM windows have a prefix, so this is not spoofable by a VM). */
+    reply = xcb_get_property_reply(g->cb_connection, sw->class_cookie, NULL);
+    if (!reply)
+        return false;
+    if (reply->format == 8) {
+        res_name = xcb_get_property_value(reply);
+        len = strnlen(res_name, xcb_get_property_value_length(reply));
+        for (i = 0; i < MAX_SCREENSAVER_NAMES && g->screensaver_names[i]; i++) {
+            if ((int)strlen(g->screensaver_names[i]) == len &&
+                    memcmp(res_name, g->screensaver_names[i], len) == 0) {
+                sw->keep_on_top = true;
+                break;
+            }
+        }
+    }
+    free(reply);
+    return sw->keep_on_top;
+}
+
+/* forget a window in the stacking order cache */
+static void stacking_remove(Ghandles *g, struct genlist *item)
+{
+    struct stack_window *sw = item->data;
+
+    if (sw->class_pending)
+        xcb_discard_reply(g->cb_connection, sw->class_cookie.sequence);
+    free(sw);
+    list_remove(item);
+}
+
+/* add window to the stacking order cache, directly above sibling (None
+ * meaning bottom, and the top of the stack if sibling is not known) */
+static struct stack_window *stacking_add(Ghandles *g, Window w, Window sibling)
+{
+    struct genlist *item, *anchor;
+    struct stack_window *sw;
+
+    item = list_lookup(g->stacking, w);
+    if (item)
+        stacking_remove(g, item);
+    if (sibling == None) {
+        anchor = g->stacking;
+    } else {
+        anchor = list_lookup(g->stacking, sibling);
+        if (!anchor)
+            anchor = g->stacking->prev;
+    }
+    sw = calloc(1, sizeof(*sw));
+    if (!sw || !list_insert(anchor, w, sw)) {
+        fprintf(stderr, "stacking_add: out of memory\n");
+        exit(1);
+    }
+    return sw;
+}
+
+/* move window directly above sibling in the stacking order cache */
+static void stacking_move(Ghandles *g, Window w, Window sibling)
+{
+    struct genlist *item;
+    struct stack_window *sw, *moved;
+
+    item = list_lookup(g->stacking, w);
+    if (!item)
+        return;
+    sw = item->data;
+    /* avoid freeing the data and the pending request */
+    item->data = NULL;
+    list_remove(item);
+    moved = stacking_add(g, w, sibling);
+    *moved = *sw;
+    free(sw);
+}
+
+/* Maintain the stacking order of top-level windows, bottom to top, based on
+ * root window SubstructureNotify events, so restack_windows() does not need
+ * XQueryTree and per-window round trips. Returns true if the event was a
+ * notification about a root window child, which is not handled otherwise. */
+static bool stacking_track_xevent(Ghandles *g, const XEvent *ev)
+{
+    struct genlist *item;
+    struct stack_window *sw;
+
+    if (ev->xany.window != g->root_win || ev->xany.send_event)
+        return false;
+    switch (ev->type) {
+    case CreateNotify:
+        sw = stacking_add(g, ev->xcreatewindow.window, g->stacking->prev ==
+                g->stacking ? None : (Window)g->stacking->prev->key);
+        sw->override_redirect = ev->xcreatewindow.override_redirect;
+        return true;
+    case DestroyNotify:
+        if (ev->xdestroywindow.window == g->root_win)
+            return false;
+        item = list_lookup(g->stacking, ev->xdestroywindow.window);
+        if (item)
+            stacking_remove(g, item);
+        return true;
+    case ReparentNotify:
+        item = list_lookup(g->stacking, ev->xreparent.window);
+        if (ev->xreparent.parent != g->root_win) {
+            if (item)
+                stacking_remove(g, item);
+        } else {
+            /* reparented window is placed on top of its new siblings */
+            sw = stacking_add(g, ev->xreparent.window, g->stacking->prev ==
+                    g->stacking ? None : (Window)g->stacking->prev->key);
+            sw->override_redirect = ev->xreparent.override_redirect;
+        }
+        return true;
+    case MapNotify:
+        item = list_lookup(g->stacking, ev->xmap.window);
+        if (!item)
+            return true;
+        sw = item->data;
+        sw->mapped = true;
+        sw->override_redirect = ev->xmap.override_redirect;
+        stacking_request_class(g, ev->xmap.window, sw);
+        return true;
+    case UnmapNotify:
+        item = list_lookup(g->stacking, ev->xunmap.window);
+        if (item)
+            ((struct stack_window *)item->data)->mapped = false;
+        return true;
+    case ConfigureNotify:
+        if (ev->xconfigure.window == g->root_win)
+            return false;
+        item = list_lookup(g->stacking, ev->xconfigure.window);
+        if (item)
+            ((struct stack_window *)item->data)->override_redirect =
+                ev->xconfigure.override_redirect;
+        stacking_move(g, ev->xconfigure.window, ev->xconfigure.above);
+        return true;
+    case CirculateNotify:
+        if (ev->xcirculate.place == PlaceOnTop)
+            stacking_move(g, ev->xcirculate.window, g->stacking->prev->key);
+        else
+            stacking_move(g, ev->xcirculate.window, None);
+        return true;
+    case GravityNotify:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* empty the stacking order cache */
+static void stacking_clear(Ghandles *g)
+{
+    while (g->stacking->next != g->stacking)
+        stacking_remove(g, g->stacking->next);
+}
+
+/* fill the stacking order cache with current root window children */
+static void stacking_init(Ghandles *g)
+{
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    xcb_get_window_attributes_cookie_t *cookies;
+    int i, count;
+
+    stacking_clear(g);
+    tree = xcb_query_tree_reply(g->cb_connection,
+            xcb_query_tree(g->cb_connection, g->root_win), NULL);
+    if (!tree) {
+        fprintf(stderr, "Cannot query root window children\n");
+        exit(1);
+    }
+    children = xcb_query_tree_children(tree);
+    count = xcb_query_tree_children_length(tree);
+    cookies = calloc(count ? count : 1, sizeof(*cookies));
+    if (!cookies) {
+        fprintf(stderr, "stacking_init: out of memory\n");
+        exit(1);
+    }
+    /* send all the requests before waiting for any reply */
+    for (i = 0; i < count; i++)
+        cookies[i] = xcb_get_window_attributes(g->cb_connection, children[i]);
+    for (i = 0; i < count; i++) {
+        xcb_get_window_attributes_reply_t *attr;
+        struct stack_window *sw;
+
+        attr = xcb_get_window_attributes_reply(g->cb_connection, cookies[i], NULL);
+        /* children are listed bottom to top */
+        sw = stacking_add(g, children[i], i ? children[i - 1] : None);
+        if (attr) {
+            sw->override_redirect = attr->override_redirect;
+            sw->mapped = attr->map_state == XCB_MAP_STATE_VIEWABLE;
+            free(attr);
+        }
+        stacking_request_class(g, children[i], sw);
+    }
+    free(cookies);
+    free(tree);
+}
+
+/* Root window property changes and SubstructureNotify (any window moved or
+ * restacked on the desktop) are needed only for the work area and the
+ * stacking order of VM windows. Select them only while the VM has a
+ * window, so guids of VMs without windows are not woken up by each of
+ * them. */
+static void update_root_events(Ghandles *g)
+{
+    bool active = g->wid2windowdata->next != g->wid2windowdata;
+
+    if (active == g->root_events_active)
+        return;
+    g->root_events_active = active;
+    if (!active) {
+        XSelectInput(g->display, g->root_win, StructureNotifyMask);
+        stacking_clear(g);
+        return;
+    }
+    XSelectInput(g->display, g->root_win,
+            PropertyChangeMask | StructureNotifyMask | SubstructureNotifyMask);
+    /* changes were not tracked until now; after selecting, so no change is
+     * missed */
+    update_work_area(g);
+    stacking_init(g);
+}
+
+/* get current time, in ns */
+static int64_t ebuf_current_time_ns(void)
 {
     int64_t timeval;
     struct timespec spec;
     clock_gettime(CLOCK_MONOTONIC, &spec);
-    timeval = (((int64_t)spec.tv_sec) * 1000LL) + (((int64_t)spec.tv_nsec) / 1000000LL);
+    timeval = (((int64_t)spec.tv_sec) * 1000000000LL) + spec.tv_nsec;
     return timeval;
 }
 
-/* get random delay value */
-static uint32_t ebuf_random_delay(uint32_t upper_bound, uint32_t lower_bound)
+/* random values drawn from ebuf_rng before reseeding it from getrandom() */
+#define EBUF_RNG_RESEED_INTERVAL (1 << 20)
+/* initial size of the event queue, enough for a burst of motion events */
+#define EBUF_INITIAL_SIZE 64
+
+/* get random value, without a syscall for each one */
+static uint32_t ebuf_random_u32(void *opaque)
 {
-    uint32_t maxval;
-    uint32_t randval;
-    size_t randsize;
-    union ebuf_rand ebuf_rand_data;
+    Ghandles *g = opaque;
+    uint32_t seed[8];
+    ssize_t randsize;
 
-    if (lower_bound >= upper_bound) {
-        if (lower_bound > upper_bound) {
-            fprintf(stderr,
-                    "Bug detected - lower_bound > upper_bound, events may get briefly stuck");
-        }
-        return upper_bound;
+    if (!g->ebuf_rng_left) {
+        do {
+            randsize = getrandom(seed, sizeof(seed), 0);
+            if (randsize < 0 && errno != EINTR) {
+                perror("getrandom");
+                exit(1);
+            }
+        } while (randsize != sizeof(seed));
+        chacha_rng_seed(&g->ebuf_rng, seed);
+        explicit_bzero(seed, sizeof(seed));
+        g->ebuf_rng_left = EBUF_RNG_RESEED_INTERVAL;
     }
+    g->ebuf_rng_left--;
+    return chacha_rng_u32(&g->ebuf_rng);
+}
 
-    maxval = upper_bound - lower_bound + 1;
-
-    do {
-        randsize = getrandom(ebuf_rand_data.raw, sizeof(uint32_t), 0);
-        if (randsize != sizeof(uint32_t))
-            continue;
-    } while (ebuf_rand_data.val > UINT32_MAX - ((uint32_t)((((uint64_t)UINT32_MAX) + 1) % maxval)));
+/* append an entry to the event queue, growing it if full */
+static struct ebuf_entry *ebuf_push(Ghandles * g)
+{
+    if (g->ebuf_count == g->ebuf_size) {
+        size_t new_size = g->ebuf_size ? g->ebuf_size * 2 : EBUF_INITIAL_SIZE;
+        struct ebuf_entry *new_ebuf;
 
-    randval = ebuf_rand_data.val % maxval;
-    return lower_bound + randval;
+        new_ebuf = malloc(new_size * sizeof(*new_ebuf));
+        if (new_ebuf == NULL) {
+            perror("Could not allocate ebuf:");
+            exit(1);
+        }
+        /* unwrap the ring */
+        for (size_t i = 0; i < g->ebuf_count; i++)
+            new_ebuf[i] = g->ebuf[(g->ebuf_first + i) % g->ebuf_size];
+        free(g->ebuf);
+        g->ebuf = new_ebuf;
+        g->ebuf_size = new_size;
+        g->ebuf_first = 0;
+    }
+    return &g->ebuf[(g->ebuf_first + g->ebuf_count++) % g->ebuf_size];
 }
 
 /* queue input event */
-static void ebuf_queue_xevent(Ghandles * g, XEvent xev)
+static void ebuf_queue_xevent(Ghandles * g, XEvent xev, int64_t recv_ns)
 {
     int64_t current_time;
-    uint32_t random_delay;
     struct ebuf_entry *new_ebuf_entry;
-    uint32_t lower_bound;
-
-    current_time = ebuf_current_time_ms();
-
-    /* 
-     * Each event is scheduled by taking the current time and adding a delay.
-     * We do not want events later in the queue having a release timestamp
-     * that is *less* than an event earlier in the queue. This means that
-     * whatever delay we add *must* be at least enough to give a release
-     * timestamp larger than the one generated last time. To facilitate this,
-     * we set lower_bound to the scheduled release time of the last event
-     * minus the current time. Some sanity checks are included to make sure
-     * lower_bound is never less than 0 or greater than ebuf_max_delay.
-     */
-    lower_bound = min(max(g->ebuf_prev_release_time - current_time, 0), g->ebuf_max_delay);
 
-    random_delay = ebuf_random_delay(g->ebuf_max_delay, lower_bound);
-    new_ebuf_entry = malloc(sizeof(struct ebuf_entry));
-    if (new_ebuf_entry == NULL) {
-        perror("Could not allocate ebuf_entry:");
-        exit(1);
-    }
-    if (current_time > 0 && random_delay > (INT64_MAX - current_time)) {
+    current_time = ebuf_current_time_ns();
+    if (current_time > INT64_MAX - g->ebuf_max_delay * 1000000LL - 1000) {
         fprintf(stderr, "Event scheduler overflow detected, cannot continue");
         exit(1);
     }
-    new_ebuf_entry->time = current_time + random_delay;
+    new_ebuf_entry = ebuf_push(g);
+    new_ebuf_entry->time = ebuf_release_time(g->ebuf_prev_release_time,
+            current_time, g->ebuf_max_delay, ebuf_random_u32, g);
     new_ebuf_entry->xev = xev;
-    TAILQ_INSERT_TAIL(&(g->ebuf_head), new_ebuf_entry, entries);
+    new_ebuf_entry->recv_ns = recv_ns;
     g->ebuf_prev_release_time = new_ebuf_entry->time;
 }
 
 /* dispatch local Xserver event */
-static void process_xevent_core(Ghandles * g, XEvent event_buffer)
+static void process_xevent_core(Ghandles * g, XEvent event_buffer,
+        int64_t recv_ns)
 {
+    int64_t start = stats_now_ns();
+    int64_t end;
+    uint64_t queued_before = vchan_bytes_queued;
+    int input_class;
+
+    keymap_track_xevent(g, &event_buffer);
     switch (event_buffer.type) {
     case KeyPress:
     case KeyRelease:
         process_xevent_keypress(g, (XKeyEvent *) & event_buffer);
         break;
     case ReparentNotify:
-        process_xevent_reparent(g, (XReparentEvent *) &event_buffer);
+        if (!process_xevent_frame(g, &event_buffer))
+            process_xevent_reparent(g, (XReparentEvent *) &event_buffer);
         break;
     case ConfigureNotify:
-        process_xevent_configure(g, (XConfigureEvent *) &
-                     event_buffer);
+        if (!process_xevent_frame(g, &event_buffer))
+            process_xevent_configure(g, (XConfigureEvent *) &
+                         event_buffer);
+        break;
+    case DestroyNotify:
+        process_xevent_frame(g, &event_buffer);
         break;
     case ButtonPress:
     case ButtonRelease:
@@ -2793,7 +3405,8 @@ static void process_xevent_core(Ghandles * g, XEvent event_buffer)
         process_xevent_expose(g, (XExposeEvent *) & event_buffer);
         break;
     case MapNotify:
-        process_xevent_mapnotify(g, (XMapEvent *) & event_buffer);
+        if (!process_xevent_frame(g, &event_buffer))
+            process_xevent_mapnotify(g, (XMapEvent *) & event_buffer);
         break;
     case PropertyNotify:
         process_xevent_propertynotify(g, (XPropertyEvent *) & event_buffer);
@@ -2845,49 +3458,156 @@ static void process_xevent_core(Ghandles * g, XEvent event_buffer)
         break;
     default:;
     }
+    end = stats_now_ns();
+    stats_account_xevent(&g->stats, event_buffer.type, end - start);
+    input_class = stats_input_class(event_buffer.type);
+    if (input_class >= 0 && vchan_bytes_queued != queued_before)
+        stats_input_queued(&g->stats, input_class, vchan_bytes_queued,
+                recv_ns, start, end);
+    stats_input_sent(&g->stats, vchan_bytes_sent);
+}
+
+/* dispatch queued events, returns the number of events released */
+static int ebuf_release_xevents(Ghandles * g)
+{
+    int64_t current_time;
+    struct ebuf_entry current_ebuf_entry;
+    int released = 0;
+
+    current_time = ebuf_current_time_ns();
+    while (g->ebuf_count
+        && (current_time >= g->ebuf[g->ebuf_first].time)) {
+        current_ebuf_entry = g->ebuf[g->ebuf_first];
+        g->ebuf_first = (g->ebuf_first + 1) % g->ebuf_size;
+        g->ebuf_count--;
+        process_xevent_core(g, current_ebuf_entry.xev,
+                current_ebuf_entry.recv_ns);
+        released++;
+    }
+    if (g->ebuf_count == 0) {
+        g->ebuf_next_release = current_time +
+            VCHAN_DEFAULT_POLL_DURATION * 1000000LL;
+    } else {
+        g->ebuf_next_release = g->ebuf[g->ebuf_first].time;
+    }
+    return released;
+}
+
+/* maximum number of X events fetched from XCB at once */
+#define XEVENT_BATCH_SIZE 64
+
+/* X errors for requests without a reply are received as events, since XCB
+ * owns the event queue; report them the same way Xlib would */
+static void process_xcb_error(Ghandles * g, const xcb_generic_error_t *error)
+{
+    XErrorEvent ev = {
+        .type = 0,
+        .display = g->display,
+        .resourceid = error->resource_id,
+        .serial = error->full_sequence,
+        .error_code = error->error_code,
+        .request_code = error->major_code,
+        .minor_code = error->minor_code,
+    };
+
+    x11_error_handler(g->display, &ev);
+}
+
+/* convert event to Xlib structure using converter registered in Xlib for
+ * its type, so Xlib internal state (e.g. XKB keymap) is still updated;
+ * returns false if the event was consumed by Xlib */
+static bool xcb_event_to_xevent(Ghandles * g, xcb_generic_event_t *event,
+        XEvent *xev)
+{
+    const int type = event->response_type & ~0x80;
+    Bool (*proc)(Display *, XEvent *, xEvent *);
+
+    if (type == XCB_GE_GENERIC)
+        return false;
+    proc = XESetWireToEvent(g->display, type, NULL);
+    XESetWireToEvent(g->display, type, proc);
+    if (!proc)
+        return false;
+    return proc(g->display, xev, (xEvent *)event);
 }
 
-/* dispatch queued events */
-static void ebuf_release_xevents(Ghandles * g)
+/* check if motion event is followed by another one with the same
+ * parameters, so sending only the later one is enough */
+static bool motion_superseded(const xcb_generic_event_t *event,
+        const xcb_generic_event_t *next)
 {
-    int64_t current_time;
-    struct ebuf_entry *current_ebuf_entry;
-
-    current_time = ebuf_current_time_ms();
-    while ((current_ebuf_entry = TAILQ_FIRST(&(g->ebuf_head)))
-        && (current_time >= current_ebuf_entry->time)) {
-        XEvent event_buffer = current_ebuf_entry->xev;
-        process_xevent_core(g, event_buffer);
-        TAILQ_REMOVE(&(g->ebuf_head), current_ebuf_entry, entries);
-        free(current_ebuf_entry);
-    }
-    current_ebuf_entry = TAILQ_FIRST(&(g->ebuf_head));
-    if (current_ebuf_entry == NULL) {
-        g->ebuf_next_timeout = VCHAN_DEFAULT_POLL_DURATION;
-    } else {
-        g->ebuf_next_timeout = (int)(current_ebuf_entry->time - current_time);
-    }
+    const xcb_motion_notify_event_t *cur = (const xcb_motion_notify_event_t *)event;
+    const xcb_motion_notify_event_t *nxt = (const xcb_motion_notify_event_t *)next;
+
+    /* only events generated by the X server, not by XSendEvent */
+    return event->response_type == XCB_MOTION_NOTIFY &&
+        next->response_type == XCB_MOTION_NOTIFY &&
+        cur->event == nxt->event &&
+        cur->child == nxt->child &&
+        cur->state == nxt->state &&
+        cur->same_screen == nxt->same_screen;
 }
 
 /* handle or queue local Xserver event */
-static void process_xevent(Ghandles * g)
+static void process_xevent(Ghandles * g, xcb_generic_event_t *event,
+        int64_t recv_ns)
 {
     XEvent event_buffer;
-    XNextEvent(g->display, &event_buffer);
+
+    if (!xcb_event_to_xevent(g, event, &event_buffer))
+        return;
+    /* not delayed, restack_windows() needs the current state */
+    if (stacking_track_xevent(g, &event_buffer))
+        return;
     if (g->ebuf_max_delay > 0) {
         switch (event_buffer.type) {
         case ConfigureNotify:
         case ReparentNotify:
         case MapNotify:
-            process_xevent_core(g, event_buffer);
+            process_xevent_core(g, event_buffer, recv_ns);
             break;
         default:
-            ebuf_queue_xevent(g, event_buffer);
+            ebuf_queue_xevent(g, event_buffer, recv_ns);
             break;
         }
     } else {
-        process_xevent_core(g, event_buffer);
+        process_xevent_core(g, event_buffer, recv_ns);
+    }
+}
+
+/* handle a batch of local Xserver events, returns the number of events
+ * fetched; only the first poll may read from the X connection */
+static int process_xevents(Ghandles * g)
+{
+    xcb_generic_event_t *batch[XEVENT_BATCH_SIZE];
+    int64_t recv_ns;
+    int count, i;
+
+    /* requests are not flushed by polling for events */
+    XFlush(g->display);
+    batch[0] = xcb_poll_for_event(g->cb_connection);
+    if (!batch[0]) {
+        if (xcb_connection_has_error(g->cb_connection))
+            x11_io_error_handler(g->display);
+        return 0;
+    }
+    for (count = 1; count < XEVENT_BATCH_SIZE; count++) {
+        batch[count] = xcb_poll_for_queued_event(g->cb_connection);
+        if (!batch[count])
+            break;
+    }
+    recv_ns = stats_now_ns();
+    g->stats.xevent_batches++;
+    for (i = 0; i < count; i++) {
+        if (batch[i]->response_type == 0)
+            process_xcb_error(g, (xcb_generic_error_t *)batch[i]);
+        else if (i + 1 < count && motion_superseded(batch[i], batch[i + 1]))
+            g->stats.motion_coalesced++;
+        else
+            process_xevent(g, batch[i], recv_ns);
+        free(batch[i]);
     }
+    return count;
 }
 
 
@@ -2912,6 +3632,116 @@ static void handle_shmimage(Ghandles * g, struct windowdata *vm_window)
               untrusted_mx.width, untrusted_mx.height);
 }
 
+/* X client (resource id base) which created a window */
+static uint32_t window_owner(Ghandles * g, Window w)
+{
+    return w & ~xcb_get_setup(g->cb_connection)->resource_id_mask;
+}
+
+/* whether a client of a previous instance still has a window, other than
+ * "except", which is in use or waiting to be adopted */
+static bool owner_has_windows(Ghandles * g, uint32_t owner, Window except)
+{
+    struct genlist *item;
+
+    list_for_each(item, g->wid2windowdata) {
+        struct windowdata *vm_window = item->data;
+
+        if (vm_window->adopted && vm_window->local_winid != except &&
+                window_owner(g, vm_window->local_winid) == owner)
+            return true;
+    }
+    list_for_each(item, g->restored_windows) {
+        struct restored_window *rw = item->data;
+
+        if (rw->local_winid != except &&
+                window_owner(g, rw->local_winid) == owner)
+            return true;
+    }
+    return false;
+}
+
+/* free all X resources retained for a client of a previous instance */
+static void release_retained_client(Ghandles * g, uint32_t owner)
+{
+    unsigned i;
+
+    for (i = 0; i < g->retained_clients_count; i++) {
+        if (window_owner(g, g->retained_clients[i]) != owner)
+            continue;
+        if (g->log_level > 0)
+            fprintf(stderr, "releasing resources of previous instance 0x%x\n",
+                    owner);
+        XKillClient(g->display, g->retained_clients[i]);
+        g->retained_clients[i] =
+            g->retained_clients[--g->retained_clients_count];
+        return;
+    }
+}
+
+/* destroy a window created by a previous instance; the rest of its X
+ * resources goes with its last window */
+static void destroy_adopted_window(Ghandles * g, Window w)
+{
+    uint32_t owner = window_owner(g, w);
+
+    XDestroyWindow(g->display, w);
+    if (!owner_has_windows(g, owner, w))
+        release_retained_client(g, owner);
+}
+
+/* reuse the local window the previous instance had for this VM window,
+ * instead of creating a new one; None if there is none. It is still mapped,
+ * but is_mapped stays 0, so MSG_MAP applies its attributes again. */
+static Window adopt_window(Ghandles * g, struct windowdata *vm_window)
+{
+    struct genlist *item;
+    struct restored_window *rw;
+    xcb_query_tree_reply_t *tree;
+    xcb_generic_error_t *error = NULL;
+    const uint32_t event_mask = VM_WINDOW_EVENT_MASK;
+    Window w;
+
+    item = list_lookup(g->restored_windows, vm_window->remote_winid);
+    if (!item)
+        return None;
+    rw = item->data;
+    list_remove(item);
+    w = rw->local_winid;
+    if (rw->override_redirect != !!vm_window->override_redirect) {
+        destroy_adopted_window(g, w);
+        free(rw);
+        return None;
+    }
+    /* select first, to not miss any change after reading the parent */
+    xcb_change_window_attributes(g->cb_connection, w, XCB_CW_EVENT_MASK,
+            &event_mask);
+    tree = xcb_query_tree_reply(g->cb_connection,
+            xcb_query_tree(g->cb_connection, w), &error);
+    if (!tree) {
+        /* destroyed by someone else in the meantime */
+        free(error);
+        if (!owner_has_windows(g, window_owner(g, w), w))
+            release_retained_client(g, window_owner(g, w));
+        free(rw);
+        return None;
+    }
+    /* pid, user time window etc. of this instance */
+    set_window_props(g, w);
+    vm_window->adopted = true;
+    vm_window->local_winid = w;
+    if (tree->parent != g->root_win) {
+        vm_window->local_frame_winid = tree->parent;
+        frame_track(g, vm_window);
+    }
+    free(tree);
+    /* the geometry in MSG_CREATE is what the VM has now */
+    XMoveResizeWindow(g->display, w, vm_window->x, vm_window->y,
+            vm_window->width, vm_window->height);
+    free(rw);
+    return w;
+}
+
 /* handle VM message: MSG_CREATE
  * checks given attributes and create appropriate window in local Xserver
  * (using mkwindow) */
@@ -2954,10 +3784,17 @@ static void handle_create(Ghandles * g, XID window)
         exit(1);
     }
     vm_window->transient_for = NULL;
-    vm_window->local_winid = mkwindow(&ghandles, vm_window);
+    vm_window->local_winid = adopt_window(g, vm_window);
+    if (vm_window->local_winid == None)
+        vm_window->local_winid = mkwindow(&ghandles, vm_window);
+    if (vm_window->remote_winid == FULLSCREEN_WINDOW_ID) {
+        /* whole screen window */
+        g->screen_window = vm_window;
+    }
     if (g->log_level > 0)
         fprintf(stderr,
-            "Created 0x%x(0x%x) ovr=%d x/y %d/%d w/h %d/%d\n",
+            "%s 0x%x(0x%x) ovr=%d x/y %d/%d w/h %d/%d\n",
+            vm_window->adopted ? "Adopted" : "Created",
             (int) vm_window->local_winid, (int) window,
             vm_window->override_redirect,
             vm_window->x, vm_window->y,
@@ -2967,6 +3804,7 @@ static void handle_create(Ghandles * g, XID window)
         fprintf(stderr, "list_insert(g->wid2windowdata failed\n");
         exit(1);
     }
+    update_root_events(g);
 
     /* do not allow to hide color frame off the screen */
     if (vm_window->override_redirect
@@ -2996,6 +3834,19 @@ static void check_window_references(Ghandles * g, struct windowdata *vm_window)
     }
 }
 
+/* forget a delayed title update, e.g. when the window is destroyed */
+static void cancel_title_update(Ghandles * g, struct windowdata *vm_window)
+{
+    struct genlist *item;
+
+    if (!vm_window->title_pending)
+        return;
+    item = list_lookup(g->title_updates, vm_window->local_winid);
+    if (item)
+        list_remove(item);
+    vm_window->title_pending = false;
+}
+
 /* handle VM message: MSG_DESTROY
  * destroy window locally, as requested */
 static void handle_destroy(Ghandles * g, struct genlist *l)
@@ -3005,14 +3856,22 @@ static void handle_destroy(Ghandles * g, struct genlist *l)
     /* check if this window is referenced anywhere */
     check_window_references(g, vm_window);
     /* then destroy */
-    XDestroyWindow(g->display, vm_window->local_winid);
+    if (vm_window->adopted)
+        destroy_adopted_window(g, vm_window->local_winid);
+    else
+        XDestroyWindow(g->display, vm_window->local_winid);
     if (g->log_level > 0)
         fprintf(stderr, " XDestroyWindow 0x%x\n",
             (int) vm_window->local_winid);
     release_mapped_mfns(g, vm_window);
+    tray_cache_free(g, vm_window);
+    frame_untrack(g, vm_window);
+    cancel_wm_state_read(g, vm_window);
+    cancel_title_update(g, vm_window);
     l2 = list_lookup(g->wid2windowdata, vm_window->local_winid);
     list_remove(l);
     list_remove(l2);
+    update_root_events(g);
     if (vm_window == g->screen_window)
         g->screen_window = NULL;
     /* Inform the agent that the window has been destroyed.
@@ -3029,121 +3888,70 @@ static void handle_destroy(Ghandles * g, struct genlist *l)
     free(vm_window);
 }
 
-/* validate single UTF-8 character
- * return bytes count of this character, or 0 if the character is invalid */
-static int validate_utf8_char(unsigned char *untrusted_c) {
-    int tails_count = 0;
-    int total_size = 0;
-    /* it is safe to access byte pointed by the parameter and the next one
-     * (which can be terminating NULL), but every next byte can access only if
-     * neither of previous bytes was NULL
-     */
-
-    /* According to http://www.ietf.org/rfc/rfc3629.txt:
-     *   UTF8-char   = UTF8-1 / UTF8-2 / UTF8-3 / UTF8-4
-     *   UTF8-1      = %x00-7F
-     *   UTF8-2      = %xC2-DF UTF8-tail
-     *   UTF8-3      = %xE0 %xA0-BF UTF8-tail / %xE1-EC 2( UTF8-tail ) /
-     *                 %xED %x80-9F UTF8-tail / %xEE-EF 2( UTF8-tail )
-     *   UTF8-4      = %xF0 %x90-BF 2( UTF8-tail ) / %xF1-F3 3( UTF8-tail ) /
-     *                 %xF4 %x80-8F 2( UTF8-tail )
-     *   UTF8-tail   = %x80-BF
-     */
-
-    if (*untrusted_c <= 0x7F) {
-        return 1;
-    } else if (*untrusted_c >= 0xC2 && *untrusted_c <= 0xDF) {
-        total_size = 2;
-        tails_count = 1;
-    } else switch (*untrusted_c) {
-        case 0xE0:
-            untrusted_c++;
-            total_size = 3;
-            if (*untrusted_c >= 0xA0 && *untrusted_c <= 0xBF)
-                tails_count = 1;
-            else
-                return 0;
-            break;
-        case 0xE1: case 0xE2: case 0xE3: case 0xE4:
-        case 0xE5: case 0xE6: case 0xE7: case 0xE8:
-        case 0xE9: case 0xEA: case 0xEB: case 0xEC:
-            /* 0xED */
-        case 0xEE:
-        case 0xEF:
-            total_size = 3;
-            tails_count = 2;
-            break;
-        case 0xED:
-            untrusted_c++;
-            total_size = 3;
-            if (*untrusted_c >= 0x80 && *untrusted_c <= 0x9F)
-                tails_count = 1;
-            else
-                return 0;
-            break;
-        case 0xF0:
-            untrusted_c++;
-            total_size = 4;
-            if (*untrusted_c >= 0x90 && *untrusted_c <= 0xBF)
-                tails_count = 2;
-            else
-                return 0;
-            break;
-        case 0xF1:
-        case 0xF2:
-        case 0xF3:
-            total_size = 4;
-            tails_count = 3;
-            break;
-        case 0xF4:
-            untrusted_c++;
-            if (*untrusted_c >= 0x80 && *untrusted_c <= 0x8F)
-                tails_count = 2;
-            else
-                return 0;
-            break;
-        default:
-            return 0;
-    }
+/* set already sanitized title on the window */
+static void set_window_title(Ghandles * g, struct windowdata *vm_window,
+        const char *title, int64_t now)
+{
+    XTextProperty text_prop;
+    char buf[sizeof(vm_window->title) + sizeof(g->vmname) + 3];
+    char *list[1] = { buf };
 
-    while (tails_count-- > 0) {
-        untrusted_c++;
-        if (!(*untrusted_c >= 0x80 && *untrusted_c <= 0xBF))
-            return 0;
-    }
-    return total_size;
+    if (g->prefix_titles)
+        snprintf(buf, sizeof(buf), "[%s] %s", g->vmname, title);
+    else
+        snprintf(buf, sizeof(buf), "%s", title);
+    if (g->log_level > 1)
+        fprintf(stderr, "set title for window 0x%x\n",
+            (int) vm_window->local_winid);
+    Xutf8TextListToTextProperty(g->display, list, 1, XUTF8StringStyle,
+                    &text_prop);
+    XSetWMName(g->display, vm_window->local_winid, &text_prop);
+    XChangeProperty(g->display, vm_window->local_winid, g->net_wm_name,
+        g->utf8_string, 8, PropModeReplace, (unsigned char *) buf, strlen(buf));
+    XSetWMIconName(g->display, vm_window->local_winid, &text_prop);
+    XChangeProperty(g->display, vm_window->local_winid, g->net_wm_icon_name,
+        g->utf8_string, 8, PropModeReplace, (unsigned char *) buf, strlen(buf));
+    XFree(text_prop.value);
+    strcpy(vm_window->title, title);
+    if (g->title_max_rate)
+        vm_window->title_next_update = now + 1000000000LL / g->title_max_rate;
 }
 
-/* replace non-printable characters with '_'
- * given string must be NULL terminated already */
-static void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8)
+/* set delayed titles that are due; returns when the next one is due, or
+ * INT64_MAX if there is none */
+static int64_t release_title_updates(Ghandles * g)
 {
-    int utf8_ret;
-    for (; *untrusted_s; untrusted_s++) {
-        // allow only non-control ASCII chars
-        if (*untrusted_s >= 0x20 && *untrusted_s <= 0x7E)
+    struct genlist *item, *next;
+    int64_t now, next_update = INT64_MAX;
+
+    if (g->title_updates->next == g->title_updates)
+        return next_update;
+    now = ebuf_current_time_ns();
+    for (item = g->title_updates->next; item != g->title_updates; item = next) {
+        struct windowdata *vm_window = item->data;
+
+        next = item->next;
+        if (vm_window->title_next_update > now) {
+            if (vm_window->title_next_update < next_update)
+                next_update = vm_window->title_next_update;
             continue;
-        if (allow_utf8 && *untrusted_s >= 0x80) {
-            utf8_ret = validate_utf8_char(untrusted_s);
-            if (utf8_ret > 0) {
-                /* loop will do one additional increment */
-                untrusted_s += utf8_ret - 1;
-                continue;
-            }
         }
-        *untrusted_s = '_';
+        list_remove(item);
+        vm_window->title_pending = false;
+        set_window_title(g, vm_window, vm_window->pending_title, now);
     }
+    return next_update;
 }
 
 /* handle VM message: MSG_WMNAME
- * remove non-printable characters and pass to X server */
+ * remove non-printable characters and pass to X server; the same title is
+ * not set again, and changes faster than title_max_rate are merged, only the
+ * latest title is set once the limit allows it */
 static void handle_wmname(Ghandles * g, struct windowdata *vm_window)
 {
-    XTextProperty text_prop;
     struct msg_wmname untrusted_msg;
-    char buf[sizeof(untrusted_msg.data) + sizeof(g->vmname) + 3];
     size_t name_len;
-    char *list[1] = { buf };
+    int64_t now;
 
     read_struct(g->vchan, untrusted_msg);
     /* sanitize start */
@@ -3157,24 +3965,32 @@ static void handle_wmname(Ghandles * g, struct windowdata *vm_window)
     }
     sanitize_string_from_vm((unsigned char *) (untrusted_msg.data),
                 g->allow_utf8_titles);
-
-    if (g->prefix_titles)
-        snprintf(buf, sizeof(buf), "[%s] %s", g->vmname, untrusted_msg.data);
-    else
-        snprintf(buf, sizeof(buf), "%s", untrusted_msg.data);
     /* sanitize end */
-    if (g->log_level > 1)
-        fprintf(stderr, "set title for window 0x%x\n",
-            (int) vm_window->local_winid);
-    Xutf8TextListToTextProperty(g->display, list, 1, XUTF8StringStyle,
-                    &text_prop);
-    XSetWMName(g->display, vm_window->local_winid, &text_prop);
-    XChangeProperty(g->display, vm_window->local_winid, g->net_wm_name,
-        g->utf8_string, 8, PropModeReplace, (unsigned char *) buf, strlen(buf));
-    XSetWMIconName(g->display, vm_window->local_winid, &text_prop);
-    XChangeProperty(g->display, vm_window->local_winid, g->net_wm_icon_name,
-        g->utf8_string, 8, PropModeReplace, (unsigned char *) buf, strlen(buf));
-    XFree(text_prop.value);
+    if (vm_window->title_set &&
+            strcmp(untrusted_msg.data, vm_window->title) == 0) {
+        /* back to the current title, drop the delayed one, if any */
+        if (vm_window->title_pending)
+            cancel_title_update(g, vm_window);
+        g->stats.titles_suppressed++;
+        return;
+    }
+    now = ebuf_current_time_ns();
+    if (g->title_max_rate && vm_window->title_set &&
+            now < vm_window->title_next_update) {
+        if (vm_window->title_pending) {
+            g->stats.titles_suppressed++;
+        } else {
+            if (!list_insert(g->title_updates, vm_window->local_winid, vm_window)) {
+                fprintf(stderr, "list_insert(g->title_updates) failed\n");
+                exit(1);
+            }
+            vm_window->title_pending = true;
+        }
+        strcpy(vm_window->pending_title, untrusted_msg.data);
+        return;
+    }
+    set_window_title(g, vm_window, untrusted_msg.data, now);
+    vm_window->title_set = true;
 }
 
 /* handle VM message: MSG_WMCLASS
@@ -3411,91 +4227,71 @@ static void handle_wmflags(Ghandles * g, struct windowdata *vm_window)
 }
 
 
-/* Check if we should keep this window on top of others */
-static bool should_keep_on_top(Ghandles *g, Window window) {
-    int ret;
-    XWindowAttributes attr;
-    XClassHint hint;
-    bool result;
-    int i;
-
-    /* Check if the window has override_redirect attribute, and is mapped. */
-    ret = XGetWindowAttributes(g->display, window, &attr);
-    if (!(ret && attr.override_redirect && attr.map_state == IsViewable))
-        return false;
-
-    /* Check if this is a dom0 screensaver window by looking at window class.
-     * (VM windows have a prefix, so this is not spoofable by a VM). */
-    ret = XGetClassHint(g->display, window, &hint);
-    if (!ret)
-        return false;
-
-    result = false;
-    for (i = 0; i < MAX_SCREENSAVER_NAMES && g->screensaver_names[i]; i++) {
-        if (strcmp(hint.res_name, g->screensaver_names[i]) == 0) {
-            result = true;
-            break;
-        }
+/* The stacking order cache knows only events already read; a screen locker
+ * mapped just now may still have its MapNotify in the socket. Make a round
+ * trip, so all events generated before it are queued, and handle them. */
+static void stacking_sync(Ghandles *g)
+{
+    xcb_generic_event_t *event;
+    int64_t recv_ns;
+
+    free(xcb_get_input_focus_reply(g->cb_connection,
+                xcb_get_input_focus(g->cb_connection), NULL));
+    recv_ns = stats_now_ns();
+    /* only the already queued events, do not wait for more */
+    while ((event = xcb_poll_for_queued_event(g->cb_connection))) {
+        if (event->response_type == 0)
+            process_xcb_error(g, (xcb_generic_error_t *)event);
+        else
+            process_xevent(g, event, recv_ns);
+        free(event);
     }
-
-    XFree(hint.res_name);
-    XFree(hint.res_class);
-    return result;
 }
 
-
 /* Move a newly mapped override_redirect window below windows that need to be
  * kept on top, i.e. screen lockers. Returns new index (-1 == top of all) */
 static int restack_windows(Ghandles *g, struct windowdata *vm_window)
 {
-    Window root;
-    Window parent;
-    Window *children_list;
-    unsigned int children_count;
-    int i, current_pos, goal_pos;
+    struct genlist *item, *goal;
+    int i, goal_pos;
 
-    /* Find all windows below parent */
-
-    XQueryTree(g->display, g->root_win, &root, &parent, &children_list, &children_count);
-
-    if (!children_list) {
-        fprintf(stderr, "XQueryTree returned an empty list\n");
-        return 0;
-    }
+    stacking_sync(g);
 
-    /* Traverse children_list, looking for bottom-most window that
+    /* Traverse the stacking order cache, looking for bottom-most window that
      * need to be kept on top. The list is bottom-to-top, so we record only the
-     * first such window, and break as soon as we encounter our own window. */
+     * first such window, and break as soon as we encounter our own window.
+     * If our window is not there yet (CreateNotify not processed), it
+     * was just created, so it is on top. */
 
-    current_pos = -1;
+    goal = NULL;
     goal_pos = -1;
-    for (i = 0; i < (int) children_count; i++) {
-        if (children_list[i] == vm_window->local_winid) {
-            current_pos = i;
+    i = 0;
+    list_for_each(item, g->stacking) {
+        if ((Window)item->key == vm_window->local_winid)
             break;
-        } else if (goal_pos == -1 && should_keep_on_top(g, children_list[i]))
+        else if (!goal && stacking_keep_on_top(g, item->data)) {
+            goal = item;
             goal_pos = i;
+        }
+        i++;
     }
 
     /* Reorder if needed */
 
-    if (current_pos != -1 && goal_pos != -1) {
+    if (goal) {
         Window to_restack[2];
 
-        assert(current_pos > goal_pos);
-
         if (g->log_level > 0) {
             fprintf(stderr, "restack_windows: moving window 0x%x deeper\n",
                     (int) vm_window->local_winid);
         }
 
-        to_restack[0] = children_list[goal_pos];
+        to_restack[0] = (Window)goal->key;
         to_restack[1] = vm_window->local_winid;
 
         XRestackWindows(g->display, to_restack, 2);
     }
 
-    XFree(children_list);
     return goal_pos;
 }
 
@@ -3613,6 +4409,7 @@ static void inter_appviewer_lock(Ghandles *g, int mode)
 /* release shared memory connected with given window */
 static void release_mapped_mfns(Ghandles * g, struct windowdata *vm_window)
 {
+    tray_cache_release_image(vm_window);
     if (g->invisible || vm_window->shmseg == QUBES_NO_SHM_SEGMENT)
         return;
     check_xcb_void(
@@ -3676,6 +4473,7 @@ qubes_xcb_send_xen_fd(Ghandles *g,
                     (uint64_t)gref->index);
         s->off = gref->index;
         free(gref);
+        tray_cache_set_image(g, vm_window, s->refs, s->count);
     }
     memcpy(g->shm_args, shm_args, shm_args_len);
     memset(((uint8_t *) g->shm_args) + shm_args_len, 0,
@@ -3925,14 +4723,12 @@ msg_too_short_error(const char *msg, uint32_t untrusted_len, size_t expected_len
 }
 
 /* VM message dispatcher */
-static void handle_message(Ghandles * g)
+static void dispatch_message(Ghandles * g, struct msg_hdr untrusted_hdr)
 {
-    struct msg_hdr untrusted_hdr;
     XID window = 0;
     struct genlist *l;
     struct windowdata *vm_window = NULL;
 
-    read_struct(g->vchan, untrusted_hdr);
     uint32_t untrusted_len = untrusted_hdr.untrusted_len;
     uint32_t const untrusted_type = untrusted_hdr.type;
     if (untrusted_type == MSG_CLIPBOARD_DATA) {
@@ -4036,6 +4832,22 @@ static void handle_message(Ghandles * g)
     }
 }
 
+/* read a message from VM and handle it, collecting statistics */
+static void handle_message(Ghandles * g)
+{
+    struct msg_hdr untrusted_hdr;
+    int64_t start;
+    unsigned long start_request;
+
+    read_struct(g->vchan, untrusted_hdr);
+    start = stats_now_ns();
+    start_request = XNextRequest(g->display);
+    dispatch_message(g, untrusted_hdr);
+    stats_account_message(&g->stats, untrusted_hdr.type,
+            untrusted_hdr.untrusted_len, stats_now_ns() - start,
+            XNextRequest(g->display) - start_request);
+}
+
 /* helper to get a file flag path */
 static char *guid_fs_flag(const char *type, int domid)
 {
@@ -4064,6 +4876,39 @@ static void sighup_signal_handler(int UNUSED(x))
     ghandles.reload_requested = 1;
 }
 
+/* signal handler - connected to SIGUSR2 */
+static void sigusr2_signal_handler(int UNUSED(x))
+{
+    ghandles.stats_requested = 1;
+}
+
+/* dump runtime statistics to guid-stats.<domid> file */
+static void write_stats(Ghandles * g)
+{
+    char path[256];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s.tmp", guid_fs_flag("stats", g->domid));
+    file = fopen(path, "w");
+    if (!file) {
+        perror("Can not create stats file");
+        return;
+    }
+    stats_write_json(&g->stats, g->vmname, file);
+    if (fclose(file) != 0) {
+        perror("Can not write stats file");
+        unlink(path);
+        return;
+    }
+    if (rename(path, guid_fs_flag("stats", g->domid)) < 0)
+        perror("Can not rename stats file");
+}
+
+static void write_stats_at_exit(void)
+{
+    write_stats(&ghandles);
+}
+
 static void print_backtrace(void)
 {
     void *array[100];
@@ -4195,6 +5040,7 @@ static void wait_for_connection_in_parent(int *pipe_notify)
 enum {
     opt_trayicon_mode = 257,
     opt_screensaver_name = 258,
+    opt_record = 259,
 };
 
 struct option longopts[] = {
@@ -4218,6 +5064,7 @@ struct option longopts[] = {
     { "trayicon-mode", required_argument, NULL, opt_trayicon_mode },
     { "screensaver-name", required_argument, NULL, opt_screensaver_name },
     { "max-clipboard-size", required_argument, NULL, 'X' },
+    { "record", required_argument, NULL, opt_record },
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, 'V' },   // V is virtual and not a short option
     { 0, 0, 0, 0 },
@@ -4250,6 +5097,7 @@ static void usage(FILE *stream)
     fprintf(stream, " --trayicon-mode\ttrayicon coloring mode (see below); default: tint\n");
     fprintf(stream, " --screensaver-name\tscreensaver window name, can be repeated, default: xscreensaver\n");
     fprintf(stream, " --max-clipboard-size=SIZE\tmaximum clipboard size VM is allowed to send to global clipboard\n");
+    fprintf(stream, " --record=PATH\trecord raw GUI protocol stream to PATH, for replaying with qubes-guid-replay\n");
     fprintf(stream, " --help, -h\tshow command help\n");
     fprintf(stream, " --version\tshow protocol version\n");
     fprintf(stream, " --override-redirect=disabled\tdisable the “override redirect” flag (will likely break applications)\n");
@@ -4268,6 +5116,8 @@ static void usage(FILE *stream)
     fprintf(stream, "  tint+border1,tint+border2:\tsame as tint, but also add a border\n");
     fprintf(stream, "  tint+saturation50:\tsame as tint, but reduce icon saturation by 50%%\n");
     fprintf(stream, "  tint+whitehack:\tsame as tint, but change white pixels (0xffffff) to almost-white (0xfefefe)\n");
+    fprintf(stream, "  tint+render, bg+render:\tprocess icons on the X server side using the RENDER extension (no round trips);\n"
+                    "\ttinted colors differ slightly, not compatible with tint+whitehack\n");
     fprintf(stream, "\n");
 }
 
@@ -4345,7 +5195,7 @@ static void parse_cmdline_prop(Ghandles *g) {
                 if (value[i] == ',')
                     nelements++;
 
-            value_c = malloc(nelements * 4);
+            value_c = malloc(nelements * sizeof(*value_c));
             if (!value_c) {
                 fprintf(stderr, "Out of memory\n");
                 exit(1);
@@ -4376,7 +5226,8 @@ static void parse_cmdline_prop(Ghandles *g) {
 }
 
 static void parse_trayicon_mode(Ghandles *g, const char *mode_str) {
-    if (strcmp(mode_str, "bg") == 0) {
+    g->trayicon_render = strstr(mode_str, "+render") != NULL;
+    if (strcmp(mode_str, "bg") == 0 || strcmp(mode_str, "bg+render") == 0) {
         g->trayicon_mode = TRAY_BACKGROUND;
         g->trayicon_border = 0;
     } else if (strcmp(mode_str, "border1") == 0) {
@@ -4527,6 +5378,9 @@ static void parse_cmdline(Ghandles * g, int argc, char **argv)
             }
             g->screensaver_names[screensaver_name_num++] = strdup(optarg);
             break;
+        case opt_record:
+            g->record_path = optarg;
+            break;
         case 'X':
             unsigned int value;
             if (sscanf(optarg, "%u", &value) != 1)
@@ -4583,10 +5437,12 @@ static void load_default_config_values(Ghandles * g)
     g->allow_fullscreen = 0;
     g->override_redirect_protection = 1;
     g->startup_timeout = 45;
+    g->title_max_rate = 10;
     g->trayicon_mode = TRAY_TINT;
     g->trayicon_border = 0;
     g->trayicon_tint_reduce_saturation = 0;
     g->trayicon_tint_whitehack = 0;
+    g->trayicon_render = 0;
     g->window_background_color_pre_parse = "white";
 }
 
@@ -4738,6 +5594,18 @@ static void parse_vm_config(Ghandles * g, config_setting_t * group)
         }
         g->ebuf_max_delay = delay_val;
     }
+
+    if ((setting =
+         config_setting_get_member(group, "title_max_rate"))) {
+        int rate = config_setting_get_int(setting);
+        if (rate < 0 || rate > 1000) {
+            fprintf(stderr,
+                    "unsupported value '%d' for title_max_rate (must be >= 0 and <= 1000)",
+                    rate);
+            exit(1);
+        }
+        g->title_max_rate = rate;
+    }
 }
 
 static void parse_config(Ghandles * g)
@@ -4826,14 +5694,273 @@ static void get_boot_lock(int domid)
 }
 
 static void cleanup() {
+    vchan_record_close();
     XFree(ghandles.hostname.value);
     XCloseDisplay(ghandles.display);
     unset_alive_flag();
     close(ghandles.inter_appviewer_lock_fd);
 }
 
+/* Window table passed to the restarted guid, in a memfd whose number is in
+ * GUID_STATE_FD_ENV: struct guid_state_hdr, nclients resources of retained
+ * X clients (uint32_t) and nwindows struct guid_state_window. */
+#define GUID_STATE_FD_ENV "QUBES_GUID_STATE_FD"
+#define GUID_STATE_MAGIC 0x33534751 /* "QGS3" */
+#define GUID_STATE_MAX_CLIENTS 1024
+#define GUID_STATE_MAX_WINDOWS 65536
+/* restored windows not created again by the VM by then are destroyed, and
+ * adopted ones not mapped again by then are unmapped */
+#define RESTORE_TIMEOUT_NS (10 * 1000000000LL)
+
+struct guid_state_hdr {
+    uint32_t magic;
+    uint32_t nclients;
+    uint32_t nwindows;
+};
+
+struct guid_state_window {
+    uint32_t remote_winid;
+    uint32_t local_winid;
+    uint32_t override_redirect;
+};
+
+/* Keep the local windows for the restarted guid: serialize the window table
+ * and let the X server retain our resources after the connection is
+ * closed. Without it, the windows are simply recreated. */
+static void save_state_for_restart(Ghandles * g)
+{
+    struct guid_state_hdr hdr = { .magic = GUID_STATE_MAGIC };
+    struct guid_state_window *windows;
+    uint32_t *clients;
+    struct genlist *item;
+    const uint32_t no_events = 0;
+    size_t max_windows = 0, size;
+    char fd_str[16];
+    char *buf;
+    int fd;
+
+    list_for_each(item, g->wid2windowdata)
+        max_windows++;
+    list_for_each(item, g->restored_windows)
+        max_windows++;
+    if (!max_windows || max_windows > GUID_STATE_MAX_WINDOWS ||
+            g->retained_clients_count >= GUID_STATE_MAX_CLIENTS)
+        return;
+    size = sizeof(hdr) + (g->retained_clients_count + 1) * sizeof(*clients) +
+        max_windows * sizeof(*windows);
+    buf = calloc(1, size);
+    if (!buf) {
+        perror("calloc(guid state)");
+        return;
+    }
+    clients = (uint32_t *)(buf + sizeof(hdr));
+    windows = (struct guid_state_window *)
+        (clients + g->retained_clients_count + 1);
+    list_for_each(item, g->wid2windowdata) {
+        struct windowdata *vm_window = item->data;
+        struct guid_state_window *w = &windows[hdr.nwindows];
+
+        /* tray icons are embedded again by the VM */
+        if (vm_window->is_docked)
+            continue;
+        w->remote_winid = vm_window->remote_winid;
+        w->local_winid = vm_window->local_winid;
+        w->override_redirect = !!vm_window->override_redirect;
+        hdr.nwindows++;
+    }
+    list_for_each(item, g->restored_windows) {
+        struct restored_window *rw = item->data;
+        struct guid_state_window *w = &windows[hdr.nwindows++];
+
+        w->remote_winid = item->key;
+        w->local_winid = rw->local_winid;
+        w->override_redirect = rw->override_redirect;
+    }
+    if (!hdr.nwindows)
+        goto out;
+    memcpy(clients, g->retained_clients,
+            g->retained_clients_count * sizeof(*clients));
+    clients[g->retained_clients_count] = XGContextFromGC(g->context);
+    hdr.nclients = g->retained_clients_count + 1;
+    memcpy(buf, &hdr, sizeof(hdr));
+    size = sizeof(hdr) + hdr.nclients * sizeof(*clients) +
+        hdr.nwindows * sizeof(*windows);
+
+    /* not O_CLOEXEC, it is inherited by the new image */
+    fd = memfd_create("qubes-guid-state", 0);
+    if (fd < 0) {
+        perror("memfd_create");
+        goto out;
+    }
+    if (write(fd, buf, size) != (ssize_t)size || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("write guid state");
+        close(fd);
+        goto out;
+    }
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    if (setenv(GUID_STATE_FD_ENV, fd_str, 1) < 0) {
+        perror("setenv");
+        close(fd);
+        goto out;
+    }
+    list_for_each(item, g->wid2windowdata) {
+        struct windowdata *vm_window = item->data;
+
+        if (vm_window->is_docked) {
+            XDestroyWindow(g->display, vm_window->local_winid);
+            continue;
+        }
+        /* left mapped, so the window manager keeps its frame, desktop and
+         * state; the content stays until the VM draws it again */
+        if (!vm_window->adopted)
+            /* events (ButtonPress in particular) can be selected by only
+             * one client, release them for the new instance */
+            xcb_change_window_attributes(g->cb_connection,
+                    vm_window->local_winid, XCB_CW_EVENT_MASK, &no_events);
+    }
+    XSetCloseDownMode(g->display, RetainTemporary);
+    fprintf(stderr, "passing %u windows to the restarted guid\n", hdr.nwindows);
+out:
+    free(buf);
+}
+
+/* read the window table of the previous instance, see
+ * save_state_for_restart() */
+static void restore_state(Ghandles * g)
+{
+    const char *fd_str = getenv(GUID_STATE_FD_ENV);
+    struct guid_state_hdr hdr;
+    struct guid_state_window *windows = NULL;
+    uint32_t *clients = NULL;
+    unsigned i;
+    int fd;
+
+    if (!fd_str)
+        return;
+    fd = atoi(fd_str);
+    /* not for our children */
+    unsetenv(GUID_STATE_FD_ENV);
+    if (fd <= 2)
+        return;
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            hdr.magic != GUID_STATE_MAGIC ||
+            hdr.nclients > GUID_STATE_MAX_CLIENTS ||
+            hdr.nwindows > GUID_STATE_MAX_WINDOWS) {
+        fprintf(stderr, "invalid state of the previous instance, ignoring\n");
+        goto out;
+    }
+    clients = calloc(hdr.nclients, sizeof(*clients));
+    windows = calloc(hdr.nwindows, sizeof(*windows));
+    if ((hdr.nclients && !clients) || (hdr.nwindows && !windows)) {
+        perror("calloc(guid state)");
+        exit(1);
+    }
+    if (read(fd, clients, hdr.nclients * sizeof(*clients)) !=
+            (ssize_t)(hdr.nclients * sizeof(*clients)) ||
+        read(fd, windows, hdr.nwindows * sizeof(*windows)) !=
+            (ssize_t)(hdr.nwindows * sizeof(*windows))) {
+        fprintf(stderr, "truncated state of the previous instance, ignoring\n");
+        goto out;
+    }
+    g->retained_clients = clients;
+    g->retained_clients_count = hdr.nclients;
+    clients = NULL;
+    for (i = 0; i < hdr.nwindows; i++) {
+        const struct guid_state_window *w = &windows[i];
+        struct restored_window *rw;
+
+        if (list_lookup(g->restored_windows, w->remote_winid))
+            continue;
+        rw = malloc(sizeof(*rw));
+        if (!rw) {
+            perror("malloc(restored_window)");
+            exit(1);
+        }
+        rw->local_winid = w->local_winid;
+        rw->override_redirect = w->override_redirect;
+        if (!list_insert(g->restored_windows, w->remote_winid, rw)) {
+            fprintf(stderr, "list_insert(g->restored_windows) failed\n");
+            exit(1);
+        }
+    }
+    /* clients left without windows are not needed anymore */
+    for (i = 0; i < g->retained_clients_count; ) {
+        uint32_t owner = window_owner(g, g->retained_clients[i]);
+
+        if (owner_has_windows(g, owner, None))
+            i++;
+        else
+            release_retained_client(g, owner);
+    }
+    fprintf(stderr, "got %u windows from the previous instance\n", hdr.nwindows);
+out:
+    free(clients);
+    free(windows);
+    close(fd);
+}
+
+/* destroy all windows of the previous instance not adopted yet */
+static void discard_restored_windows(Ghandles * g)
+{
+    struct genlist *item;
+
+    while ((item = g->restored_windows->next) != g->restored_windows) {
+        struct restored_window *rw = item->data;
+
+        list_remove(item);
+        destroy_adopted_window(g, rw->local_winid);
+        free(rw);
+    }
+}
+
+/* destroy restored windows the VM did not create again in time, and unmap
+ * adopted ones it did not map; returns when to check next, or INT64_MAX if
+ * there is nothing to wait for */
+static int64_t expire_restored_windows(Ghandles * g)
+{
+    struct genlist *item;
+
+    if (g->restore_deadline == INT64_MAX)
+        return INT64_MAX;
+    if (ebuf_current_time_ns() < g->restore_deadline)
+        return g->restore_deadline;
+    g->restore_deadline = INT64_MAX;
+    discard_restored_windows(g);
+    list_for_each(item, g->wid2windowdata) {
+        struct windowdata *vm_window = item->data;
+
+        if (vm_window->adopted && !vm_window->is_mapped &&
+                !vm_window->is_docked)
+            XUnmapWindow(g->display, vm_window->local_winid);
+    }
+    return INT64_MAX;
+}
+
+/* the windows of previous instances are not destroyed with our connection */
+static void release_retained_clients(void)
+{
+    Ghandles *g = &ghandles;
+
+    if (x11_connection_lost || !g->retained_clients_count)
+        return;
+    while (g->retained_clients_count)
+        XKillClient(g->display, g->retained_clients[--g->retained_clients_count]);
+    XFlush(g->display);
+}
+
+/* also called when the double buffer is flushed before sleeping, so
+ * input held back by the agent is not charged with the sleep */
+static void input_sent_at_flush(uint64_t bytes_sent)
+{
+    stats_input_sent(&ghandles.stats, bytes_sent);
+}
+
 static char** restart_argv;
 static void restart_guid() {
+    save_state_for_restart(&ghandles);
+    /* atexit() handlers do not run across execv() */
+    write_stats_at_exit();
+    vchan_record_keep_for_restart();
     cleanup();
     execv("/usr/bin/qubes-guid", restart_argv);
     perror("execv");
@@ -4842,17 +5969,19 @@ static void restart_guid() {
 int main(int argc, char **argv)
 {
     int xfd;
+    pid_t keymap_pid = -1;
     int childpid;
     int pipe_notify[2];
     char dbg_log[256];
     char dbg_log_old[256];
     char shmid_filename[SHMID_FILENAME_LEN];
     int logfd;
-    char cmd_tmp[256];
     struct stat stat_buf;
     char *display_str;
     int display_num;
 
+    /* startup phases are timed from here */
+    stats_init(&ghandles.stats);
     load_default_config_values(&ghandles);
     /* get the config file path first */
     parse_cmdline_config_path(&ghandles, argc, argv);
@@ -4860,9 +5989,9 @@ int main(int argc, char **argv)
     parse_config(&ghandles);
     /* parse cmdline, possibly overriding values from config */
     parse_cmdline(&ghandles, argc, argv);
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_CONFIG);
     get_boot_lock(ghandles.domid);
-    /* init event queue */
-    TAILQ_INIT(&(ghandles.ebuf_head));
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_BOOT_LOCK);
 
     if (!ghandles.nofork) {
         // daemonize...
@@ -4975,15 +6104,35 @@ int main(int argc, char **argv)
         perror("setsid()");
         exit(1);
     }
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_DAEMONIZE);
+    stats_startup_log(&ghandles.stats);
     mkghandles(&ghandles);
+    restore_state(&ghandles);
+    atexit(release_retained_clients);
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_X_CONNECT);
     XSetErrorHandler(x11_error_handler);
     default_x11_io_error_handler = XSetIOErrorHandler(x11_io_error_handler);
+
+    /* provide keyboard map before VM Xserver starts (on MSG_XCONF); it is
+     * written while connecting to the agent */
+    if (access(QUBES_RELEASE, F_OK) != -1) {
+        /* don't fail gui-daemon if only keyboard layout fails */
+        keymap_pid = export_keymap_start(ghandles.display, ghandles.vmname);
+        ghandles.in_dom0 = true;
+    } else if (errno != ENOENT) {
+        perror("cannot determine if " QUBES_RELEASE " exists");
+        exit(1);
+    } else {
+        ghandles.in_dom0 = false;
+    }
+
     double_buffer_init();
     ghandles.vchan = libvchan_client_init(ghandles.domid, 6000);
     if (!ghandles.vchan) {
         fprintf(stderr, "Failed to connect to gui-agent\n");
         exit(1);
     }
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_VCHAN);
     atexit(vchan_close);
     /* drop root privileges */
     if (setgid(getgid()) < 0) {
@@ -4996,6 +6145,7 @@ int main(int argc, char **argv)
     }
     set_alive_flag(ghandles.domid);
     atexit(unset_alive_flag);
+    atexit(write_stats_at_exit);
 
     // let write return -EPIPE, instead of delivering a signal
     signal(SIGPIPE, SIG_IGN);
@@ -5009,6 +6159,7 @@ int main(int argc, char **argv)
     signal(SIGTERM, dummy_signal_handler);
     signal(SIGUSR1, dummy_signal_handler);
     signal(SIGHUP, sighup_signal_handler);
+    signal(SIGUSR2, sigusr2_signal_handler);
     atexit(print_backtrace);
 
     if (ghandles.kill_on_connect) {
@@ -5018,52 +6169,68 @@ int main(int argc, char **argv)
 
     xfd = ConnectionNumber(ghandles.display);
 
-    /* provide keyboard map before VM Xserver starts */
-
-    if (access(QUBES_RELEASE, F_OK) != -1) {
-        /* cast return value to unsigned, so (unsigned)-1 > sizeof(cmd_tmp) */
-        if ((unsigned)snprintf(cmd_tmp, sizeof(cmd_tmp), "/usr/bin/qubesdb-write -d %s "
-                 "/qubes-keyboard \"`/usr/bin/setxkbmap -print`\"",
-                 ghandles.vmname) < sizeof(cmd_tmp)) {
-            /* intentionally ignore return value - don't fail gui-daemon if only
-             * keyboard layout fails */
-            ignore_result(system(cmd_tmp));
-        }
-        ghandles.in_dom0 = true;
-    } else if (errno != ENOENT) {
-        perror("cannot determine if " QUBES_RELEASE " exists");
-        exit(1);
-    } else {
-        ghandles.in_dom0 = false;
-    }
     vchan_register_at_eof(restart_guid);
+    vchan_register_at_sent(input_sent_at_flush);
+
+    if (ghandles.record_path && vchan_record_open(ghandles.record_path) < 0)
+        err(1, "Cannot open recording file %s", ghandles.record_path);
 
     get_protocol_version(&ghandles);
+    stats_startup_phase(&ghandles.stats, STATS_STARTUP_PROTOCOL);
+    /* the VM X server reads the keyboard map when started on MSG_XCONF */
+    if (keymap_pid > 0) {
+        export_keymap_wait(keymap_pid);
+        stats_startup_phase(&ghandles.stats, STATS_STARTUP_KEYMAP);
+    }
+    /* the VM creates its windows again after the protocol negotiation */
+    if (ghandles.restored_windows->next != ghandles.restored_windows)
+        ghandles.restore_deadline = ebuf_current_time_ns() + RESTORE_TIMEOUT_NS;
     send_xconf(&ghandles);
 
     for (;;) {
         int busy;
+        int64_t deadline, restore_deadline;
         if (ghandles.reload_requested) {
             fprintf(stderr, "reloading X server parameters...\n");
             reload(&ghandles);
             ghandles.reload_requested = 0;
         }
+        if (ghandles.stats_requested) {
+            write_stats(&ghandles);
+            ghandles.stats_requested = 0;
+        }
         do {
             busy = 0;
-            if (XPending(ghandles.display)) {
-                process_xevent(&ghandles);
+            if (process_xevents(&ghandles)) {
+                busy = 1;
+            } else if (ghandles.current_desktop_pending ||
+                       ghandles.workarea_pending ||
+                       ghandles.wm_state_reads->next != ghandles.wm_state_reads) {
+                process_pending_property_reads(&ghandles);
                 busy = 1;
             }
             if (libvchan_data_ready(ghandles.vchan) >= (int)sizeof(struct msg_hdr)) {
                 handle_message(&ghandles);
                 busy = 1;
             }
-            if (ghandles.ebuf_max_delay > 0) {
-                ebuf_release_xevents(&ghandles);
-            }
+            /* released events may have requested property reads, resolve
+             * them before sleeping */
+            if (ghandles.ebuf_max_delay > 0 &&
+                    ebuf_release_xevents(&ghandles))
+                busy = 1;
         } while (busy);
+        deadline = release_title_updates(&ghandles);
+        restore_deadline = expire_restored_windows(&ghandles);
+        if (restore_deadline < deadline)
+            deadline = restore_deadline;
+        /* nothing else flushes the requests above before sleeping */
+        XFlush(ghandles.display);
         if (ghandles.ebuf_max_delay > 0) {
-            wait_for_vchan_or_argfd_once(ghandles.vchan, xfd, ghandles.ebuf_next_timeout);
+            wait_for_vchan_or_argfd_until(ghandles.vchan, xfd,
+                    deadline < ghandles.ebuf_next_release ?
+                    deadline : ghandles.ebuf_next_release);
+        } else if (deadline != INT64_MAX) {
+            wait_for_vchan_or_argfd_until(ghandles.vchan, xfd, deadline);
         } else {
             wait_for_vchan_or_argfd_once(ghandles.vchan, xfd, VCHAN_DEFAULT_POLL_DURATION);
         }
@@ -84,14 +84,16 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <unistd.h>
-#include <sys/queue.h>
 #include <libvchan.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
 #include <xcb/shm.h>
 #include <qubes-gui-protocol.h>
 #include "util.h"
+#include "stats.h"
+#include "hotpath.h"
 
 #define QUBES_POLICY_EVAL_SIMPLE_SOCKET ("/etc/qubes-rpc/" QUBES_SERVICE_EVAL_SIMPLE)
 #define QREXEC_PRELUDE_CLIPBOARD_PASTE (QUBES_SERVICE_EVAL_SIMPLE "+" QUBES_SERVICE_CLIPBOARD_PASTE " dom0 keyword adminvm")
@@ -108,6 +110,8 @@ enum trayicon_mode {
 };
 
 /* per-window data */
+struct tray_cache;
+
 struct windowdata {
     unsigned width;
     unsigned height;
@@ -118,6 +122,13 @@ struct windowdata {
     XID remote_winid;    /* window id on VM side */
     Window local_winid;    /* window id on X side */
     Window local_frame_winid; /* window id of frame window created by window manager */
+    /* frame window geometry, tracked from its ConfigureNotify events to
+     * compute root coordinates without XTranslateCoordinates(); valid only
+     * if frame_tracked (frame is a direct child of the root window) */
+    bool frame_tracked;
+    int frame_x, frame_y;           /* position of frame content in root */
+    int frame_child_x, frame_child_y; /* position of our window content in frame */
+    unsigned frame_translations;    /* computed locally since the last check */
     struct windowdata *transient_for;    /* transient_for hint for WM, see http://tronche.com/gui/x/icccm/sec-4.html#WM_TRANSIENT_FOR */
     int override_redirect;    /* see http://tronche.com/gui/x/xlib/window/attributes/override-redirect.html */
     xcb_shm_seg_t shmseg; /* X Shared Memory segment, or ((xcb_shm_seg_t)-1) if there is none */
@@ -129,6 +140,22 @@ struct windowdata {
                                           request - translate it back when WM
                                           acknowledge maximize */
     uint32_t flags_set;    /* window flags acked to gui-agent */
+    xcb_get_property_cookie_t wm_state_cookie; /* _NET_WM_STATE read in flight */
+    bool wm_state_pending;  /* wm_state_cookie not yet resolved */
+    char title[sizeof(((struct msg_wmname *)0)->data)]; /* sanitized title, without VM name prefix */
+    char pending_title[sizeof(((struct msg_wmname *)0)->data)]; /* title to set at title_next_update */
+    bool title_set;         /* title is valid */
+    bool title_pending;     /* title update delayed by title_max_rate */
+    int64_t title_next_update; /* earliest time of the next title update, in ns */
+    struct tray_cache *tray_cache; /* tinted/masked tray icons, see trayicon.c */
+    bool adopted;           /* local window created by a previous guid instance */
+};
+
+/* local window left by the previous guid instance on restart, waiting for
+ * the VM to create its window again, see adopt_window() */
+struct restored_window {
+    Window local_winid;
+    bool override_redirect;
 };
 
 /* extra X11 property to set on every window, prepared parameters for
@@ -142,15 +169,22 @@ struct extra_prop {
     int nelements; /* data size, in "format" units */
 };
 
+/* property set on each created window, data in X protocol format (32-bit
+ * items for format 32), see prepare_window_props() */
+struct window_prop {
+    xcb_atom_t prop;
+    xcb_atom_t type;
+    uint8_t format;
+    uint32_t nelements;
+    void *data;
+};
+
+#define MAX_WINDOW_PROPS (MAX_EXTRA_PROPS + 16)
+
 struct ebuf_entry {
     XEvent xev;
     int64_t time;
-    TAILQ_ENTRY(ebuf_entry) entries;
-};
-
-union ebuf_rand {
-    uint32_t val;
-    char raw[sizeof(uint32_t)];
+    int64_t recv_ns; /* when it was received, for latency statistics */
 };
 
 /* global variables
@@ -168,9 +202,13 @@ struct _global_handles {
     GC context;        /* context for pixmap operations */
     GC frame_gc;        /* graphic context to paint window frame */
     GC tray_gc;        /* graphic context to paint tray background - only in TRAY_BACKGROUND mode */
+    GC tray_copy_gc;   /* graphic context to copy cached tray icons, without GraphicsExpose events */
     double tint_h;  /* precomputed H and S for tray coloring - only in TRAY_TINT mode */
     double tint_s;
+    struct tint_lut tint_lut; /* max+min of pixel channels -> tinted color */
+    tint_pixels_fn *tint_pixels; /* tinting kernel selected for this CPU */
     /* atoms for comunitating with xserver */
+    Atom wm_protocols;    /* Atom: WM_PROTOCOLS */
     Atom wmDeleteMessage;    /* Atom: WM_DELETE_WINDOW */
     Atom tray_selection;    /* Atom: _NET_SYSTEM_TRAY_SELECTION_S<creen number> */
     Atom tray_opcode;    /* Atom: _NET_SYSTEM_TRAY_MESSAGE_OPCODE */
@@ -213,17 +251,35 @@ struct _global_handles {
     int label_index;    /* label (frame color) hint for WM */
     struct windowdata *screen_window; /* window of whole VM screen */
     struct extra_prop extra_props[MAX_EXTRA_PROPS];
+    struct window_prop window_props[MAX_WINDOW_PROPS]; /* the same for all windows */
+    int window_props_count;
     /* lists of windows: */
     /*   indexed by remote window id */
     struct genlist *remote2local;
     /*   indexed by local window id */
     struct genlist *wid2windowdata;
+    /*   indexed by local frame window id (only frames with tracked geometry) */
+    struct genlist *frame2windowdata;
+    /*   indexed by local window id (windows with _NET_WM_STATE read in flight) */
+    struct genlist *wm_state_reads;
+    /*   indexed by window id, root window children in stacking order, bottom to top */
+    struct genlist *stacking;
+    /*   indexed by local window id (windows with delayed title update) */
+    struct genlist *title_updates;
+    /*   indexed by remote window id (windows of the previous instance, not adopted yet) */
+    struct genlist *restored_windows;
+    int64_t restore_deadline; /* see expire_restored_windows() */
+    /* X clients of previous instances, kept with RetainTemporary while they
+     * own a window; a resource of each (for XKillClient) */
+    uint32_t *retained_clients;
+    unsigned retained_clients_count;
     /* counters and other state */
     int clipboard_requested;    /* if clippoard content was requested by dom0 */
     Time clipboard_xevent_time;  /* timestamp of keypress which triggered last copy/paste */
     Window time_win; /* Window to set _NET_WM_USER_TIME on */
     /* signal was caught */
     int volatile reload_requested;
+    int volatile stats_requested;
     pid_t pulseaudio_pid;
     /* configuration */
     char config_path[64]; /* configuration file path (initialized to default) */
@@ -248,14 +304,25 @@ struct _global_handles {
     int trayicon_border; /* position of trayicon border - 0 - no border, 1 - at the edges, 2 - 1px from the edges */
     bool trayicon_tint_reduce_saturation; /* reduce trayicon saturation by 50% (available only for "tint" mode) */
     bool trayicon_tint_whitehack; /* replace white pixels with almost-white 0xfefefe (available only for "tint" mode) */
+    bool trayicon_render; /* process tray icons with RENDER extension on the X server side ("+render" modifier) */
+    Picture tray_tint_fill; /* RENDER Picture with the tint color - only with trayicon_render in TRAY_TINT mode */
     const char *window_background_color_pre_parse; /* user-provided description of window background pixel */
     unsigned long window_background_pixel;         /* parsed version of the above */
     bool disable_override_redirect; /* Disable “override redirect” windows */
     char *screensaver_names[MAX_SCREENSAVER_NAMES]; /* WM_CLASS names for windows detected as screensavers */
-    Cursor *cursors;  /* preloaded cursors (using XCreateFontCursor) */
+    Cursor *cursors;  /* cursors created so far (using XCreateFontCursor), None if not yet */
     xcb_connection_t *cb_connection; /**< XCB connection */
     xcb_gcontext_t gc; /**< XCB graphics context */
     int work_x, work_y, work_width, work_height;  /* do not allow a window to go beyond these bounds */
+    bool current_desktop_pending, workarea_pending; /* cookies below not yet resolved */
+    xcb_get_property_cookie_t current_desktop_cookie;
+    xcb_get_property_cookie_t workarea_cookie;
+    long current_desktop;   /* cached _NET_CURRENT_DESKTOP, -1 if not set */
+    uint32_t *workarea;     /* cached _NET_WORKAREA, all desktops */
+    unsigned workarea_len, workarea_size; /* items in workarea, allocated size */
+    uint8_t workarea_format; /* 0 if _NET_WORKAREA is not set */
+    xcb_atom_t workarea_type;
+    bool root_events_active; /* root PropertyChange and SubstructureNotify selected, see update_root_events() */
     Atom qubes_label, qubes_label_color, qubes_vmname, qubes_vmwindowid, net_wm_icon;
     bool in_dom0; /* true if we are in dom0, otherwise false */
     Atom net_supported;
@@ -263,10 +330,22 @@ struct _global_handles {
     int xen_dir_fd; /* file descriptor to /dev/xen */
     bool permit_subwindows : 1; /* Permit subwindows */
     uint32_t ebuf_max_delay;
-    /* ebuf state */
-    TAILQ_HEAD(tailhead, ebuf_entry) ebuf_head;
+    unsigned title_max_rate;    /* title updates per second for each window, 0 - no limit */
+    /* ebuf state - ring of queued events, grown when full */
+    struct ebuf_entry *ebuf;
+    size_t ebuf_size, ebuf_first, ebuf_count;
     int64_t ebuf_prev_release_time;
-    int ebuf_next_timeout;
+    int64_t ebuf_next_release; /* when to wake up for the next event, in ns */
+    struct chacha_rng ebuf_rng;
+    uint32_t ebuf_rng_left; /* random values left before reseeding */
+    /* keyboard state for MSG_KEYMAP_NOTIFY, tracked from key events */
+    char keymap[32];
+    bool keymap_focused; /* one of our windows has (ungrabbed) keyboard focus */
+    bool keymap_valid;   /* keymap is up to date */
+    bool keymap_notify_pending; /* send MSG_KEYMAP_NOTIFY on next KeymapNotify */
+    /* performance analysis */
+    const char *record_path; /* record vchan stream to this file */
+    struct guid_stats stats;
 };
 
 typedef struct _global_handles Ghandles;
@@ -22,8 +22,14 @@
 #ifndef _QUBES_TXRX_H
 #define _QUBES_TXRX_H
 
+#include <stdint.h>
 #include <libvchan.h>
 
+/* total bytes passed to write_data() and actually written to the vchan;
+ * the difference is waiting in the double buffer */
+extern uint64_t vchan_bytes_queued;
+extern uint64_t vchan_bytes_sent;
+
 int write_data(libvchan_t *vchan, char *buf, int size);
 int real_write_message(libvchan_t *vchan, char *hdr, int size, char *data, int datasize);
 int read_data(libvchan_t *vchan, char *buf, int size);
@@ -34,6 +40,13 @@ int read_data(libvchan_t *vchan, char *buf, int size);
     real_write_message(vchan, (char*)&x, sizeof(x), (char*)&y, sizeof(y)); \
     } while(0)
 int wait_for_vchan_or_argfd_once(libvchan_t *vchan, int fd, int timeout);
+/* same as above, but wait until given CLOCK_MONOTONIC time (in ns) */
+int wait_for_vchan_or_argfd_until(libvchan_t *vchan, int fd, int64_t deadline_ns);
 void vchan_register_at_eof(void (*new_vchan_at_eof)(void));
+void vchan_register_at_sent(void (*new_vchan_at_sent)(uint64_t bytes_sent));
+int vchan_record_open(const char *path);
+/* make the next vchan_record_open() after execv() append to the recording */
+void vchan_record_keep_for_restart(void);
+void vchan_record_close(void);
 
 #endif /* _QUBES_TXRX_H */
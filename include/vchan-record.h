@@ -0,0 +1,52 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _QUBES_VCHAN_RECORD_H
+#define _QUBES_VCHAN_RECORD_H
+
+#include <stdint.h>
+
+/* Recording of the raw vchan byte stream (qubes-guid --record=PATH).
+ *
+ * The file starts with VCHAN_RECORD_MAGIC, followed by chunks in the order
+ * they were seen by qubes-guid. Each chunk is a struct vchan_record_hdr
+ * followed by hdr.len bytes of data. A restarted qubes-guid appends to the
+ * same file, after a VCHAN_RECORD_NEW_SESSION chunk, with timestamps
+ * relative to the same start. Integers are in host byte order, the
+ * file is meant to be replayed on the same kind of machine.
+ */
+#define VCHAN_RECORD_MAGIC "QGUIREC1"
+#define VCHAN_RECORD_MAGIC_LEN 8
+
+enum vchan_record_dir {
+    VCHAN_RECORD_FROM_AGENT = 0,  /* read by qubes-guid */
+    VCHAN_RECORD_TO_AGENT = 1,    /* written by qubes-guid */
+    /* no data: qubes-guid restarted, the following chunks belong to a new
+     * vchan connection (starting with the protocol version again) */
+    VCHAN_RECORD_NEW_SESSION = 2,
+};
+
+struct vchan_record_hdr {
+    uint64_t time_ns;   /* CLOCK_MONOTONIC, relative to the start of recording */
+    uint32_t len;       /* data length */
+    uint8_t dir;        /* enum vchan_record_dir */
+    uint8_t pad[3];
+};
+
+#endif /* _QUBES_VCHAN_RECORD_H */